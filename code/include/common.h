@@ -4,6 +4,7 @@
 /* Define structs and routine could be used by every source files */
 
 #include <stdint.h>
+#include <sys/types.h> /* pthread_mutex_t; <pthread.h> would pull in our sched.h */
 
 #ifndef OSCFG_H
 #include "os-cfg.h"
@@ -78,6 +79,8 @@ struct pcb_t {
 // #endif
 // #ifdef CPU_TLB
 	struct memphy_struct *tlb;
+	uint32_t tlb_asid;     // Address space ID tagging this process' TLB entries
+	uint32_t tlb_asid_gen; // ASID generation, tlb_asid is stale if it lags
 // #endif
 // #ifdef MM_PAGING
 	struct mm_struct *mm;
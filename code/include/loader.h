@@ -5,5 +5,7 @@
 
 struct pcb_t * load(const char * path);
 
+void load_set_pid(uint32_t pid);
+
 #endif
 
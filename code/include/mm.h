@@ -3,6 +3,8 @@
 #include "bitops.h"
 #include "common.h"
 
+struct snap; /* snapshot.h */
+
 /* CPU Bus definition */
 #define PAGING_CPU_BUS_WIDTH 22 /* 22bit bus - MAX SPACE 4MB */
 #define PAGING_PAGESZ  256      /* 256B or 8-bits PAGE NUMBER */
@@ -13,14 +15,21 @@
 #define PAGING_SWPFPN_OFFSET 5  
 #define PAGING_MAX_PGN  (DIV_ROUND_UP(BIT(PAGING_CPU_BUS_WIDTH),PAGING_PAGESZ))
 
+/* Two level page table: the pgd points to leaf tables of PTEs, made
+ * when a page of their range is first mapped */
+#define PAGING_PTE_LEAF_BITS 8 /* 256 PTEs, 1KB per leaf */
+#define PAGING_PTE_LEAF_SZ   BIT(PAGING_PTE_LEAF_BITS)
+#define PAGING_PGD_SZ   (DIV_ROUND_UP(PAGING_MAX_PGN,PAGING_PTE_LEAF_SZ))
+#define PAGING_XLAT(mm,pgn) (&(mm)->xlat[(pgn)&(MM_XLAT_SZ-1)])
+
 #define PAGING_SBRK_INIT_SZ PAGING_PAGESZ
 /* PTE BIT */
 #define PAGING_PTE_PRESENT_MASK BIT(31) 
 #define PAGING_PTE_SWAPPED_MASK BIT(30)
-#define PAGING_PTE_RESERVE_MASK BIT(29)
+#define PAGING_PTE_WRITEBACK_MASK BIT(29) /* swapped, frame not yet written */
 #define PAGING_PTE_DIRTY_MASK BIT(28)
-#define PAGING_PTE_EMPTY01_MASK BIT(14)
-#define PAGING_PTE_EMPTY02_MASK BIT(13)
+#define PAGING_PTE_ACCESSED_MASK BIT(14) /* present, used since the hand passed */
+#define PAGING_PTE_KSM_MASK BIT(13) /* present, frame shared read-only */
 
 /* PTE BIT PRESENT */
 #define PAGING_PTE_SET_PRESENT(pte) (pte=pte|PAGING_PTE_PRESENT_MASK)
@@ -39,6 +48,7 @@
 /* SWPOFF */
 #define PAGING_PTE_SWPOFF_LOBIT 5
 #define PAGING_PTE_SWPOFF_HIBIT 25
+#define PAGING_MAX_SWPOFF (1 << (PAGING_PTE_SWPOFF_HIBIT - PAGING_PTE_SWPOFF_LOBIT + 1))
 
 /* PTE masks */
 #define PAGING_PTE_USRNUM_MASK GENMASK(PAGING_PTE_USRNUM_HIBIT,PAGING_PTE_USRNUM_LOBIT)
@@ -61,7 +71,9 @@
 /* SWAPFPN */
 #define PAGING_SWP_LOBIT NBITS(PAGING_PAGESZ)
 #define PAGING_SWP_HIBIT (NBITS(PAGING_MEMSWPSZ) - 1)
-#define PAGING_SWP(pte) ((pte&PAGING_SWP_MASK) >> PAGING_SWPFPN_OFFSET)
+#define PAGING_SWP(pte) GETVAL(pte,PAGING_PTE_SWPOFF_MASK,PAGING_PTE_SWPOFF_LOBIT)
+#define PAGING_SWPTYP(pte) GETVAL(pte,PAGING_PTE_SWPTYP_MASK,PAGING_PTE_SWPTYP_LOBIT)
+#define ZSWAP_SWPTYP 0x1f /* swap type of pages held by the compressed tier */
 
 /* Value operators */
 #define SETBIT(v,mask) (v=v|mask)
@@ -83,11 +95,47 @@
 #define PAGING_PGN(x)  GETVAL(x,PAGING_PGN_MASK,PAGING_ADDR_PGN_LOBIT)
 /* Extract FramePHY Number*/
 #define PAGING_FPN(x)  GETVAL(x,PAGING_FPN_MASK,PAGING_ADDR_FPN_LOBIT)
+/* Extract FPN field of PTE */
+#define PAGING_PTE_FPN(pte)  GETVAL(pte,PAGING_PTE_FPN_MASK,PAGING_PTE_FPN_LOBIT)
 /* Extract SWAPFPN */
 #define PAGING_PGN(x)  GETVAL(x,PAGING_PGN_MASK,PAGING_ADDR_PGN_LOBIT)
 /* Extract SWAPTYPE */
 #define PAGING_SWAPTYPE(x)  GETVAL(x,PAGING_SWP_MASK,PAGING_PTE_SWPTYP_LOBIT)
 
+/* TLB entry tag: VALID | PID | PGN packed in one aligned word,
+ * so that a lookup is a single compare against TLB_TAG(pid, pgn)
+ */
+#define TLB_TAG_VALID_MASK BIT(31)
+#define TLB_TAG_PGN_LOBIT 0
+#define TLB_TAG_PGN_HIBIT (PAGING_ADDR_PGN_HIBIT - PAGING_ADDR_PGN_LOBIT)
+#define TLB_TAG_PID_LOBIT (TLB_TAG_PGN_HIBIT + 1)
+#define TLB_TAG_PID_HIBIT 30
+#define TLB_TAG_PGN_MASK GENMASK(TLB_TAG_PGN_HIBIT,TLB_TAG_PGN_LOBIT)
+#define TLB_TAG_PID_MASK GENMASK(TLB_TAG_PID_HIBIT,TLB_TAG_PID_LOBIT)
+#define TLB_TAG(pid,pgn) (TLB_TAG_VALID_MASK | \
+        (((uint32_t)(pid) << TLB_TAG_PID_LOBIT) & TLB_TAG_PID_MASK) | \
+        (((uint32_t)(pgn) << TLB_TAG_PGN_LOBIT) & TLB_TAG_PGN_MASK))
+#define TLB_TAG_PID(tag) GETVAL(tag,TLB_TAG_PID_MASK,TLB_TAG_PID_LOBIT)
+#define TLB_TAG_PGN(tag) GETVAL(tag,TLB_TAG_PGN_MASK,TLB_TAG_PGN_LOBIT)
+#define TLB_ASID_MAX (TLB_TAG_PID_MASK >> TLB_TAG_PID_LOBIT)
+#define TLB_FLG_REF BIT(0)  /* referenced since the last CLOCK sweep */
+/* Entry size: the entry maps 2^order pages */
+#define TLB_FLG_ORDER_LOBIT 4
+#define TLB_FLG_ORDER_HIBIT 7
+#define TLB_FLG_ORDER_MASK GENMASK(TLB_FLG_ORDER_HIBIT,TLB_FLG_ORDER_LOBIT)
+#define TLB_FLG_ORDER(flg) GETVAL(flg,TLB_FLG_ORDER_MASK,TLB_FLG_ORDER_LOBIT)
+#define TLB_FLG_SET_ORDER(order) (((order) << TLB_FLG_ORDER_LOBIT) & TLB_FLG_ORDER_MASK)
+#define TLB_MAX_ORDER 8
+#define TLB_ENTRY_ALIGN 64 /* cache line */
+#define TLB_FA_MAXSZ 256   /* TLBs up to this size are fully associative */
+#define TLB_SHOOTDOWN_QSZ 32 /* pending remote invalidations per CPU */
+
+/* TLB miss classes, see cpu-tlbstat.c */
+#define TLB_MISS_COMPULSORY 0
+#define TLB_MISS_CAPACITY 1
+#define TLB_MISS_CONFLICT 2
+#define TLB_MISS_NCLASS 3
+
 /* Memory range operator */
 #define INCLUDE(x1,x2,y1,y2) (((y1-x1)*(x2-y2)>=0)?1:0)
 #define OVERLAP(x1,x2,y1,y2) (((y2-x1)*(x2-y1)>=0)?1:0)
@@ -95,15 +143,22 @@
 /* VM region prototypes */
 struct vm_rg_struct * init_vm_rg(int rg_start, int rg_endi);
 int enlist_vm_rg_node(struct vm_rg_struct **rglist, struct vm_rg_struct* rgnode);
-int enlist_pgn_node(struct pgn_t **pgnlist, int pgn);
+int pgn_ring_add(struct mm_struct *mm, int pgn);
+int pgn_ring_del(struct mm_struct *mm);
 int vmap_page_range(struct pcb_t *caller, int addr, int pgnum, 
                     struct framephy_struct *frames, struct vm_rg_struct *ret_rg);
 int vm_map_ram(struct pcb_t *caller, int astart, int send, int mapstart, int incpgnum, struct vm_rg_struct *ret_rg);
 int alloc_pages_range(struct pcb_t *caller, int incpgnum, struct framephy_struct **frm_lst);
 int __swap_cp_page(struct memphy_struct *mpsrc, int srcfpn,
                 struct memphy_struct *mpdst, int dstfpn) ;
+int __swap_out(struct pcb_t *caller, int fpn, uint32_t *pte);
+int __swap_in(struct pcb_t *caller, uint32_t pte, int fpn);
+int __swap_free(struct pcb_t *caller, uint32_t pte);
 int pte_set_fpn(uint32_t *pte, int fpn);
 int pte_set_swap(uint32_t *pte, int swptyp, int swpoff);
+uint32_t pte_get(struct mm_struct *mm, int pgn);
+int pte_set(struct mm_struct *mm, int pgn, uint32_t pte);
+extern int mm_pgtbl_inverted;
 int init_pte(uint32_t *pte,
              int pre,    // present
              int fpn,    // FPN
@@ -116,32 +171,64 @@ int __free(struct pcb_t *caller, int vmaid, int rgid);
 int __read(struct pcb_t *caller, int vmaid, int rgid, int offset, BYTE *data);
 int __write(struct pcb_t *caller, int vmaid, int rgid, int offset, BYTE value);
 int init_mm(struct mm_struct *mm, struct pcb_t *caller);
+int mm_save(struct mm_struct *mm, struct snap *s);
+int mm_restore(struct mm_struct *mm, struct snap *s);
 
 /* CPUTLB prototypes */
 int tlb_change_all_page_tables_of(struct pcb_t *proc,  struct memphy_struct * mp);
 int tlb_flush_tlb_of(struct pcb_t *proc, struct memphy_struct * mp);
+int tlb_flush_all(struct memphy_struct * mp);
+uint32_t tlb_asid_of(struct pcb_t *proc);
+int tlb_asid_save(struct snap *s);
+int tlb_asid_restore(struct snap *s);
+int tlb_shootdown_register(struct memphy_struct *mp);
+int tlb_shootdown(struct pcb_t *proc, int pgn_start, int pgn_end);
+int tlb_shootdown_apply(struct memphy_struct *mp);
+int tlb_shootdown_stat(void);
+int tlb_refill(struct pcb_t *proc, int pgn, int fpn);
+extern int tlb_prefetch_depth;
+extern int tlb_huge_order;
+extern int tlb_stat_enabled;
+int tlb_stat_init(int nentries);
+int tlb_stat_register(struct memphy_struct *mp);
+int tlb_stat_ref(struct pcb_t *proc, int pgn, int hit);
+int tlb_stat_forget(uint32_t pid, int pgn_start, int pgn_end);
+int tlb_stat_flush(uint32_t pid);
+int tlb_stat_dump(void);
+extern int tlb_sweep_enabled;
+int tlb_sweep_ref(uint32_t pid, int pgn);
+int tlb_sweep_dump(int assoc);
+double tlb_sweep_miss(int size);
 int tlballoc(struct pcb_t *proc, uint32_t size, uint32_t reg_index);
 int tlbfree_data(struct pcb_t *proc, uint32_t reg_index);
 int tlbread(struct pcb_t * proc, uint32_t source, uint32_t offset, uint32_t destination) ;
 int tlbwrite(struct pcb_t * proc, int data, uint32_t destination, uint32_t offset);
 int init_tlbmemphy(struct memphy_struct *mp, int max_size);
+int TLBMEMPHY_share(struct memphy_struct *mp, int nlocks);
+int TLBMEMPHY_stat(struct memphy_struct *mp, const char *name);
 int TLBMEMPHY_read(struct memphy_struct * mp, int addr, int *value);
 int TLBMEMPHY_write(struct memphy_struct * mp, int addr, int data);
 int TLBMEMPHY_dump(struct memphy_struct * mp);
+int TLBMEMPHY_save(struct memphy_struct *mp, struct snap *s);
+int TLBMEMPHY_restore(struct memphy_struct *mp, struct snap *s);
 int tlb_cache_write(struct memphy_struct* mp, int pid, int pgnum, int value);
 int tlb_cache_read(struct memphy_struct* mp, int pid, int pgnum, int* value);
-uint32_t tlb_create_value(uint32_t pte,uint32_t pgn,int valid); // Create a TLB value
-int tlb_get_pid(struct memphy_struct* mp,int addr); // Get PID from TLB value
-int tlb_empty(struct memphy_struct* mp, int addr); // Empty TLB value
-uint32_t tlb_get_pgn(struct memphy_struct* mp, int addr); // Get PGN from TLB value
-int tlb_set_value(struct memphy_struct* mp, int addr, uint32_t value,int pid); // Set TLB value
+int tlb_cache_write_order(struct memphy_struct *mp, int pid, int pgnum, int value, int order, int deep);
+int tlb_cache_invalidate(struct memphy_struct* mp, int pid, int pgnum);
+int tlb_cache_invalidate_range(struct memphy_struct* mp, int pid, int pgn_start, int pgn_end);
+int tlb_get_pid(struct memphy_struct* mp,int addr); // Get PID of TLB entry
+int tlb_empty(struct memphy_struct* mp, int addr); // Empty TLB entry
+uint32_t tlb_get_pgn(struct memphy_struct* mp, int addr); // Get PGN of TLB entry
+int tlb_set_entry(struct memphy_struct* mp, int addr, int pid, int pgn, int fpn, int order); // Set TLB entry
+int tlb_get_order(struct memphy_struct* mp, int addr); // Get size (log2 of pages) of TLB entry
+int tlb_clear_entry(struct memphy_struct* mp, int addr); // Invalidate TLB entry
 int tlb_get_addr(struct memphy_struct* mp, int pid, int pgn); // Get TLB address
-int tlb_get_fpn(struct memphy_struct* mp, int addr); // Get FPN from TLB value
-uint32_t tlb_get_value(struct memphy_struct* mp, int addr); // Get TLB value
+int tlb_get_fpn(struct memphy_struct* mp, int addr); // Get FPN of TLB entry
 
 /* VM prototypes */
 int pgalloc(struct pcb_t *proc, uint32_t size, uint32_t reg_index);
 int pgfree_data(struct pcb_t *proc, uint32_t reg_index);
+int free_pcb_memph(struct pcb_t *caller);
 int pgread(
 		struct pcb_t * proc, // Process executing the instruction
 		uint32_t source, // Index of source register
@@ -158,21 +245,86 @@ int validate_overlap_vm_area(struct pcb_t *caller, int vmaid, int vmastart, int
 int get_free_vmrg_area(struct pcb_t *caller, int vmaid, int size, struct vm_rg_struct *newrg);
 int inc_vma_limit(struct pcb_t *caller, int vmaid, int inc_sz);
 int find_victim_page(struct mm_struct* mm, int *pgn);
+int pg_mark_accessed(struct mm_struct *mm, int pgn);
+extern int mm_victim_clock;
+int pg_getpage(struct mm_struct *mm, int pgn, int *fpn, struct pcb_t *caller);
+int __pg_getpage(struct mm_struct *mm, int pgn, int *fpn, struct pcb_t *caller);
+int pg_take_frame(struct pcb_t *caller, int *fpn);
+int pg_getval(struct mm_struct *mm, int addr, BYTE *data, struct pcb_t *caller);
+int pg_setval(struct mm_struct *mm, int addr, BYTE value, struct pcb_t *caller);
 struct vm_area_struct *get_vma_by_num(struct mm_struct *mm, int vmaid);
 
 /* MEM/PHY protypes */
 int MEMPHY_get_freefp(struct memphy_struct *mp, int *fpn);
 int MEMPHY_put_freefp(struct memphy_struct *mp, int fpn);
+int MEMPHY_format(struct memphy_struct *mp, int pagesz);
+int MEMPHY_get_freefp_range(struct memphy_struct *mp, int nfp, int *fpn);
+int MEMPHY_frag_stat(struct memphy_struct *mp, const char *name);
 int MEMPHY_read(struct memphy_struct * mp, int addr, BYTE *value);
 int MEMPHY_write(struct memphy_struct * mp, int addr, BYTE data);
+int MEMPHY_stall_slots(void);
+unsigned long MEMPHY_take_cost_ns(void);
+void MEMPHY_set_time_ns(unsigned long ns);
+void MEMPHY_queue_ns(struct memphy_struct *mp, unsigned long ns);
+void MEMPHY_wait_queue(struct memphy_struct *mp);
+int MEMPHY_nfree(struct memphy_struct *mp);
+int MEMPHY_read_block(struct memphy_struct *mp, int addr, BYTE *buf, int len);
+int MEMPHY_write_block(struct memphy_struct *mp, int addr, const BYTE *buf, int len);
+int MEMPHY_copy_frames(struct memphy_struct *mpsrc, int srcfpn,
+                       struct memphy_struct *mpdst, int dstfpn, int nfp);
 int MEMPHY_dump(struct memphy_struct * mp);
 int init_memphy(struct memphy_struct *mp, int max_size, int randomflg);
+int MEMPHY_save(struct memphy_struct *mp, struct snap *s);
+int MEMPHY_restore(struct memphy_struct *mp, struct snap *s);
+
+/* Swap manager, mm-swap.c */
+int swap_init(struct memphy_struct *devs, const int *prio, int ndev);
+struct memphy_struct *swap_device(struct pcb_t *caller, int swptyp);
+int swap_page_out(struct pcb_t *caller, int fpn, int *swptyp, int *swpoff);
+int swap_page_in(struct pcb_t *caller, int swptyp, int swpoff, int fpn);
+int swap_page_free(struct pcb_t *caller, int swptyp, int swpoff);
+int swap_stat(void);
+int swap_wb_start(int nthread, int low);
+int swap_wb_stop(void);
+int swap_wb_balance(struct pcb_t *caller);
+int swap_wb_wait(struct mm_struct *mm, int pgn);
+int swap_wb_drain(void);
+int swap_save(struct snap *s);
+int swap_restore(struct snap *s);
+
+/* Same page merging, mm-ksm.c */
+int ksm_start(struct memphy_struct *mram, int npage, int us);
+int ksm_stop(void);
+int ksm_pause(void);
+int ksm_resume(void);
+int ksm_register(struct mm_struct *mm);
+int ksm_merge(struct pcb_t *caller);
+int ksm_put(int fpn);
+int ksm_break(struct pcb_t *caller, int pgn, int *fpn);
+int ksm_stat(void);
+
+/* Compressed swap tier, mm-zswap.c */
+int zswap_init(struct memphy_struct *mram, int nfp);
+int zswap_store(struct memphy_struct *mram, int fpn, int *swpoff);
+int zswap_load(struct memphy_struct *mram, uint32_t pte, int fpn);
+int zswap_free(int e);
+int zswap_stat(void);
+int zswap_save(struct snap *s);
+int zswap_restore(struct snap *s);
+int zswap_compress(const BYTE *src, int n, BYTE *dst);
+int zswap_decompress(const BYTE *src, int len, BYTE *dst, int n);
+
+/* Inverted page table, mm-ipt.c */
+uint32_t ipt_get(uint32_t id, int pgn);
+int ipt_set(uint32_t id, int pgn, uint32_t pte);
+long ipt_bytes(void);
+int ipt_stat(void);
 /* DEBUG */
 int print_list_fp(struct framephy_struct *fp);
 int print_list_rg(struct vm_rg_struct *rg);
 int print_list_vma(struct vm_area_struct *rg);
 
 
-int print_list_pgn(struct pgn_t *ip);
+int print_list_pgn(struct pgn_t *ring);
 int print_pgtbl(struct pcb_t *ip, uint32_t start, uint32_t end);
 #endif
@@ -6,11 +6,39 @@
 
 #define CPU_TLB
 #define CPUTLB_FIXED_TLBSZ
+#define CPUTLB_L1SZ 64       /* private per-CPU TLB, the shared L2 has tlbsz */
+#define CPUTLB_L2_NLOCKS 16  /* lock stripes of the shared L2 TLB */
+#define CPUTLB_PREFETCH 0    /* next pages also installed on a miss, 0 = off */
+#define CPUTLB_HUGE_ORDER 4  /* TLB entries map up to 2^4 contiguous pages */
+#define CPUTLB_STAT 0        /* 3C miss statistics, one global lock per translation */
+#define CPUTLB_STAT_SLOTS 0  /* print TLB statistics every N slots, 0 = at exit */
+#define CPUTLB_SWEEP 0       /* record references, print miss ratio per TLB size */
+#define CPUTLB_SWEEP_ASSOC 4 /* ways of the set associative sweep */
 #define MM_PAGING
+#define MM_PGTBL_INVERTED 0  /* 1: one hashed page table for all processes */
+#define MM_XLAT_SZ 8         /* last translations kept per process, power of 2 */
+#define MM_VICTIM_CLOCK 1    /* 0: FIFO victims, as the original code. zswap, KSM
+                                and writeback change paging too: the reference
+                                outputs are not reproduced */
+#define MM_SWP_RDMFLG 1  /* 0: swap devices are sequential disks, see below */
+#define MEMPHY_SEEK_NS_PER_KB 500    /* sequential device: seek cost */
+#define MEMPHY_XFER_NS_PER_BYTE 10   /* sequential device: 100MB/s */
+#define MEMPHY_SLOT_NS 1000000       /* simulated length of a time slot */
+#define MM_SWP_PRIO { 0, 0, 0, 0 }   /* higher used first, equal ones striped */
+#define MM_SWP_SEEK_NS_PER_KB { 500, 500, 500, 500 } /* per swap device */
+#define MM_SWP_XFER_NS_PER_BYTE { 10, 10, 10, 10 }
+#define MM_SWP_WB_THREADS 1          /* swap writeback workers, 0 = evict in the fault */
+#define MM_SWP_WB_LOW_SHIFT 4        /* writeback keeps 1/2^4 of the RAM frames free */
+#define MM_ZSWAP                     /* compressed swap tier in front of MEMSWP */
+#define ZSWAP_POOL_SHIFT 4           /* its pool takes 1/2^4 of the RAM frames */
+#define MM_KSM                       /* merge identical pages across processes */
+#define KSM_SCAN_PAGES 64            /* pages the scanner hashes per wakeup */
+#define KSM_SCAN_US 1000             /* scanner sleep between wakeups */
 //#define MM_FIXED_MEMSZ
 // #define VMDBG 1
 // #define MMDBG 1
 #define IODUMP 1
+// #define MEM_TO_FILE 1  /* MEMPHY_dump() writes changed bytes to outputN.txt */
 #define PAGETBL_DUMP 1
 
 #endif
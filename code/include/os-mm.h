@@ -4,6 +4,7 @@
 // #define MM_PAGING
 #define PAGING_MAX_MMSWP 4 /* max number of supported swapped space */
 #define PAGING_MAX_SYMTBL_SZ 256
+#define MEMPHY_MAX_ORDER 10 /* largest buddy block: 2^10 frames */
 
 typedef char BYTE;
 typedef uint32_t addr_t;
@@ -14,6 +15,14 @@ struct pgn_t{
    struct pgn_t *pg_next; 
 };
 
+/*
+ * Recent translation of a present, unmerged page, see __pg_getpage()
+ */
+struct mm_xlat {
+   int pgn; /* -1: empty */
+   int fpn;
+};
+
 /*
  *  Memory region struct
  */
@@ -42,19 +51,48 @@ struct vm_area_struct {
    struct vm_area_struct *vm_next;
 };
 
+/*
+ * Locking of the memory subsystem. Locks are taken in this order and
+ * never the other way round:
+ *   1. mm_struct.mm_lock    page table, pg_ring, vma and region lists
+ *                           of one address space. One at a time: code
+ *                           working for a process only locks its own mm.
+ *   2. memphy_struct.mp_lock  frame pool and cursor of one device, held
+ *                           for one device at a time and never across a
+ *                           call out of mm-memphy.c. The pool lock of
+ *                           the compressed swap tier (mm-zswap.c) is at
+ *                           the same level, so is the request queue
+ *                           of the swap writeback (mm-swap.c). Its
+ *                           workers take 1 with nothing held. So are
+ *                           the tables of same page merging (mm-ksm.c).
+ *   3. TLB locks (ASID, shootdown queues, L2 stripes), see cpu-tlb.c and
+ *                           cpu-tlbcache.c, never held while taking 1 or 2.
+ * Bytes of random access devices are read and written without a lock:
+ * a frame belongs to one mm and is only accessed on behalf of it, or
+ * is shared read-only by KSM.
+ */
+
 /* 
  * Memory management struct
  */
 struct mm_struct {
-   uint32_t *pgd;
+   pthread_mutex_t mm_lock;
+   pthread_cond_t mm_wb_cond; /* a writeback of this mm completed */
+   uint32_t id;    /* key of its pages in the inverted page table */
+   uint32_t **pgd; /* leaf tables, see pte_get() */
+   struct mm_xlat xlat[MM_XLAT_SZ]; /* cleared by pte_set() */
 
    struct vm_area_struct *mmap;
 
    /* Currently we support a fixed number of symbol */
    struct vm_rg_struct symrgtbl[PAGING_MAX_SYMTBL_SZ];
 
-   /* list of free page */
-   struct pgn_t *fifo_pgn;
+   /* Ring of resident pages, see find_victim_page(): the newest one,
+    * its pg_next is the oldest and under the hand */
+   struct pgn_t *pg_ring;
+   struct pgn_t *pg_free; /* ring nodes to reuse */
+
+   struct ksm_hint *ksm_hints; /* pages to merge, see mm-ksm.c */
 };
 
 /*
@@ -72,20 +110,52 @@ struct memphy_struct {
    /* Basic field of data and size */
    BYTE *storage;
    int maxsz;
+   pthread_mutex_t mp_lock; /* frame pool and cursor, see above */
    
    /* Sequential device fields */ 
    int rdmflg;
    int cursor;
-   struct tlb_entry_t *tlb;
-   /* Management structure */
-   struct framephy_struct *free_fp_list;
+   int seek_ns_per_kb;     /* latency model, see mm-memphy.c */
+   int xfer_ns_per_byte;
+   unsigned long busy_ns;  /* time spent seeking and transferring */
+   unsigned long wb_until_ns; /* busy with queued writeback until then */
+
+   /* TLB entry store (struct-of-arrays, TLB devices only) */
+   uint32_t *tlb_tag;   /* VALID | PID | PGN, see TLB_TAG() */
+   uint32_t *tlb_fpn;
+   uint32_t *tlb_flags;
+   int tlb_fa;          /* fully associative lookup */
+   int tlb_fa_hand;     /* CLOCK replacement hand in fa mode */
+   uint32_t tlb_orders; /* bit k set: may hold entries mapping 2^k pages */
+
+   /* TLB hierarchy: a private level falls back on a shared next level,
+    * shared levels are guarded by tlb_nlocks lock stripes */
+   struct memphy_struct *tlb_next;
+   struct tlb_stripe *tlb_locks; /* opaque, see cpu-tlbcache.c */
+   int tlb_nlocks;
+   uint32_t tlb_asid_gen; /* ASID generation a private level is synced to */
+   struct tlb_shootdown *tlb_sd; /* remote invalidations, see cpu-tlb.c */
+   unsigned long tlb_hits;
+   unsigned long tlb_misses;
+   unsigned long tlb_lock_acqs;
+   unsigned long tlb_lock_waits; /* acquisitions that found the lock taken */
+
+   /* Management structure: buddy allocator of the frames. Free blocks
+    * of 2^k frames are linked through arrays indexed by their first
+    * frame, see mm-memphy.c */
+   int nfp;             /* number of frames */
+   int free_fp_cnt;     /* number of free frames */
+   int *fp_next;
+   int *fp_prev;
+   signed char *fp_order; /* order of the free block starting here, -1 */
+   int fp_head[MEMPHY_MAX_ORDER + 1]; /* free blocks of each order, -1 */
+   unsigned long fp_range_ok;   /* contiguous requests served */
+   unsigned long fp_range_fail; /* contiguous requests that fell back */
+
+   /* Frames written since the last MEMPHY_dump() */
+   uint64_t *dirty;
+   int nfp_dirty;     /* frames covered by the bitmap */
+   BYTE *dump_shadow; /* device content as of the last dump, MEM_TO_FILE */
    struct framephy_struct *used_fp_list;
 };
-struct tlb_entry_t {
-    int pid;        // PID của tiến trình
-    int pgnum;      // Số trang
-    int value;      // Giá trị ứng với địa chỉ vật lý
-    int valid;     // Cờ chỉ ra tính hợp lệ của mục TLB (0 là false, 1 là true)
-};
-
 #endif
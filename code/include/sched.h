@@ -26,6 +26,15 @@ void add_proc(struct pcb_t * proc);
 /* Handle when proc is done*/
 void finish_proc(struct pcb_t ** proc);
 
+struct snap;
+
+/* Save the queues to a snapshot, put() writes each queued process */
+int sched_save(struct snap * s, int (*put)(struct snap *, struct pcb_t *));
+
+/* Refill the queues from a snapshot, get() reads each process back */
+int sched_restore(struct snap * s,
+		struct pcb_t * (*get)(struct snap *, void *), void * arg);
+
 #endif
 
 
@@ -0,0 +1,57 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Snapshot file: a header, large arrays each at an offset aligned to
+ * SNAP_ALIGN, then the stream of records that describes everything
+ * else and refers to the arrays. Arrays are mapped back copy-on-write
+ * by snap_map_array(), so restoring does not read device storage.
+ * Integers are in host byte order, a snapshot is only restored by the
+ * build that wrote it.
+ */
+#define SNAP_MAGIC "OSSNAPSH"
+#define SNAP_VERSION 4
+#define SNAP_BYTEORDER 0x01020304
+#define SNAP_ALIGN 4096
+
+struct snap_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteorder;
+	uint64_t time;     /* slot the simulation resumes at */
+	uint64_t meta_off; /* record stream */
+	uint64_t meta_len;
+};
+
+struct snap;
+
+/* Writing, the file appears at path only once snap_commit() succeeds */
+struct snap * snap_create(const char * path);
+
+int snap_commit(struct snap * s, uint64_t time);
+
+/* Reading */
+struct snap * snap_open(const char * path, uint64_t * time);
+
+int snap_close(struct snap * s);
+
+int snap_put(struct snap * s, const void * buf, size_t len);
+
+int snap_get(struct snap * s, void * buf, size_t len);
+
+int snap_put_u32(struct snap * s, uint32_t v);
+
+uint32_t snap_get_u32(struct snap * s);
+
+int snap_put_u64(struct snap * s, uint64_t v);
+
+uint64_t snap_get_u64(struct snap * s);
+
+int snap_put_array(struct snap * s, const void * buf, size_t len);
+
+void * snap_map_array(struct snap * s, size_t len);
+
+#endif
@@ -25,4 +25,8 @@ void next_slot(struct timer_id_t* timer_id);
 
 uint64_t current_time();
 
+void timer_set_time(uint64_t time);
+
+void timer_at(uint64_t time, void (*hook)(void));
+
 #endif
@@ -0,0 +1,47 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/* Traced operations */
+#define TRACE_PGREAD   1
+#define TRACE_PGWRITE  2
+#define TRACE_TLBREAD  3
+#define TRACE_TLBWRITE 4
+#define TRACE_GETPAGE  5  /* page walk, hit if the page was in RAM */
+#define TRACE_SWAPOUT  6  /* vaddr of the victim page, fpn it left */
+#define TRACE_SWAPIN   7  /* vaddr of the target page, fpn it got */
+#define TRACE_ALLOC    8  /* one record per page mapped by ALLOC */
+
+#define TRACE_MAGIC "OSTRACE1"
+#define TRACE_BUFSZ 4096  /* records buffered per thread */
+
+/* One trace record, 24 bytes on disk */
+struct trace_rec {
+	uint64_t time;
+	uint32_t pid;
+	uint32_t vaddr;
+	int32_t fpn;
+	uint8_t cpu;
+	uint8_t op;
+	uint8_t hit;
+	uint8_t pad;
+};
+
+extern int trace_enabled;
+
+int trace_open(const char * path, uint64_t (*clock)(void));
+
+int trace_close();
+
+void trace_set_cpu(int cpu);
+
+void trace_emit(uint32_t pid, int op, uint32_t vaddr, int hit, int fpn);
+
+/* Costs a single branch while tracing is off */
+#define TRACE(pid, op, vaddr, hit, fpn) do { \
+	if (trace_enabled) \
+		trace_emit(pid, op, vaddr, hit, fpn); \
+} while (0)
+
+#endif
@@ -0,0 +1,1320 @@
+/*
+ * Micro benchmarks of the memory subsystem
+ * Run: ./bench [tlb|tlbfa|prefetch|huge|sweep|frames|buddy|swap|dump|zswap|swapdev|writeback|ksm|snapshot|pgtbl|xlat|victim]
+ */
+
+#include "mm.h"
+#include "snapshot.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_NPROC   8
+#define BENCH_NPAGE   1024
+#define BENCH_ROUNDS  2000
+
+static double bench_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * bench_tlb - lookups per second of tlb_cache_read()
+ * Half of the probed pages are cached, the other half miss
+ */
+static int bench_tlb(void)
+{
+  struct memphy_struct tlb;
+  volatile long sink = 0;
+  long nlookup = 0;
+  int pid, pgn, rnd, fpn, bad = 0;
+  double t;
+
+  init_tlbmemphy(&tlb, 0x10000);
+  for (pid = 1; pid <= BENCH_NPROC; pid++)
+    for (pgn = 0; pgn < BENCH_NPAGE / 2; pgn++)
+      tlb_cache_write(&tlb, pid, pgn, pgn);
+
+  t = bench_now();
+  for (rnd = 0; rnd < BENCH_ROUNDS; rnd++)
+    for (pid = 1; pid <= BENCH_NPROC; pid++)
+      for (pgn = 0; pgn < BENCH_NPAGE; pgn++) {
+        sink += tlb_cache_read(&tlb, pid, pgn, &fpn);
+        nlookup++;
+      }
+  t = bench_now() - t;
+
+  printf("tlb: %ld lookups in %.3fs, %.1f Mlookups/s\n",
+         nlookup, t, nlookup / t / 1e6);
+
+  for (pid = 1; pid <= BENCH_NPROC; pid++)
+    for (pgn = 0; pgn < BENCH_NPAGE; pgn++)
+      if (pgn < BENCH_NPAGE / 2)
+        bad += tlb_cache_read(&tlb, pid, pgn, &fpn) < 0 || fpn != pgn;
+      else
+        bad += tlb_cache_read(&tlb, pid, pgn, &fpn) >= 0;
+  printf("  cached pages read back, others miss: %d bad\n", bad);
+  return bad != 0;
+}
+
+static uint32_t bench_seed = 12345;
+
+static uint32_t bench_rand(void)
+{
+  bench_seed = bench_seed * 1103515245 + 12345;
+  return bench_seed >> 8;
+}
+
+/*
+ * bench_tlb_assoc_run - replay a skewed trace, refilling on miss
+ * Return the hit rate
+ */
+static double bench_tlb_assoc_run(struct memphy_struct *tlb, int tlbsz,
+                                const char *name)
+{
+  long nref = 1000000, nhit = 0, i;
+  int pid, pgn, fpn;
+  double t;
+
+  bench_seed = 12345;
+  t = bench_now();
+  for (i = 0; i < nref; i++) {
+    pid = 1 + bench_rand() % 4;
+    if (bench_rand() % 10 < 9)
+      /* hot set: half of the TLB, scattered over the address space */
+      pgn = (bench_rand() % (tlbsz / 8)) * 37 % BENCH_NPAGE;
+    else
+      pgn = bench_rand() % BENCH_NPAGE;
+
+    if (tlb_cache_read(tlb, pid, pgn, &fpn) >= 0)
+      nhit++;
+    else
+      tlb_cache_write(tlb, pid, pgn, pgn);
+  }
+  t = bench_now() - t;
+
+  printf("  %-6s tlbsz %3d: hit rate %5.1f%%, %.1f Mrefs/s\n",
+         name, tlbsz, 100.0 * nhit / nref, nref / t / 1e6);
+  return 100.0 * nhit / nref;
+}
+
+/*
+ * bench_tlb_assoc - fully associative (SIMD tag match) vs hashed lookup
+ * The hot set fits in half of a fully associative TLB: it must hit at
+ * least on the 90% of references to the hot set, minus its cold misses.
+ * The odd sizes leave padding in the last vector of tags: once full,
+ * the TLB must still take a new entry
+ */
+static int bench_tlb_assoc(void)
+{
+  static const int oddsz[] = {10, 99};
+  struct memphy_struct tlb;
+  int tlbsz, i, fpn, bad = 0;
+
+#if defined(__AVX2__)
+  printf("tlbfa: AVX2 tag match\n");
+#elif defined(__SSE2__)
+  printf("tlbfa: SSE2 tag match\n");
+#else
+  printf("tlbfa: scalar tag match\n");
+#endif
+  for (tlbsz = 16; tlbsz <= TLB_FA_MAXSZ; tlbsz *= 2) {
+    init_tlbmemphy(&tlb, tlbsz);
+    tlb.tlb_fa = 0;
+    bench_tlb_assoc_run(&tlb, tlbsz, "hashed");
+
+    init_tlbmemphy(&tlb, tlbsz);
+    bad += bench_tlb_assoc_run(&tlb, tlbsz, "fa") < 89.0;
+  }
+  for (i = 0; i < 2; i++) {
+    init_tlbmemphy(&tlb, oddsz[i]);
+    tlb.tlb_fa = 0;
+    bench_tlb_assoc_run(&tlb, oddsz[i], "hashed");
+
+    init_tlbmemphy(&tlb, oddsz[i]);
+    bench_tlb_assoc_run(&tlb, oddsz[i], "fa");
+    tlb_cache_write(&tlb, 5, BENCH_NPAGE, 1);
+    fpn = -1;
+    bad += tlb_cache_read(&tlb, 5, BENCH_NPAGE, &fpn) < 0 || fpn != 1;
+    printf("  fa     tlbsz %3d: new entry when full %s\n", oddsz[i],
+           fpn == 1 ? "cached" : "LOST");
+  }
+  printf("  %s\n", bad ? "FAILED" : "ok");
+  return bad != 0;
+}
+
+static struct memphy_struct bench_mram;
+static struct memphy_struct bench_mswp[PAGING_MAX_MMSWP];
+
+/*
+ * bench_proc - a loaded process without scheduler and timer
+ */
+static struct pcb_t *bench_proc(int pid, struct memphy_struct *tlb)
+{
+  struct pcb_t *proc = calloc(1, sizeof(struct pcb_t));
+
+  if (bench_mram.maxsz == 0) {
+    init_memphy(&bench_mram, 0x100000, 1);
+    init_memphy(&bench_mswp[0], 0x1000000, 1);
+  }
+
+  proc->pid = pid;
+  proc->mm = malloc(sizeof(struct mm_struct));
+  init_mm(proc->mm, proc);
+  proc->mram = &bench_mram;
+  proc->mswp = (struct memphy_struct **)&bench_mswp;
+  proc->active_mswp = &bench_mswp[0];
+  proc->tlb = tlb;
+  return proc;
+}
+
+/*
+ * bench_access - translate one address the way tlbread()/tlbwrite() do
+ * Return 1 on a TLB hit
+ */
+static int bench_access(struct pcb_t *proc, int addr)
+{
+  int pgn = PAGING_PGN(addr);
+  int fpn;
+
+  if (tlb_cache_read(proc->tlb, tlb_asid_of(proc), pgn, &fpn) >= 0)
+    return 1;
+
+  pg_getpage(proc->mm, pgn, &fpn, proc);
+  return 0;
+}
+
+/*
+ * bench_prefetch - TLB hit rate with refill on miss and next-page
+ * prefetch, on sequential and strided scans of a 512 page region
+ * Single page entries only, a multi-page fill would cover the next
+ * pages the same way prefetch does. Without prefetch every page misses
+ * on its first reference; prefetch must not do worse, and must help
+ * the sequential scan.
+ */
+static int bench_prefetch(void)
+{
+  static const int depth[] = { 0, 1, 2, 4, 8 };
+  static const int stride[] = { 1, 2, 3 };
+  int npage = 512, addr, d, st, pass, bad = 0;
+
+  printf("prefetch: %d page region, 64 entry TLB, 16 refs/page, "
+         "single page entries\n", npage);
+  tlb_huge_order = 0;
+  for (st = 0; st < sizeof(stride) / sizeof(stride[0]); st++) {
+    double base = 0;
+
+    for (d = 0; d < sizeof(depth) / sizeof(depth[0]); d++) {
+      struct memphy_struct tlb;
+      struct pcb_t *proc;
+      long nref = 0, nhit = 0;
+      double rate;
+
+      init_tlbmemphy(&tlb, 64);
+      proc = bench_proc(1, &tlb);
+      MEMPHY_format(&bench_mram, PAGING_PAGESZ);
+      if (__alloc(proc, 0, 0, npage * PAGING_PAGESZ, &addr) < 0) {
+        printf("  stride %d page(s), prefetch depth %d: region not "
+               "allocated\n", stride[st], depth[d]);
+        bad++;
+        continue;
+      }
+      tlb_prefetch_depth = depth[d];
+
+      for (pass = 0; pass < 4; pass++)
+        for (addr = 0; addr < npage * PAGING_PAGESZ;
+             addr += (addr % PAGING_PAGESZ == PAGING_PAGESZ - 16) ?
+                     16 + (stride[st] - 1) * PAGING_PAGESZ : 16) {
+          nhit += bench_access(proc, addr);
+          nref++;
+        }
+
+      rate = 100.0 * nhit / nref;
+      if (depth[d] == 0)
+        base = rate;
+      printf("  stride %d page(s), prefetch depth %d: hit rate %5.1f%%\n",
+             stride[st], depth[d], rate);
+      /* one miss per page visited without prefetch */
+      if ((depth[d] == 0 && nref - nhit != nref / 16) || rate < base ||
+          (stride[st] == 1 && depth[d] > 0 && rate <= base))
+        bad++;
+    }
+  }
+  tlb_prefetch_depth = CPUTLB_PREFETCH;
+  tlb_huge_order = CPUTLB_HUGE_ORDER;
+  printf("  %s\n", bad ? "FAILED" : "ok");
+  return bad != 0;
+}
+
+/*
+ * bench_huge - TLB reach and hit rate with multi-page entries, on
+ * uniform random references over freshly allocated regions. The reach
+ * cannot exceed the region nor 64 entries of the largest order, and
+ * larger entries must not lower the hit rate
+ */
+static int bench_huge(void)
+{
+  static const int order[] = { 0, 2, 4 };
+  static const int npage[] = { 64, 256, 1024 };
+  int o, n, i, addr, bad = 0;
+
+  printf("huge: 64 entry TLB, 1M random refs, refill on miss\n");
+  for (n = 0; n < sizeof(npage) / sizeof(npage[0]); n++) {
+    double last = 0;
+
+    for (o = 0; o < sizeof(order) / sizeof(order[0]); o++) {
+      struct memphy_struct tlb;
+      struct pcb_t *proc;
+      long nref = 1000000, nhit = 0, reach = 0;
+      double t;
+
+      tlb_huge_order = order[o];
+      init_tlbmemphy(&tlb, 64);
+      proc = bench_proc(1, &tlb);
+      /* fresh free list: the region gets ascending frames */
+      MEMPHY_format(&bench_mram, PAGING_PAGESZ);
+      if (__alloc(proc, 0, 0, npage[n] * PAGING_PAGESZ, &addr) < 0) {
+        printf("  %4d pages: region not allocated\n", npage[n]);
+        bad++;
+        continue;
+      }
+
+      bench_seed = 12345;
+      t = bench_now();
+      for (i = 0; i < nref; i++)
+        nhit += bench_access(proc, bench_rand() % (npage[n] * PAGING_PAGESZ));
+      t = bench_now() - t;
+
+      for (i = 0; i < tlb.maxsz; i++)
+        if (tlb_get_order(&tlb, i) >= 0)
+          reach += 1 << tlb_get_order(&tlb, i);
+
+      printf("  %4d pages, max order %d: reach %4ld pages, "
+             "hit rate %5.1f%%, %.1f Mrefs/s\n",
+             npage[n], order[o], reach, 100.0 * nhit / nref, nref / t / 1e6);
+      bad += reach > npage[n] || reach > (long)tlb.maxsz << order[o] ||
+             100.0 * nhit / nref < last;
+      last = 100.0 * nhit / nref;
+    }
+  }
+  tlb_huge_order = CPUTLB_HUGE_ORDER;
+  printf("  %s\n", bad ? "FAILED" : "ok");
+  return bad != 0;
+}
+
+/*
+ * bench_sweep_lru - reference miss ratio of a fully associative LRU,
+ * by brute force move-to-front
+ */
+static double bench_sweep_lru(const uint32_t *key, long n, int size)
+{
+  uint32_t *lru = calloc(size, sizeof(uint32_t));
+  long i, nmiss = 0;
+  int j, len = 0;
+
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < len && lru[j] != key[i]; j++)
+      ;
+    if (j == len) {
+      nmiss++;
+      if (len < size)
+        len++;
+      j = len - 1;
+    }
+    memmove(&lru[1], &lru[0], j * sizeof(uint32_t));
+    lru[0] = key[i];
+  }
+  free(lru);
+  return 100.0 * nmiss / n;
+}
+
+/*
+ * bench_sweep - single pass stack distance sweep against brute force
+ * LRU simulation of a few sizes, which must agree
+ */
+static int bench_sweep(void)
+{
+  static const int size[] = { 16, 64, 256 };
+  long nref = 1000000, i;
+  uint32_t *key = malloc(nref * sizeof(uint32_t));
+  double t;
+  int k, bad = 0;
+
+  bench_seed = 12345;
+  for (i = 0; i < nref; i++) {
+    int pid = 1 + bench_rand() % 4, pgn;
+    if (bench_rand() % 10 < 9)
+      pgn = (bench_rand() % 64) * 37 % BENCH_NPAGE;
+    else
+      pgn = bench_rand() % BENCH_NPAGE;
+    key[i] = TLB_TAG(pid, pgn);
+    tlb_sweep_ref(pid, pgn);
+  }
+
+  t = bench_now();
+  tlb_sweep_dump(4);
+  printf("sweep: all sizes in %.3fs\n", bench_now() - t);
+
+  for (k = 0; k < sizeof(size) / sizeof(size[0]); k++) {
+    double ratio;
+
+    t = bench_now();
+    ratio = bench_sweep_lru(key, nref, size[k]);
+    printf("  brute force LRU %3d entries: miss ratio %6.2f%% in %.3fs, "
+           "sweep %6.2f%%\n", size[k], ratio, bench_now() - t,
+           tlb_sweep_miss(size[k]));
+    bad += ratio != tlb_sweep_miss(size[k]);
+  }
+  free(key);
+  return bad != 0;
+}
+
+/*
+ * bench_frames - MEMPHY_format() and free frame get/put rate on a
+ * 16MB swap sized device. Every round takes all frames, then one more
+ * must fail, and gives them all back
+ */
+static int bench_frames(void)
+{
+  struct memphy_struct mp;
+  int nfp = 0x1000000 / PAGING_PAGESZ, rounds = 50, r, i, extra, bad = 0;
+  int *fpn = malloc(nfp * sizeof(int));
+  double t;
+
+  memset(&mp, 0, sizeof(mp));
+  t = bench_now();
+  init_memphy(&mp, 0x1000000, 1);
+  printf("frames: format %d frames in %.3fms\n", nfp, (bench_now() - t) * 1e3);
+
+  t = bench_now();
+  for (r = 0; r < rounds; r++) {
+    for (i = 0; i < nfp; i++)
+      bad += MEMPHY_get_freefp(&mp, &fpn[i]) != 0;
+    bad += MEMPHY_get_freefp(&mp, &extra) == 0;
+    /* release in a scrambled order */
+    for (i = 0; i < nfp; i++)
+      MEMPHY_put_freefp(&mp, fpn[(i * 7919) % nfp]);
+  }
+  t = bench_now() - t;
+  bad += MEMPHY_nfree(&mp) != nfp;
+  printf("frames: %d get+put pairs in %.3fs, %.1f Mpairs/s, %d bad\n",
+         rounds * nfp, t, rounds * nfp / t / 1e6, bad);
+
+  free(fpn);
+  return bad != 0;
+}
+
+/*
+ * bench_buddy - long run of random contiguous allocations and frame by
+ * frame releases on a 1MB RAM, with fragmentation along the way. Once
+ * all is released every frame must be free again
+ */
+static int bench_buddy(void)
+{
+  struct memphy_struct mp;
+  enum { NLIVE = 96 };
+  int live_fpn[NLIVE], live_n[NLIVE];
+  long nop = 2000000, i;
+  int slot, j;
+  double t;
+
+  memset(&mp, 0, sizeof(mp));
+  init_memphy(&mp, 0x100000, 1);
+  for (slot = 0; slot < NLIVE; slot++)
+    live_n[slot] = 0;
+
+  bench_seed = 12345;
+  t = bench_now();
+  for (i = 1; i <= nop; i++) {
+    slot = bench_rand() % NLIVE;
+    if (live_n[slot] > 0) {
+      for (j = 0; j < live_n[slot]; j++)
+        MEMPHY_put_freefp(&mp, live_fpn[slot] + j);
+      live_n[slot] = 0;
+    } else {
+      int n = 1 + bench_rand() % 64;
+      if (MEMPHY_get_freefp_range(&mp, n, &live_fpn[slot]) == 0)
+        live_n[slot] = n;
+    }
+    if (i % (nop / 4) == 0)
+      MEMPHY_frag_stat(&mp, "RAM");
+  }
+  t = bench_now() - t;
+
+  for (slot = 0; slot < NLIVE; slot++)
+    for (j = 0; j < live_n[slot]; j++)
+      MEMPHY_put_freefp(&mp, live_fpn[slot] + j);
+  printf("buddy: %ld ops in %.3fs, %.1f Mops/s; after releasing all:\n",
+         nop, t, nop / t / 1e6);
+  MEMPHY_frag_stat(&mp, "RAM");
+  if (MEMPHY_nfree(&mp) != mp.nfp) {
+    printf("  FAILED: %d/%d frames free\n", MEMPHY_nfree(&mp), mp.nfp);
+    return 1;
+  }
+  return 0;
+}
+
+/* Page copy the way __swap_cp_page() used to do it, one byte a call */
+static void bench_swap_bytewise(struct memphy_struct *mpsrc, int srcfpn,
+                                struct memphy_struct *mpdst, int dstfpn)
+{
+  int cellidx;
+
+  for (cellidx = 0; cellidx < PAGING_PAGESZ; cellidx++) {
+    BYTE data;
+    MEMPHY_read(mpsrc, srcfpn * PAGING_PAGESZ + cellidx, &data);
+    MEMPHY_write(mpdst, dstfpn * PAGING_PAGESZ + cellidx, data);
+  }
+}
+
+/*
+ * bench_swap - swap out/in page copy throughput, byte-wise against
+ * the block copy of __swap_cp_page(). Pages copied out and back in must
+ * leave RAM as it was
+ */
+static int bench_swap(void)
+{
+  struct memphy_struct ram, swp;
+  int nram = 0x100000 / PAGING_PAGESZ, nswp = 0x1000000 / PAGING_PAGESZ;
+  long ncopy = 400000, i;
+  double t, tbyte, tblock;
+  int bad = 0;
+  BYTE v;
+
+  memset(&ram, 0, sizeof(ram));
+  memset(&swp, 0, sizeof(swp));
+  init_memphy(&ram, 0x100000, 1);
+  init_memphy(&swp, 0x1000000, 1);
+  for (i = 0; i < ram.maxsz; i++)
+    MEMPHY_write(&ram, i, (BYTE)(i * 7 + i / PAGING_PAGESZ));
+
+  bench_seed = 12345;
+  t = bench_now();
+  for (i = 0; i < ncopy; i++) {
+    int fpn = bench_rand() % nram, swfpn = bench_rand() % nswp;
+    bench_swap_bytewise(&ram, fpn, &swp, swfpn);
+    bench_swap_bytewise(&swp, swfpn, &ram, fpn);
+  }
+  tbyte = bench_now() - t;
+
+  bench_seed = 12345;
+  t = bench_now();
+  for (i = 0; i < ncopy; i++) {
+    int fpn = bench_rand() % nram, swfpn = bench_rand() % nswp;
+    __swap_cp_page(&ram, fpn, &swp, swfpn);
+    __swap_cp_page(&swp, swfpn, &ram, fpn);
+  }
+  tblock = bench_now() - t;
+
+  printf("swap: %ld page copies\n", 2 * ncopy);
+  printf("  byte-wise  %.3fs, %7.1f MB/s\n", tbyte,
+         2.0 * ncopy * PAGING_PAGESZ / tbyte / 1e6);
+  printf("  block      %.3fs, %7.1f MB/s (%.1fx)\n", tblock,
+         2.0 * ncopy * PAGING_PAGESZ / tblock / 1e6, tbyte / tblock);
+
+  for (i = 0; i < ram.maxsz; i++) {
+    MEMPHY_read(&ram, i, &v);
+    bad += v != (BYTE)(i * 7 + i / PAGING_PAGESZ);
+  }
+  printf("  RAM after the round trips: %d bad bytes\n", bad);
+  return bad != 0;
+}
+
+/*
+ * bench_dump - cost of the MEMPHY_dump() done after every memory
+ * instruction, full RAM scan against dirty frame tracking. A write
+ * must mark its frame dirty, a dump must leave none so
+ */
+static int bench_dump(void)
+{
+  struct memphy_struct ram;
+  int ninstr = 2000, i, addr, bad = 0;
+  volatile BYTE sink;
+  double t, tfull, tdirty;
+
+  memset(&ram, 0, sizeof(ram));
+  init_memphy(&ram, 0x100000, 1);
+
+  /* What MEMPHY_dump() used to do: read every byte */
+  bench_seed = 12345;
+  t = bench_now();
+  for (i = 0; i < ninstr; i++) {
+    MEMPHY_write(&ram, bench_rand() % ram.maxsz, i);
+    for (addr = 0; addr < ram.maxsz; addr++) {
+      BYTE data;
+      MEMPHY_read(&ram, addr, &data);
+      sink = data;
+    }
+  }
+  tfull = bench_now() - t;
+  (void)sink;
+
+  bench_seed = 12345;
+  t = bench_now();
+  for (i = 0; i < ninstr; i++) {
+    int fpn = (addr = bench_rand() % ram.maxsz) / PAGING_PAGESZ;
+
+    MEMPHY_write(&ram, addr, i);
+    bad += !(ram.dirty[fpn / 64] & (1ULL << (fpn % 64)));
+    MEMPHY_dump(&ram);
+  }
+  tdirty = bench_now() - t;
+  for (i = 0; i < (ram.nfp_dirty + 63) / 64; i++)
+    bad += ram.dirty[i] != 0;
+
+  printf("dump: 1MB RAM, one write and one dump per instruction\n");
+  printf("  full scan   %9.1f us/dump\n", tfull / ninstr * 1e6);
+  printf("  dirty only  %9.1f us/dump (%.0fx), %s\n", tdirty / ninstr * 1e6,
+         tfull / tdirty, bad ? "tracking FAILED" : "tracking ok");
+  return bad != 0;
+}
+
+/* Page of the given kind: 0 sparse (a few bytes written, as the
+ * simulated programs do), 1 text-like, 2 random */
+static void bench_zswap_page(BYTE *page, int kind)
+{
+  static const char *words[] = { "alloc ", "free ", "read ", "write ",
+                                 "calc ", "region ", "offset " };
+  int i, n;
+
+  memset(page, 0, PAGING_PAGESZ);
+  if (kind == 0) {
+    for (n = bench_rand() % 8; n >= 0; n--)
+      page[bench_rand() % PAGING_PAGESZ] = bench_rand();
+  } else if (kind == 1) {
+    for (i = 0; i < PAGING_PAGESZ; i += n) {
+      const char *w = words[bench_rand() % 7];
+      n = strlen(w);
+      memcpy(page + i, w, i + n <= PAGING_PAGESZ ? n : PAGING_PAGESZ - i);
+    }
+  } else {
+    for (i = 0; i < PAGING_PAGESZ; i++)
+      page[i] = bench_rand();
+  }
+}
+
+/*
+ * bench_zswap - codec ratio and speed per kind of page, then how many
+ * sparse pages a small pool holds before evictions spill to swap
+ */
+static int bench_zswap(void)
+{
+  static const char *kinds[] = { "sparse", "text", "random" };
+  int npage = 2000, rounds = 50, kind, i, r, len;
+  BYTE *pages = malloc(npage * PAGING_PAGESZ);
+  BYTE buf[2 * PAGING_PAGESZ], out[PAGING_PAGESZ];
+  struct memphy_struct ram;
+  struct memphy_struct swp;
+  struct pcb_t caller;
+  int *swpoff, nstored, fpn, bad = 0;
+  uint32_t pte;
+  double t, tc, td;
+  long in, outsz;
+
+  printf("zswap: %d pages of %d bytes per kind\n", npage, PAGING_PAGESZ);
+  for (kind = 0; kind < 3; kind++) {
+    bench_seed = 12345;
+    for (i = 0; i < npage; i++)
+      bench_zswap_page(pages + i * PAGING_PAGESZ, kind);
+
+    in = outsz = 0;
+    t = bench_now();
+    for (r = 0; r < rounds; r++)
+      for (i = 0; i < npage; i++) {
+        len = zswap_compress(pages + i * PAGING_PAGESZ, PAGING_PAGESZ, buf);
+        outsz += len;
+        in += PAGING_PAGESZ;
+      }
+    tc = bench_now() - t;
+
+    t = bench_now();
+    for (r = 0; r < rounds; r++)
+      for (i = 0; i < npage; i++) {
+        len = zswap_compress(pages + i * PAGING_PAGESZ, PAGING_PAGESZ, buf);
+        if (zswap_decompress(buf, len, out, PAGING_PAGESZ) != PAGING_PAGESZ ||
+            memcmp(out, pages + i * PAGING_PAGESZ, PAGING_PAGESZ) != 0)
+          bad++;
+      }
+    td = bench_now() - t - tc;
+
+    printf("  %-7s ratio %6.2fx  compress %7.1f MB/s  decompress %7.1f MB/s\n",
+           kinds[kind], (double)in / outsz, in / tc / 1e6,
+           td > 0 ? in / td / 1e6 : 0.0);
+  }
+  printf("  round trips %s\n", bad ? "FAILED" : "ok");
+
+  /* Pool of 16 frames, evict sparse pages into it until it is full */
+  memset(&ram, 0, sizeof(ram));
+  init_memphy(&ram, 0x100000, 1);
+  zswap_init(&ram, 16);
+  swpoff = malloc(ram.nfp * sizeof(int));
+  bench_seed = 12345;
+  for (nstored = 0; MEMPHY_get_freefp(&ram, &fpn) == 0; nstored++) {
+    bench_zswap_page(pages, 0);
+    MEMPHY_write_block(&ram, fpn * PAGING_PAGESZ, pages, PAGING_PAGESZ);
+    if (zswap_store(&ram, fpn, &swpoff[nstored]) < 0)
+      break;
+  }
+  bench_seed = 12345;
+  for (i = 0; i < nstored; i++) {
+    bench_zswap_page(pages, 0);
+    pte = 0;
+    pte_set_swap(&pte, ZSWAP_SWPTYP, swpoff[i]);
+    zswap_load(&ram, pte, fpn);
+    MEMPHY_read_block(&ram, fpn * PAGING_PAGESZ, out, PAGING_PAGESZ);
+    bad += memcmp(out, pages, PAGING_PAGESZ) != 0;
+  }
+  printf("  pool of 16 frames held %d sparse pages (%.1f per frame), "
+         "reloads %s\n", nstored, nstored / 16.0, bad ? "FAILED" : "ok");
+
+  /* Pages dropped while swapped, by __free(): the pool takes as many
+   * again, and a swap device gets its slot back */
+  memset(&caller, 0, sizeof(caller));
+  memset(&swp, 0, sizeof(swp));
+  init_memphy(&swp, 16 * PAGING_PAGESZ, 1);
+  caller.mram = &ram;
+  caller.active_mswp = &swp;
+  for (r = 0; r < 2; r++) {
+    bench_seed = 12345;
+    for (i = 0; i < nstored; i++) {
+      bench_zswap_page(pages, 0);
+      MEMPHY_write_block(&ram, fpn * PAGING_PAGESZ, pages, PAGING_PAGESZ);
+      if (zswap_store(&ram, fpn, &swpoff[i]) < 0)
+        break;
+    }
+    bad += i != nstored;
+    for (i--; i >= 0; i--) {
+      pte = 0;
+      pte_set_swap(&pte, ZSWAP_SWPTYP, swpoff[i]);
+      __swap_free(&caller, pte);
+    }
+  }
+  for (i = 0; i < 16; i++) {
+    swap_page_out(&caller, fpn, &r, &len);
+    pte = 0;
+    pte_set_swap(&pte, r, len);
+    __swap_free(&caller, pte);
+  }
+  bad += MEMPHY_nfree(&swp) != 16;
+  printf("  pages freed while swapped: pool and swap slots %s\n",
+         bad ? "LEAKED" : "released");
+  zswap_stat();
+
+  free(swpoff);
+  free(pages);
+  return bad != 0;
+}
+
+#define BENCH_SWAP_THREADS 4
+#define BENCH_SWAP_PAGES   256 /* frames each thread keeps swapping */
+
+static struct pcb_t bench_swap_caller;
+
+static void *bench_swapdev_thread(void *arg)
+{
+  int base = (int)(long)arg * BENCH_SWAP_PAGES;
+  int typ[BENCH_SWAP_PAGES], off[BENCH_SWAP_PAGES];
+  int r, i;
+
+  for (r = 0; r < 20; r++) {
+    for (i = 0; i < BENCH_SWAP_PAGES; i++)
+      swap_page_out(&bench_swap_caller, base + i, &typ[i], &off[i]);
+    for (i = BENCH_SWAP_PAGES - 1; i >= 0; i--)
+      swap_page_in(&bench_swap_caller, typ[i], off[i], base + i);
+  }
+  return NULL;
+}
+
+/*
+ * bench_swapdev - swap throughput over 1 to 4 striped sequential swap
+ * devices, with BENCH_SWAP_THREADS CPUs swapping at once. Simulated
+ * throughput takes the devices as working in parallel, host throughput
+ * is what the mutexes of the devices let through. Every slot must be
+ * free again after the pages came back, and device 0 must fill up
+ * before the others when it comes first.
+ */
+static int bench_swapdev(void)
+{
+  static const int prio[PAGING_MAX_MMSWP] = { 0, 0, 0, 0 };
+  static const int prio_first[PAGING_MAX_MMSWP] = { 1, 0, 0, 0 };
+  struct memphy_struct ram, devs[PAGING_MAX_MMSWP];
+  pthread_t th[BENCH_SWAP_THREADS];
+  unsigned long maxbusy;
+  double t, bytes;
+  int ndev, d, i, nused, bad = 0;
+
+  memset(&ram, 0, sizeof(ram));
+  init_memphy(&ram, 0x100000, 1);
+  bench_swap_caller.mram = &ram;
+  bytes = 2.0 * BENCH_SWAP_THREADS * 20 * BENCH_SWAP_PAGES * PAGING_PAGESZ;
+
+  printf("swapdev: %d threads, %.1f MB swapped out and in\n",
+         BENCH_SWAP_THREADS, bytes / 1e6);
+  for (ndev = 1; ndev <= PAGING_MAX_MMSWP; ndev++) {
+    memset(devs, 0, sizeof(devs));
+    for (d = 0; d < PAGING_MAX_MMSWP; d++)
+      init_memphy(&devs[d], d < ndev ? 0x400000 : 0, 0);
+    swap_init(devs, prio, PAGING_MAX_MMSWP);
+    bench_swap_caller.active_mswp = &devs[0];
+
+    t = bench_now();
+    for (i = 0; i < BENCH_SWAP_THREADS; i++)
+      pthread_create(&th[i], NULL, bench_swapdev_thread, (void *)(long)i);
+    for (i = 0; i < BENCH_SWAP_THREADS; i++)
+      pthread_join(th[i], NULL);
+    t = bench_now() - t;
+
+    for (maxbusy = 0, d = 0; d < ndev; d++) {
+      if (devs[d].busy_ns > maxbusy)
+        maxbusy = devs[d].busy_ns;
+      bad += MEMPHY_nfree(&devs[d]) != devs[d].nfp;
+    }
+    printf("  %d device(s): simulated %7.1f MB/s, host %7.1f MB/s\n", ndev,
+           bytes / maxbusy * 1e3, bytes / t / 1e6);
+  }
+
+  /* Device 0 first: the others only take what it cannot hold */
+  memset(devs, 0, sizeof(devs));
+  for (d = 0; d < PAGING_MAX_MMSWP; d++)
+    init_memphy(&devs[d], 0x10000, 0);
+  swap_init(devs, prio_first, PAGING_MAX_MMSWP);
+  for (i = 0; i < 2 * devs[0].nfp; i++) {
+    int typ, off;
+    swap_page_out(&bench_swap_caller, i % ram.nfp, &typ, &off);
+  }
+  printf("  priority %d %d %d %d, %d pages out:", prio_first[0],
+         prio_first[1], prio_first[2], prio_first[3], 2 * devs[0].nfp);
+  for (nused = 0, d = 0; d < PAGING_MAX_MMSWP; d++) {
+    printf(" SWP%d %d", d, devs[d].nfp - devs[d].free_fp_cnt);
+    nused += devs[d].nfp - devs[d].free_fp_cnt;
+  }
+  bad += devs[0].free_fp_cnt != 0 || nused != 2 * devs[0].nfp;
+  printf("\n  %s\n", bad ? "FAILED" : "ok");
+  return bad != 0;
+}
+
+#define BENCH_WB_FRAMES 64  /* RAM of the process */
+#define BENCH_WB_PAGES  256 /* its working set */
+#define BENCH_WB_RGPAGES 32 /* pages per region, one may not exceed RAM */
+#define BENCH_WB_THINK 20e-6 /* host seconds of work between accesses */
+
+/*
+ * bench_writeback - one process writing through a working set four
+ * times its RAM, then reading it back, its pages swapped to a
+ * sequential device, zswap off. Device time charged to the faulting CPU
+ * with eviction in the fault path and with writeback workers keeping
+ * 1/16 and 1/4 of the frames free. Simulated time advances by the think
+ * time and the CPU's device time per access; the writes of the workers
+ * are queued on the device and delay the CPU only if still pending when
+ * it next accesses it.
+ */
+static int bench_writeback(void)
+{
+  static const int prio[PAGING_MAX_MMSWP] = { 0, 0, 0, 0 };
+  static const int nthread[] = { 0, 1, 1, 2 };
+  static const int lowshift[] = { 0, 4, 2, 2 };
+  struct memphy_struct ram, tlb, devs[PAGING_MAX_MMSWP];
+  struct pcb_t proc;
+  struct mm_struct mm;
+  int naccess = 5 * BENCH_WB_PAGES;
+  int c, pass, pg, fpn, bad, nbad = 0, addr, rg, d;
+  unsigned long cost, now;
+  double t, t0;
+  BYTE v;
+
+  printf("writeback: %d pages in %d frames, %d accesses\n", BENCH_WB_PAGES,
+         BENCH_WB_FRAMES, naccess);
+  for (c = 0; c < 4; c++) {
+    memset(&ram, 0, sizeof(ram));
+    init_memphy(&ram, BENCH_WB_FRAMES * PAGING_PAGESZ, 1);
+    memset(devs, 0, sizeof(devs));
+    for (d = 0; d < PAGING_MAX_MMSWP; d++)
+      init_memphy(&devs[d], d == 0 ? 0x100000 : 0, 0);
+    swap_init(devs, prio, PAGING_MAX_MMSWP);
+    memset(&tlb, 0, sizeof(tlb));
+    init_tlbmemphy(&tlb, 64);
+
+    memset(&proc, 0, sizeof(proc));
+    proc.pid = 1;
+    proc.mm = &mm;
+    init_mm(&mm, &proc);
+    proc.mram = &ram;
+    proc.mswp = (struct memphy_struct **)&devs;
+    proc.active_mswp = &devs[0];
+    proc.tlb = &tlb;
+
+    swap_wb_start(nthread[c], ram.nfp >> lowshift[c]);
+    for (rg = 0; rg < BENCH_WB_PAGES / BENCH_WB_RGPAGES; rg++)
+      __alloc(&proc, 0, rg, BENCH_WB_RGPAGES * PAGING_PAGESZ, &addr);
+    MEMPHY_take_cost_ns();
+    cost = now = 0;
+    MEMPHY_set_time_ns(now);
+
+    t0 = bench_now();
+    for (pass = 0; pass < 4; pass++)
+      for (pg = 0; pg < BENCH_WB_PAGES; pg++) {
+        pg_getpage(&mm, pg, &fpn, &proc);
+        MEMPHY_write(&ram, fpn * PAGING_PAGESZ, (BYTE)(pg + pass));
+        /* The process computes between its faults */
+        for (t = bench_now() + BENCH_WB_THINK; bench_now() < t; )
+          ;
+        cost += MEMPHY_take_cost_ns();
+        now = cost + (pass * BENCH_WB_PAGES + pg + 1) * BENCH_WB_THINK * 1e9;
+        MEMPHY_set_time_ns(now);
+      }
+    for (bad = 0, pg = 0; pg < BENCH_WB_PAGES; pg++) {
+      pg_getpage(&mm, pg, &fpn, &proc);
+      MEMPHY_read(&ram, fpn * PAGING_PAGESZ, &v);
+      bad += v != (BYTE)(pg + 3);
+    }
+    t = bench_now() - t0;
+    cost += MEMPHY_take_cost_ns();
+    swap_wb_stop();
+    nbad += bad;
+
+    printf("  %d worker(s), %2d frames free: device %5.2f us per access "
+           "on the CPU, host %5.2f us, %d bad\n", nthread[c],
+           nthread[c] ? ram.nfp >> lowshift[c] : 0, cost / 1e3 / naccess,
+           t * 1e6 / naccess, bad);
+  }
+  swap_stat();
+  return nbad != 0;
+}
+
+#define BENCH_KSM_PROCS 8
+#define BENCH_KSM_PAGES 64 /* per process, half of them zero */
+#define BENCH_KSM_SWPOFF 768 /* swap offset with the KSM and accessed bits */
+
+/*
+ * bench_ksm_swapin - pages swapped out at offsets whose bits overlap
+ * the KSM and accessed bits come back private, not yet accessed under
+ * FIFO, and with their data. Return the number of bad pages
+ */
+static int bench_ksm_swapin(void)
+{
+  static const int prio[PAGING_MAX_MMSWP] = { 0, 0, 0, 0 };
+  struct memphy_struct ram, devs[PAGING_MAX_MMSWP];
+  struct pcb_t proc;
+  struct mm_struct mm;
+  int d, pgn, fpn, addr, bad = 0;
+  uint32_t pte;
+  BYTE v;
+
+  memset(&ram, 0, sizeof(ram));
+  init_memphy(&ram, 16 * PAGING_PAGESZ, 1);
+  memset(devs, 0, sizeof(devs));
+  for (d = 0; d < PAGING_MAX_MMSWP; d++)
+    init_memphy(&devs[d], d == 0 ? 2 * BENCH_KSM_SWPOFF * PAGING_PAGESZ : 0,
+                1);
+  swap_init(devs, prio, PAGING_MAX_MMSWP);
+  /* The slots below are taken, swapped pages land at high offsets */
+  for (d = 0; d < BENCH_KSM_SWPOFF; d++)
+    MEMPHY_get_freefp(&devs[0], &fpn);
+
+  memset(&proc, 0, sizeof(proc));
+  proc.pid = 1;
+  proc.mm = &mm;
+  init_mm(&mm, &proc);
+  proc.mram = &ram;
+  proc.mswp = (struct memphy_struct **)&devs;
+  proc.active_mswp = &devs[0];
+  mm_victim_clock = 0;
+  for (d = 0; d < 4; d++)
+    __alloc(&proc, 0, d, 8 * PAGING_PAGESZ, &addr);
+
+  /* Twice the RAM: the first half goes out as the second comes in */
+  for (pgn = 0; pgn < 32; pgn++) {
+    pg_getpage(&mm, pgn, &fpn, &proc);
+    MEMPHY_write(&ram, fpn * PAGING_PAGESZ, (BYTE)pgn);
+  }
+  for (pgn = 0; pgn < 32; pgn++) {
+    bad += PAGING_PAGE_PRESENT(pte_get(&mm, pgn)) != 0 && pgn < 16;
+    pg_getpage(&mm, pgn, &fpn, &proc);
+    pte = pte_get(&mm, pgn);
+    MEMPHY_read(&ram, fpn * PAGING_PAGESZ, &v);
+    bad += (pte & (PAGING_PTE_KSM_MASK | PAGING_PTE_ACCESSED_MASK)) != 0 ||
+           v != (BYTE)pgn;
+  }
+  mm_victim_clock = MM_VICTIM_CLOCK;
+  swap_wb_drain();
+  return bad;
+}
+
+/*
+ * bench_ksm - processes running the same program with the same data:
+ * frames freed by merging, cost of the scanner, then one write per
+ * process breaking a share. Once the processes are gone every shared
+ * frame must be back in RAM. Last, bench_ksm_swapin()
+ */
+static int bench_ksm(void)
+{
+  struct pcb_t *proc[BENCH_KSM_PROCS];
+  struct memphy_struct tlb;
+  int nfree, nmerged, p, pg, fpn, addr, bad = 0;
+  BYTE v;
+
+  memset(&tlb, 0, sizeof(tlb));
+  init_tlbmemphy(&tlb, 64);
+  for (p = 0; p < BENCH_KSM_PROCS; p++) {
+    proc[p] = bench_proc(p + 1, &tlb);
+    __alloc(proc[p], 0, 0, BENCH_KSM_PAGES * PAGING_PAGESZ, &addr);
+    for (pg = 0; pg < BENCH_KSM_PAGES / 2; pg++) {
+      pg_getpage(proc[p]->mm, pg, &fpn, proc[p]);
+      MEMPHY_write(&bench_mram, fpn * PAGING_PAGESZ, (BYTE)pg);
+    }
+  }
+  nfree = MEMPHY_nfree(&bench_mram);
+
+  ksm_start(&bench_mram, 256, 100);
+  for (p = 0; p < BENCH_KSM_PROCS; p++)
+    ksm_register(proc[p]->mm);
+  /* Processes take their slots while the scanner runs */
+  for (pg = 0; pg < 50; pg++) {
+    usleep(1000);
+    for (p = 0; p < BENCH_KSM_PROCS; p++)
+      ksm_merge(proc[p]);
+  }
+  ksm_stop();
+  nmerged = MEMPHY_nfree(&bench_mram) - nfree;
+  bad += nmerged <= 0;
+  printf("ksm: %d processes x %d pages, %d frames freed\n", BENCH_KSM_PROCS,
+         BENCH_KSM_PAGES, nmerged);
+
+  for (p = 0; p < BENCH_KSM_PROCS; p++)
+    pg_setval(proc[p]->mm, 1 * PAGING_PAGESZ + 1, (BYTE)p, proc[p]);
+  for (p = 0; p < BENCH_KSM_PROCS; p++)
+    for (pg = 0; pg < BENCH_KSM_PAGES; pg++) {
+      pg_getval(proc[p]->mm, pg * PAGING_PAGESZ, &v, proc[p]);
+      bad += v != (pg < BENCH_KSM_PAGES / 2 ? (BYTE)pg : 0);
+    }
+  for (p = 0; p < BENCH_KSM_PROCS; p++) {
+    pg_getval(proc[p]->mm, 1 * PAGING_PAGESZ + 1, &v, proc[p]);
+    bad += v != (BYTE)p;
+  }
+  printf("  after one write per process: %d frames freed, %d bad\n",
+         MEMPHY_nfree(&bench_mram) - nfree, bad);
+  ksm_stat();
+
+  for (p = 0; p < BENCH_KSM_PROCS; p++)
+    free_pcb_memph(proc[p]);
+  printf("  processes freed: %d/%d frames free\n", MEMPHY_nfree(&bench_mram),
+         bench_mram.nfp);
+  bad += MEMPHY_nfree(&bench_mram) != bench_mram.nfp;
+  ksm_stat();
+
+  p = bench_ksm_swapin();
+  printf("  swapped in from offset %d on: %d bad\n", BENCH_KSM_SWPOFF, p);
+  return bad + p != 0;
+}
+
+#define BENCH_SNAP_RAM (1 << 30)
+#define BENCH_SNAP_FILE "bench.snap"
+
+/*
+ * bench_snapshot - checkpoint of a 1 GB RAM, then restoring it by
+ * mapping the snapshot against reading all of it back
+ */
+static int bench_snapshot(void)
+{
+  struct memphy_struct ram, back;
+  struct snap *s;
+  uint64_t time;
+  BYTE *copy;
+  FILE *f;
+  double t, tmap, tread;
+  int fpn, nfp = BENCH_SNAP_RAM / PAGING_PAGESZ, bad = 0;
+  BYTE v;
+
+  init_memphy(&ram, BENCH_SNAP_RAM, 1);
+  for (fpn = 0; fpn < nfp; fpn++)
+    MEMPHY_write(&ram, fpn * PAGING_PAGESZ, (BYTE)fpn);
+
+  t = bench_now();
+  s = snap_create(BENCH_SNAP_FILE);
+  if (s == NULL)
+    return 1;
+  MEMPHY_save(&ram, s);
+  snap_commit(s, 0);
+  t = bench_now() - t;
+  printf("snapshot: %d MB RAM saved in %.3fs\n", BENCH_SNAP_RAM >> 20, t);
+
+  init_memphy(&back, BENCH_SNAP_RAM, 1);
+  tmap = bench_now();
+  s = snap_open(BENCH_SNAP_FILE, &time);
+  bad += s == NULL || MEMPHY_restore(&back, s) < 0 || snap_close(s) < 0;
+  tmap = bench_now() - tmap;
+  for (fpn = 0; fpn < nfp; fpn += 97) {
+    MEMPHY_read(&back, fpn * PAGING_PAGESZ, &v);
+    bad += v != (BYTE)fpn;
+  }
+
+  /* What restoring would cost if the storage were copied in */
+  copy = malloc(BENCH_SNAP_RAM);
+  tread = bench_now();
+  f = fopen(BENCH_SNAP_FILE, "rb");
+  fseek(f, SNAP_ALIGN, SEEK_SET);
+  bad += fread(copy, 1, BENCH_SNAP_RAM, f) != BENCH_SNAP_RAM;
+  fclose(f);
+  tread = bench_now() - tread;
+
+  printf("  restore by mapping %.3fms, by reading %.3fms, %d bad\n",
+         tmap * 1e3, tread * 1e3, bad);
+  free(copy);
+  unlink(BENCH_SNAP_FILE);
+  return bad != 0;
+}
+
+#define BENCH_PGTBL_PROCS 100000
+#define BENCH_PGTBL_NLOOKUP 1000
+
+static double bench_pgtbl_lookup(struct mm_struct *mm, const uint32_t *idx,
+                                 const uint32_t *pgn)
+{
+  volatile uint32_t sink = 0;
+  double t = bench_now();
+  int r, i;
+
+  for (r = 0; r < BENCH_ROUNDS; r++)
+    for (i = 0; i < BENCH_PGTBL_NLOOKUP; i++)
+      sink += pte_get(&mm[idx[i]], pgn[i]);
+  return (bench_now() - t) * 1e9 / BENCH_ROUNDS / BENCH_PGTBL_NLOOKUP;
+}
+
+/*
+ * bench_pgtbl - page table memory of many small processes, and the
+ * cost of a PTE lookup, for the flat, two level and inverted layouts.
+ * Every PTE set must read back, unset ones as 0
+ */
+static int bench_pgtbl(void)
+{
+  static const char *name[] = { "two level", "inverted" };
+  static const int small[] = { 0, 1, PAGING_MAX_PGN - 1 }; /* code, data, stack */
+  static struct pcb_t owner;
+  struct mm_struct *mm;
+  uint32_t *flat, idx[BENCH_PGTBL_NLOOKUP], pgn[BENCH_PGTBL_NLOOKUP];
+  uint32_t idx0[BENCH_PGTBL_NLOOKUP] = { 0 };
+  volatile uint32_t sink = 0;
+  long bytes;
+  double t;
+  int l, p, i, bad = 0;
+
+  for (i = 0; i < BENCH_PGTBL_NLOOKUP; i++) {
+    idx[i] = bench_rand() % BENCH_PGTBL_PROCS;
+    pgn[i] = small[bench_rand() % 3];
+  }
+
+  printf("pgtbl: %d processes of 3 pages, flat table %ld bytes each\n",
+         BENCH_PGTBL_PROCS, (long)(PAGING_MAX_PGN * sizeof(uint32_t)));
+  for (l = 0; l < 2; l++) {
+    mm_pgtbl_inverted = l;
+    mm = malloc((BENCH_PGTBL_PROCS + 1) * sizeof(struct mm_struct));
+    bytes = -ipt_bytes();
+    for (p = 0; p <= BENCH_PGTBL_PROCS; p++)
+      init_mm(&mm[p], &owner);
+    for (p = 0; p < BENCH_PGTBL_PROCS; p++)
+      for (i = 0; i < 3; i++)
+        pte_set(&mm[p], small[i], PAGING_PTE_PRESENT_MASK | (i + 1));
+    bytes += ipt_bytes();
+    for (p = 0; p < BENCH_PGTBL_PROCS && !l; p++) {
+      bytes += PAGING_PGD_SZ * sizeof(uint32_t *);
+      for (i = 0; i < PAGING_PGD_SZ; i++)
+        bytes += mm[p].pgd[i] ? PAGING_PTE_LEAF_SZ * sizeof(uint32_t) : 0;
+    }
+    printf("  %-9s: %ld bytes each, lookup %.2fns\n", name[l],
+           bytes / BENCH_PGTBL_PROCS, bench_pgtbl_lookup(mm, idx, pgn));
+
+    /* The last one maps all of its space */
+    for (i = 0; i < PAGING_MAX_PGN; i++)
+      pte_set(&mm[BENCH_PGTBL_PROCS], i, PAGING_PTE_PRESENT_MASK | i);
+    for (i = 0; i < BENCH_PGTBL_NLOOKUP; i++)
+      pgn[i] = bench_rand() % PAGING_MAX_PGN;
+    printf("  %-9s: lookup in a fully mapped process %.2fns\n", name[l],
+           bench_pgtbl_lookup(&mm[BENCH_PGTBL_PROCS], idx0, pgn));
+    for (i = 0; i < BENCH_PGTBL_NLOOKUP; i++)
+      pgn[i] = small[bench_rand() % 3];
+
+    for (p = 0; p < BENCH_PGTBL_PROCS; p += 97) {
+      for (i = 0; i < 3; i++)
+        bad += pte_get(&mm[p], small[i]) != (PAGING_PTE_PRESENT_MASK | (i + 1));
+      bad += pte_get(&mm[p], 2) != 0;
+    }
+    for (i = 0; i < PAGING_MAX_PGN; i++)
+      bad += pte_get(&mm[BENCH_PGTBL_PROCS], i) != (PAGING_PTE_PRESENT_MASK | i);
+    printf("  %-9s: PTEs read back, %d bad\n", name[l], bad);
+  }
+  mm_pgtbl_inverted = MM_PGTBL_INVERTED;
+
+  flat = calloc(PAGING_MAX_PGN, sizeof(uint32_t));
+  for (i = 0; i < BENCH_PGTBL_NLOOKUP; i++)
+    pgn[i] = bench_rand() % PAGING_MAX_PGN;
+  t = bench_now();
+  for (p = 0; p < BENCH_ROUNDS; p++)
+    for (i = 0; i < BENCH_PGTBL_NLOOKUP; i++)
+      sink += flat[pgn[i]];
+  t = bench_now() - t;
+  printf("  %-9s: lookup in a fully mapped process %.2fns\n", "flat",
+         t * 1e9 / BENCH_ROUNDS / BENCH_PGTBL_NLOOKUP);
+  ipt_stat();
+  return bad != 0;
+}
+
+#define BENCH_XLAT_PAGES 4
+
+/*
+ * bench_xlat - pg_getval()/pg_setval() without a TLB, as in the
+ * MM_PAGING only build: bytes of a few pages read and written in turn,
+ * then read back
+ */
+static int bench_xlat(void)
+{
+  struct pcb_t *proc = bench_proc(1, NULL);
+  long n = 0;
+  int addr, off, r, bad = 0;
+  double t;
+  BYTE v;
+
+  if (__alloc(proc, 0, 0, BENCH_XLAT_PAGES * PAGING_PAGESZ, &addr) < 0) {
+    printf("xlat: region not allocated\n");
+    return 1;
+  }
+  t = bench_now();
+  for (r = 0; r < BENCH_ROUNDS; r++)
+    for (off = 0; off < BENCH_XLAT_PAGES * PAGING_PAGESZ; off++, n++)
+      pg_getval(proc->mm, addr + off, &v, proc);
+  t = bench_now() - t;
+  printf("xlat: %ld reads, %.1fns each\n", n, t * 1e9 / n);
+
+  n = 0;
+  t = bench_now();
+  for (r = 0; r < BENCH_ROUNDS / 10; r++)
+    for (off = 0; off < BENCH_XLAT_PAGES * PAGING_PAGESZ; off++, n++)
+      pg_setval(proc->mm, addr + off, (BYTE)off, proc);
+  t = bench_now() - t;
+  printf("  %ld writes, %.1fns each\n", n, t * 1e9 / n);
+
+  for (off = 0; off < BENCH_XLAT_PAGES * PAGING_PAGESZ; off++) {
+    pg_getval(proc->mm, addr + off, &v, proc);
+    bad += v != (BYTE)off;
+  }
+  printf("  read back: %d bad\n", bad);
+  return bad != 0;
+}
+
+#define BENCH_VICTIM_FRAMES 1024
+#define BENCH_VICTIM_PAGES  8192
+#define BENCH_VICTIM_HOT    256 /* pages used 3 times out of 4 */
+
+/*
+ * bench_victim - FIFO against CLOCK: a hot set of pages reused among a
+ * scan of cold ones too large for RAM. Faults, and host time per fault
+ * with over a thousand resident pages to choose a victim from. CLOCK
+ * must keep the hot set in and fault less
+ */
+static int bench_victim(void)
+{
+  static const int prio[PAGING_MAX_MMSWP] = { 0, 0, 0, 0 };
+  static const char *name[] = { "FIFO", "CLOCK" };
+  struct memphy_struct ram, devs[PAGING_MAX_MMSWP];
+  struct pcb_t proc;
+  struct mm_struct mm;
+  long i, nfault, nfifo = 0, naccess = 200000;
+  int c, d, pgn, fpn, addr, cold, bad = 0;
+  double t;
+
+  printf("victim: %d pages in %d frames, %d hot, %ld accesses\n",
+         BENCH_VICTIM_PAGES, BENCH_VICTIM_FRAMES, BENCH_VICTIM_HOT, naccess);
+  for (c = 0; c < 2; c++) {
+    mm_victim_clock = c;
+    memset(&ram, 0, sizeof(ram));
+    init_memphy(&ram, BENCH_VICTIM_FRAMES * PAGING_PAGESZ, 1);
+    memset(devs, 0, sizeof(devs));
+    for (d = 0; d < PAGING_MAX_MMSWP; d++)
+      init_memphy(&devs[d], d == 0 ? BENCH_VICTIM_PAGES * PAGING_PAGESZ : 0, 1);
+    swap_init(devs, prio, PAGING_MAX_MMSWP);
+
+    memset(&proc, 0, sizeof(proc));
+    proc.pid = 1;
+    proc.mm = &mm;
+    init_mm(&mm, &proc);
+    proc.mram = &ram;
+    proc.mswp = (struct memphy_struct **)&devs;
+    proc.active_mswp = &devs[0];
+    /* A region may not exceed RAM */
+    for (d = 0; d < BENCH_VICTIM_PAGES / BENCH_VICTIM_HOT; d++)
+      bad += __alloc(&proc, 0, d, BENCH_VICTIM_HOT * PAGING_PAGESZ, &addr) < 0;
+
+    nfault = 0;
+    cold = BENCH_VICTIM_HOT;
+    t = bench_now();
+    for (i = 0; i < naccess; i++) {
+      if (i % 4 == 3) {
+        pgn = cold;
+        cold = cold + 1 < BENCH_VICTIM_PAGES ? cold + 1 : BENCH_VICTIM_HOT;
+      } else {
+        pgn = bench_rand() % BENCH_VICTIM_HOT;
+      }
+      nfault += !PAGING_PAGE_PRESENT(pte_get(&mm, pgn));
+      pg_getpage(&mm, pgn, &fpn, &proc);
+    }
+    t = bench_now() - t;
+    printf("  %-5s: %ld faults (%.1f%%), %.2f us per fault\n", name[c],
+           nfault, 100.0 * nfault / naccess, t * 1e6 / nfault);
+    if (c == 0)
+      nfifo = nfault;
+    else
+      bad += nfault >= nfifo;
+  }
+  mm_victim_clock = MM_VICTIM_CLOCK;
+  printf("  %s\n", bad ? "FAILED" : "ok");
+  return bad != 0;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *mode = (argc > 1) ? argv[1] : "tlb";
+
+  if (!strcmp(mode, "tlb"))
+    return bench_tlb();
+  if (!strcmp(mode, "tlbfa"))
+    return bench_tlb_assoc();
+  if (!strcmp(mode, "prefetch"))
+    return bench_prefetch();
+  if (!strcmp(mode, "huge"))
+    return bench_huge();
+  if (!strcmp(mode, "sweep"))
+    return bench_sweep();
+  if (!strcmp(mode, "frames"))
+    return bench_frames();
+  if (!strcmp(mode, "buddy"))
+    return bench_buddy();
+  if (!strcmp(mode, "swap"))
+    return bench_swap();
+  if (!strcmp(mode, "dump"))
+    return bench_dump();
+  if (!strcmp(mode, "zswap"))
+    return bench_zswap();
+  if (!strcmp(mode, "swapdev"))
+    return bench_swapdev();
+  if (!strcmp(mode, "writeback"))
+    return bench_writeback();
+  if (!strcmp(mode, "ksm"))
+    return bench_ksm();
+  if (!strcmp(mode, "snapshot"))
+    return bench_snapshot();
+  if (!strcmp(mode, "pgtbl"))
+    return bench_pgtbl();
+  if (!strcmp(mode, "xlat"))
+    return bench_xlat();
+  if (!strcmp(mode, "victim"))
+    return bench_victim();
+
+  printf("bench: unknown mode '%s'\n", mode);
+  printf("Usage: bench [tlb|tlbfa|prefetch|huge|sweep|frames|buddy|swap|dump|zswap|swapdev|writeback|ksm|snapshot|pgtbl|xlat|victim]\n");
+  return 1;
+}
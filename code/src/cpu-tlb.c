@@ -13,8 +13,326 @@
  */
  
 #include "mm.h"
+#include "snapshot.h"
+#include "trace.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <pthread.h>
+
+/*
+ * ASID allocation. A process tags its TLB entries with an ASID drawn
+ * from the current generation. Flushing a process only hands it a fresh
+ * ASID; entries under the old one never match again and are replaced
+ * lazily. When the ASID space runs out the generation is bumped, the
+ * TLB is wiped in bulk and every process picks up a new ASID on its
+ * next access.
+ */
+static pthread_mutex_t tlb_asid_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t tlb_asid_gen = 1; /* 0 marks a process without ASID */
+static uint32_t tlb_asid_next = 1;
+
+static void tlb_new_asid(struct pcb_t *proc)
+{
+  pthread_mutex_lock(&tlb_asid_lock);
+  if (tlb_asid_next > TLB_ASID_MAX) {
+    /* Rollover: no ASID of the old generation may stay cached.
+     * Shared levels are wiped here, private ones in tlb_asid_of() */
+    struct memphy_struct *mp;
+    for (mp = proc->tlb; mp != NULL; mp = mp->tlb_next)
+      if (mp->tlb_locks != NULL)
+        tlb_flush_all(mp);
+    __atomic_store_n(&tlb_asid_gen, tlb_asid_gen + 1, __ATOMIC_RELEASE);
+    tlb_asid_next = 1;
+  }
+  proc->tlb_asid = tlb_asid_next++;
+  proc->tlb_asid_gen = tlb_asid_gen;
+  pthread_mutex_unlock(&tlb_asid_lock);
+}
+
+/*tlb_asid_of - ASID to tag the TLB entries of @proc with */
+uint32_t tlb_asid_of(struct pcb_t *proc)
+{
+  uint32_t gen = __atomic_load_n(&tlb_asid_gen, __ATOMIC_ACQUIRE);
+  struct memphy_struct *mp;
+
+  if (proc->tlb_asid_gen != gen) {
+    tlb_new_asid(proc);
+    gen = proc->tlb_asid_gen;
+  }
+
+  /* Private levels are wiped after a rollover by their owner CPU */
+  for (mp = proc->tlb; mp != NULL && mp->tlb_locks == NULL; mp = mp->tlb_next) {
+    if (mp->tlb_asid_gen != gen) {
+      tlb_flush_all(mp);
+      mp->tlb_asid_gen = gen;
+    }
+  }
+
+  return proc->tlb_asid;
+}
+
+/*tlb_asid_save - write the ASID allocator to a snapshot */
+int tlb_asid_save(struct snap *s)
+{
+  pthread_mutex_lock(&tlb_asid_lock);
+  snap_put_u32(s, tlb_asid_gen);
+  snap_put_u32(s, tlb_asid_next);
+  pthread_mutex_unlock(&tlb_asid_lock);
+  return 0;
+}
+
+/*tlb_asid_restore - take the ASID allocator from a snapshot, the TLB
+ *entries and processes tagged with its ASIDs come with it */
+int tlb_asid_restore(struct snap *s)
+{
+  pthread_mutex_lock(&tlb_asid_lock);
+  __atomic_store_n(&tlb_asid_gen, snap_get_u32(s), __ATOMIC_RELEASE);
+  tlb_asid_next = snap_get_u32(s);
+  pthread_mutex_unlock(&tlb_asid_lock);
+  return 0;
+}
+
+/*
+ * TLB shootdown. The CPU that changes a mapping invalidates its own L1
+ * and the shared levels at once, and queues the invalidation to every
+ * other CPU. Those apply their queue at their next time slot, before
+ * running anything, see tlb_shootdown_apply(). Adjacent ranges of one
+ * ASID are merged into one request; a full queue degrades to a flush.
+ */
+struct tlb_shootdown {
+  pthread_mutex_t lock;
+  int nreq;
+  int overflow; /* too many requests, flush the whole L1 */
+  struct {
+    uint32_t asid;
+    int pgn_start;
+    int pgn_end;
+  } req[TLB_SHOOTDOWN_QSZ];
+};
+
+static pthread_mutex_t tlb_sd_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct memphy_struct **tlb_sd_cpus;
+static int tlb_sd_ncpus;
+
+/* Shootdown statistics */
+static unsigned long tlb_sd_issued;   /* tlb_shootdown() calls */
+static unsigned long tlb_sd_posted;   /* requests queued to remote CPUs */
+static unsigned long tlb_sd_merged;   /* requests merged into a queued one */
+static unsigned long tlb_sd_batches;  /* non-empty queues applied */
+static unsigned long tlb_sd_applied;  /* requests applied */
+static unsigned long tlb_sd_flushes;  /* overflowed queues applied */
+
+/*tlb_shootdown_register - let a CPU's private TLB receive shootdowns */
+int tlb_shootdown_register(struct memphy_struct *mp)
+{
+  struct tlb_shootdown *sd = malloc(sizeof(struct tlb_shootdown));
+
+  pthread_mutex_init(&sd->lock, NULL);
+  sd->nreq = 0;
+  sd->overflow = 0;
+  mp->tlb_sd = sd;
+
+  pthread_mutex_lock(&tlb_sd_lock);
+  tlb_sd_cpus = realloc(tlb_sd_cpus, (tlb_sd_ncpus + 1) * sizeof(*tlb_sd_cpus));
+  tlb_sd_cpus[tlb_sd_ncpus++] = mp;
+  pthread_mutex_unlock(&tlb_sd_lock);
+
+  return 0;
+}
+
+static void tlb_shootdown_post(struct tlb_shootdown *sd, uint32_t asid,
+                               int pgn_start, int pgn_end)
+{
+  pthread_mutex_lock(&sd->lock);
+  if (sd->nreq > 0 && sd->req[sd->nreq - 1].asid == asid &&
+      pgn_start <= sd->req[sd->nreq - 1].pgn_end + 1 &&
+      pgn_end >= sd->req[sd->nreq - 1].pgn_start - 1) {
+    /* Batch with the previous request */
+    if (pgn_start < sd->req[sd->nreq - 1].pgn_start)
+      sd->req[sd->nreq - 1].pgn_start = pgn_start;
+    if (pgn_end > sd->req[sd->nreq - 1].pgn_end)
+      sd->req[sd->nreq - 1].pgn_end = pgn_end;
+    __atomic_fetch_add(&tlb_sd_merged, 1, __ATOMIC_RELAXED);
+  } else if (sd->nreq < TLB_SHOOTDOWN_QSZ) {
+    sd->req[sd->nreq].asid = asid;
+    sd->req[sd->nreq].pgn_start = pgn_start;
+    sd->req[sd->nreq].pgn_end = pgn_end;
+    sd->nreq++;
+  } else {
+    sd->overflow = 1;
+  }
+  pthread_mutex_unlock(&sd->lock);
+  __atomic_fetch_add(&tlb_sd_posted, 1, __ATOMIC_RELAXED);
+}
+
+/*tlb_shootdown - invalidate pages [pgn_start, pgn_end] of @proc in all TLBs
+ *@proc: process whose mapping changed, running on the calling CPU
+ */
+int tlb_shootdown(struct pcb_t *proc, int pgn_start, int pgn_end)
+{
+  uint32_t asid = tlb_asid_of(proc);
+  struct memphy_struct *mp;
+  int i;
+
+  if (pgn_start > pgn_end)
+    return -1;
+
+  /* Local CPU and shared levels right now */
+  for (mp = proc->tlb; mp != NULL; mp = mp->tlb_next)
+    tlb_cache_invalidate_range(mp, asid, pgn_start, pgn_end);
+
+  /* Other CPUs at their next slot */
+  for (i = 0; i < tlb_sd_ncpus; i++)
+    if (tlb_sd_cpus[i] != proc->tlb)
+      tlb_shootdown_post(tlb_sd_cpus[i]->tlb_sd, asid, pgn_start, pgn_end);
+
+  __atomic_fetch_add(&tlb_sd_issued, 1, __ATOMIC_RELAXED);
+  tlb_stat_forget(proc->pid, pgn_start, pgn_end);
+  return 0;
+}
+
+/*tlb_shootdown_apply - apply the invalidations queued to a CPU's TLB
+ *@mp: private TLB of the calling CPU
+ */
+int tlb_shootdown_apply(struct memphy_struct *mp)
+{
+  struct tlb_shootdown *sd = mp->tlb_sd;
+  int i;
+
+  if (sd == NULL)
+    return 0;
+
+  pthread_mutex_lock(&sd->lock);
+  if (sd->nreq == 0 && !sd->overflow) {
+    pthread_mutex_unlock(&sd->lock);
+    return 0;
+  }
+
+  if (sd->overflow) {
+    tlb_flush_all(mp);
+    __atomic_fetch_add(&tlb_sd_flushes, 1, __ATOMIC_RELAXED);
+  } else {
+    for (i = 0; i < sd->nreq; i++)
+      tlb_cache_invalidate_range(mp, sd->req[i].asid,
+                                 sd->req[i].pgn_start, sd->req[i].pgn_end);
+  }
+  __atomic_fetch_add(&tlb_sd_batches, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&tlb_sd_applied, sd->nreq, __ATOMIC_RELAXED);
+  sd->nreq = 0;
+  sd->overflow = 0;
+  pthread_mutex_unlock(&sd->lock);
+
+  return 0;
+}
+
+/*tlb_shootdown_stat - report shootdown count and batching efficiency */
+int tlb_shootdown_stat(void)
+{
+  printf("TLB shootdown: %lu issued, %lu posted to remote CPUs, %lu merged,"
+         " %lu batches applied (%.1f posts/batch, %lu requests), %lu overflow flushes\n",
+         tlb_sd_issued, tlb_sd_posted, tlb_sd_merged, tlb_sd_batches,
+         tlb_sd_batches ? (double)tlb_sd_posted / tlb_sd_batches : 0.0,
+         tlb_sd_applied, tlb_sd_flushes);
+  return 0;
+}
+
+/*
+ * TLB refill. After a page walk resolved a missed page, its translation
+ * is installed so the next access hits. The largest aligned run of up
+ * to 2^tlb_huge_order pages around it that is mapped to contiguous
+ * frames goes into one entry. The prefetcher also installs up to
+ * tlb_prefetch_depth following pages that are present in RAM.
+ */
+int tlb_prefetch_depth = CPUTLB_PREFETCH;
+int tlb_huge_order = CPUTLB_HUGE_ORDER;
+
+/* Pages merged by KSM are left out: a write hit would bypass the copy
+ * on write of pg_setval() */
+static int tlb_pte_online(uint32_t pte)
+{
+  return PAGING_PAGE_PRESENT(pte) && !PAGING_PAGE_SWAPPED(pte) &&
+         !(pte & PAGING_PTE_KSM_MASK);
+}
+
+/* PTE read outside a page walk: swap writeback completes on its own
+ * threads and updates PTEs under mm_lock */
+static uint32_t tlb_pte_of(struct pcb_t *proc, int pgn)
+{
+  uint32_t pte;
+
+  pthread_mutex_lock(&proc->mm->mm_lock);
+  pte = pte_get(proc->mm, pgn);
+  pthread_mutex_unlock(&proc->mm->mm_lock);
+
+  return pte;
+}
+
+/*tlb_run_order - largest aligned run around a present page
+ *@mm: page table owner
+ *@pgn: page number
+ *@base: returned first page of the run
+ *Return log2 of the number of pages of the run
+ */
+static int tlb_run_order(struct mm_struct *mm, int pgn, int *base)
+{
+  int k, b, i;
+
+  for (k = tlb_huge_order; k > 0; k--) {
+    b = pgn & ~((1 << k) - 1);
+    if (b + (1 << k) > PAGING_MAX_PGN || !tlb_pte_online(pte_get(mm, b)))
+      continue;
+
+    for (i = 1; i < (1 << k); i++) {
+      uint32_t pte = pte_get(mm, b + i);
+      if (!tlb_pte_online(pte) ||
+          PAGING_PTE_FPN(pte) != PAGING_PTE_FPN(pte_get(mm, b)) + i)
+        break;
+    }
+    if (i == (1 << k)) {
+      *base = b;
+      return k;
+    }
+  }
+
+  *base = pgn;
+  return 0;
+}
+
+/*tlb_install_run - cache the run of a present page in one entry
+ *Return the page following the run
+ */
+static int tlb_install_run(struct pcb_t *proc, uint32_t asid, int pgn)
+{
+  int base, order;
+
+  order = tlb_run_order(proc->mm, pgn, &base);
+  tlb_cache_write_order(proc->tlb, asid, base,
+                        PAGING_PTE_FPN(pte_get(proc->mm, base)), order, 1);
+  return base + (1 << order);
+}
+
+/*tlb_refill - install the translation of a walked page
+ *@proc: process owning the page
+ *@pgn: page number
+ *@fpn: frame the page lives in
+ */
+int tlb_refill(struct pcb_t *proc, int pgn, int fpn)
+{
+  uint32_t asid;
+  int next;
+
+  if (proc->tlb == NULL || !tlb_pte_online(pte_get(proc->mm, pgn)))
+    return -1;
+
+  asid = tlb_asid_of(proc);
+  next = tlb_install_run(proc, asid, pgn);
+
+  while (next <= pgn + tlb_prefetch_depth && next < PAGING_MAX_PGN &&
+         tlb_pte_online(pte_get(proc->mm, next)))
+    next = tlb_install_run(proc, asid, next);
+
+  return 0;
+}
 
 int tlb_change_all_page_tables_of(struct pcb_t *proc,  struct memphy_struct * mp)
 {
@@ -27,19 +345,9 @@ int tlb_change_all_page_tables_of(struct pcb_t *proc,  struct memphy_struct * mp
 
 int tlb_flush_tlb_of(struct pcb_t *proc, struct memphy_struct * mp)
 {
-  // Lặp qua tất cả các trang trong cache TLB
-    // for (int i = 0; i < mp->maxsz; i++) {
-    //     // Đặt các giá trị của mỗi trang về trạng thái mặc định
-    //     mp->tlb[i].pid = -1;
-    //     mp->tlb[i].pgnum = -1;
-    //     mp->tlb[i].value = -1;
-    //     mp->tlb[i].valid = 0;
-    // }
-    for(int i=0; i<mp->maxsz; i++){
-        if(tlb_get_pid(mp, i) == proc->pid){
-            tlb_set_value(mp,i,tlb_create_value(0,0,0),-1);
-        }
-    }
+    /* O(1): stale entries of the old ASID are ignored on lookup */
+    tlb_new_asid(proc);
+    tlb_stat_flush(proc->pid);
     return 0;
 }
 
@@ -58,18 +366,27 @@ int tlballoc(struct pcb_t *proc, uint32_t size, uint32_t reg_index)
   /* TODO update TLB CACHED frame num of the new allocated page(s)*/
   /* by using tlb_cache_read()/tlb_cache_write()*/
   int n_page = (PAGING_PAGE_ALIGNSZ(proc->mm->symrgtbl[reg_index].rg_end) - PAGING_PAGE_ALIGNSZ(proc->mm->symrgtbl[reg_index].rg_start))/PAGING_PAGESZ;
+  int pgn_start = PAGING_PGN(proc->mm->symrgtbl[reg_index].rg_start);
+  pthread_mutex_lock(&proc->mm->mm_lock);
   printf("SO TRANG DUOC CUNG CAP VA TLB PGN: %d page ",n_page);
   for(int i=0;i<n_page;i++){
-      int pgn = PAGING_PGN(proc->mm->symrgtbl[reg_index].rg_start)+i;
-      // printf("TLB PGN : %d\n",pgn);
-        printf("%d ",pgn);
-      tlb_set_value(proc->tlb,
-                    tlb_get_addr(proc->tlb,proc->pid,pgn),
-                    tlb_create_value(proc->mm->pgd[pgn],pgn,1),
-                    proc->pid);
-      // printf("DOC RA %08x\n %d",tlb_get_value(proc->tlb,tlb_get_addr(proc->tlb,proc->pid,pgn)),tlb_get_addr(proc->tlb,proc->pid,pgn));
+        printf("%d ",pgn_start+i);
+        TRACE(proc->pid, TRACE_ALLOC, (pgn_start + i) * PAGING_PAGESZ, 1,
+              PAGING_PTE_FPN(pte_get(proc->mm, pgn_start + i)));
   }
   printf("\n");
+
+  /* Contiguous runs of the region take one entry each. Pages the
+   * allocation did not map (RAM exhausted, or a region carved out of
+   * the current sbrk page) have no frame to cache */
+  for(int pgn=pgn_start; pgn<pgn_start+n_page; ){
+      if(!tlb_pte_online(pte_get(proc->mm, pgn))){
+          pgn++;
+          continue;
+      }
+      pgn = tlb_install_run(proc, tlb_asid_of(proc), pgn);
+  }
+  pthread_mutex_unlock(&proc->mm->mm_lock);
   TLBMEMPHY_dump(proc->tlb);
   return val;
 }
@@ -85,11 +402,7 @@ int tlbfree_data(struct pcb_t *proc, uint32_t reg_index)
   int end_addr = PAGING_PGN(proc->mm->symrgtbl[reg_index].rg_end);
 
   __free(proc, 0, reg_index);
-  for(int i=start_addr;i<=end_addr;i++){
-      // tlb_set_value(proc->tlb,tlb_get_addr(proc->tlb,proc->pid,PAGING_PGN(proc->mm->symrgtbl[reg_index].rg_start)+i),tlb_create_value(reg_index,addr+i,1),proc->pid);
-
-      tlb_set_value(proc->tlb,tlb_get_addr(proc->tlb,proc->pid,PAGING_PGN(proc->mm->symrgtbl[reg_index].rg_start)+i),tlb_create_value(0,0,0),proc->pid);
-  }
+  tlb_shootdown(proc, start_addr, end_addr);
   /* TODO update TLB CACHED frame num of freed page(s)*/
   /* by using tlb_cache_read()/tlb_cache_write()*/
   printf("FREE %d page\n", end_addr-start_addr);
@@ -116,14 +429,19 @@ int tlbread(struct pcb_t * proc, uint32_t source,
   /* frmnum is return value of tlb_cache_read/write value*/
   int page = PAGING_PGN((proc->mm->symrgtbl[source].rg_start + offset));
   int off = PAGING_OFFST((proc->mm->symrgtbl[source].rg_start + offset));
-  frmnum = tlb_cache_read(proc->tlb, proc->pid, page, &val);
+  frmnum = tlb_cache_read(proc->tlb, tlb_asid_of(proc), page, &val);
+  tlb_stat_ref(proc, page, frmnum >= 0);
 	if(frmnum<0){
     val = __read(proc, 0, source, offset, &data);
   }else{
+    pg_mark_accessed(proc->mm, page);
     int addr =( frmnum << PAGING_ADDR_FPN_LOBIT )+ off;
     val = MEMPHY_read(proc->mram,addr,&data);
     printf("READ DATA: %d\n",data);
   }
+  TRACE(proc->pid, TRACE_TLBREAD,
+        proc->mm->symrgtbl[source].rg_start + offset, frmnum >= 0,
+        PAGING_PTE_FPN(tlb_pte_of(proc, page)));
 #ifdef IODUMP
   if (frmnum >= 0)
     printf("TLB hit at read region=%d offset=%d\n", 
@@ -166,14 +484,19 @@ int tlbwrite(struct pcb_t * proc, int data_,
   int page = PAGING_PGN((proc->mm->symrgtbl[destination].rg_start + offset));
   int off = PAGING_OFFST((proc->mm->symrgtbl[destination].rg_start + offset));
   printf("PAGE %d\n",page);
-  frmnum = tlb_cache_read(proc->tlb, proc->pid, page, &t);
+  frmnum = tlb_cache_read(proc->tlb, tlb_asid_of(proc), page, &t);
+  tlb_stat_ref(proc, page, frmnum >= 0);
 	if(frmnum<0){
     val = __write(proc, 0, destination, offset,data);
   }else{
+    pg_mark_accessed(proc->mm, page);
     int addr = (frmnum << PAGING_ADDR_FPN_LOBIT )+ off;
     val = MEMPHY_write(proc->mram,addr,data);
     printf("WRITE DATA: %d\n",data);
   }
+  TRACE(proc->pid, TRACE_TLBWRITE,
+        proc->mm->symrgtbl[destination].rg_start + offset, frmnum >= 0,
+        PAGING_PTE_FPN(tlb_pte_of(proc, page)));
 #ifdef IODUMP
   if (frmnum >= 0)
     printf("TLB hit at write region=%d offset=%d value=%d\n",
@@ -18,63 +18,143 @@
 
 
 #include "mm.h"
+#include "snapshot.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define init_tlbcache(mp,sz,...) init_memphy(mp, sz, (1, ##__VA_ARGS__))
 
+/* Lock stripe of a shared TLB level, one per cache line */
+struct tlb_stripe {
+    pthread_mutex_t lock;
+} __attribute__((aligned(TLB_ENTRY_ALIGN)));
+
 /*
- *  tlb_cache_read read TLB cache device
- *  @mp: memphy struct
- *  @pid: process id
- *  @pgnum: page number
- *  @value: obtained value
+ *  TLB entries live in a struct-of-arrays store (mp->tlb_tag, mp->tlb_fpn,
+ *  mp->tlb_flags). The tag packs VALID | PID | PGN in one word, so the
+ *  hit check of a lookup is a single compare with TLB_TAG(pid, pgn).
+ *
+ *  An entry of order k maps the 2^k pages from its aligned base PGN to
+ *  the 2^k frames from its FPN on. A page is looked up by probing the
+ *  base of each order the level currently holds (mp->tlb_orders).
  */
-uint32_t tlb_create_value(uint32_t pte,uint32_t pgn,int _valid){
-    uint32_t fpn = pte & 0x00001FFF;
-    uint32_t pgnum = pgn; pgnum=pgnum<<13;
-    uint32_t valid = _valid; valid=valid<<31;
-    uint32_t swap = pte & 0x40000000; swap=swap<<30;
-    uint32_t val = valid | swap | pgnum | fpn;
-    // printf("PTE: %08x\n",pgn);
-    // printf("FPN %08x, PGN %08x, \n",fpn,pgnum);
-    return val;
-} // Create a TLB value
 int tlb_get_pid(struct memphy_struct* mp,int addr){
-    if(!mp) return -1;
+    /* The PID field carries the ASID of the owner */
     if(tlb_empty(mp,addr)) return -1;
-    return mp->storage[addr*5+4];
-} // Get PID from TLB value
+    return TLB_TAG_PID(mp->tlb_tag[addr]);
+} // Get PID of TLB entry
 int tlb_empty(struct memphy_struct* mp, int addr){
     if(!mp) return -1;
     if(addr<0 || addr>=mp->maxsz) return -1;
-    uint32_t val = tlb_get_value(mp,addr);
-    val = val & 0x80000000;
-    // if(mp->storage[addr*5]==0 && mp->storage[addr*5+1]==0 && mp->storage[addr*5+2]==0 && mp->storage[addr*5+3]==0 && mp->storage[addr*5+4]==0) return 1;
-    return !val;
-
-} // Empty TLB value
+    return !(mp->tlb_tag[addr] & TLB_TAG_VALID_MASK);
+} // Empty TLB entry
 uint32_t tlb_get_pgn(struct memphy_struct* mp, int addr){
+    if(tlb_empty(mp,addr)) return -1;
+    return TLB_TAG_PGN(mp->tlb_tag[addr]);
+} // Get PGN of TLB entry
+int tlb_set_entry(struct memphy_struct* mp, int addr, int pid, int pgn, int fpn, int order){
     if(!mp) return -1;
+    if(addr<0 || addr>=mp->maxsz) return -1;
+    mp->tlb_tag[addr] = TLB_TAG(pid, pgn);
+    mp->tlb_fpn[addr] = fpn;
+    mp->tlb_flags[addr] = TLB_FLG_SET_ORDER(order);
+    if(!(__atomic_load_n(&mp->tlb_orders, __ATOMIC_RELAXED) & BIT(order)))
+        __atomic_fetch_or(&mp->tlb_orders, BIT(order), __ATOMIC_RELAXED);
+    return 0;
+} // Set TLB entry
+int tlb_get_order(struct memphy_struct* mp, int addr){
     if(tlb_empty(mp,addr)) return -1;
-    uint32_t pgn = tlb_get_value(mp,addr);
-    pgn = pgn & 0x07FFE000;
-    pgn = pgn >> 13;
-    return pgn;
-} // Get PGN from TLB value
-int tlb_set_value(struct memphy_struct* mp, int addr, uint32_t value,int pid){
+    return TLB_FLG_ORDER(mp->tlb_flags[addr]);
+} // Get number of pages (log2) of TLB entry
+int tlb_clear_entry(struct memphy_struct* mp, int addr){
     if(!mp) return -1;
     if(addr<0 || addr>=mp->maxsz) return -1;
-    // printf("GHI VAO TLB: %08x\n",value);
-    mp->storage[addr*5] = (value & 0xFF000000 )>> 24;
-    mp->storage[addr*5+1] = (value &0x00FF0000 ) >> 16;
-    mp->storage[addr*5+2] = (value & 0x0000FF00) >> 8;
-    mp->storage[addr*5+3] = (value & 0x000000FF) ;
-    mp->storage[addr*5+4] = pid;
+    mp->tlb_tag[addr] = 0;
     return 0;
+} // Invalidate TLB entry
 
-} // Set TLB value
+/*
+ *  tlb_fa_find - fully associative tag match
+ *  Compare @tag against the whole packed tag array, 8 (AVX2) or 4 (SSE2)
+ *  entries per instruction. The array is padded to a cache line with
+ *  invalid (zero) tags, so the vector loop needs no scalar tail; a
+ *  match in the padding, past maxsz, is no match.
+ *  Return the entry index, or -1 if no entry carries @tag
+ */
+static int tlb_fa_find(struct memphy_struct* mp, uint32_t tag){
+    int i;
+#if defined(__AVX2__)
+    __m256i key = _mm256_set1_epi32(tag);
+    for(i = 0; i < mp->maxsz; i += 8){
+        __m256i v = _mm256_load_si256((const __m256i *)&mp->tlb_tag[i]);
+        int m = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, key)));
+        if(m){
+            i += __builtin_ctz(m);
+            return (i < mp->maxsz) ? i : -1;
+        }
+    }
+#elif defined(__SSE2__)
+    __m128i key = _mm_set1_epi32(tag);
+    for(i = 0; i < mp->maxsz; i += 4){
+        __m128i v = _mm_load_si128((const __m128i *)&mp->tlb_tag[i]);
+        int m = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, key)));
+        if(m){
+            i += __builtin_ctz(m);
+            return (i < mp->maxsz) ? i : -1;
+        }
+    }
+#else
+    for(i = 0; i < mp->maxsz; i++){
+        if(mp->tlb_tag[i] == tag) return i;
+    }
+#endif
+    return -1;
+}
+
+/*
+ *  tlb_lookup - index of the entry caching (pid, pgn), or -1 on a miss
+ */
+static int tlb_lookup(struct memphy_struct* mp, int pid, int pgn){
+    uint32_t tag = TLB_TAG(pid, pgn);
+    int addr;
+
+    if(mp->tlb_fa)
+        return tlb_fa_find(mp, tag);
+
+    addr = tlb_get_addr(mp, pid, pgn);
+    return (mp->tlb_tag[addr] == tag) ? addr : -1;
+}
+
+/*
+ *  tlb_get_addr - entry where (pid, pgn) is or will be cached.
+ *  Hashed (direct mapped) mode derives it from pid and pgn. Fully
+ *  associative mode reuses a matching or an invalid entry, else
+ *  replaces entries in CLOCK order.
+ */
 int tlb_get_addr(struct memphy_struct* mp, int pid, int pgn){
+    if(mp->tlb_fa){
+        int addr = tlb_fa_find(mp, TLB_TAG(pid, pgn));
+        if(addr < 0)
+            addr = tlb_fa_find(mp, 0);
+        while(addr < 0){
+            /* CLOCK: give recently hit entries a second chance */
+            int hand = mp->tlb_fa_hand;
+            mp->tlb_fa_hand = (hand + 1) % mp->maxsz;
+            if(mp->tlb_flags[hand] & TLB_FLG_REF)
+                mp->tlb_flags[hand] &= ~TLB_FLG_REF;
+            else
+                addr = hand;
+        }
+        return addr;
+    }
+
     uint32_t pid_ = pid;
     pid_ = pid_ * 9173;
     pid_ = pid_ + pgn+971;
@@ -82,42 +162,174 @@ int tlb_get_addr(struct memphy_struct* mp, int pid, int pgn){
     return pid_;
 } // Get TLB address
 int tlb_get_fpn(struct memphy_struct* mp, int addr){
-    if(!mp) return -1;
     if(tlb_empty(mp,addr)) return -1;
-    uint32_t fpn = tlb_get_value(mp,addr);
-    fpn = fpn & 0x00001FFF;
-    return fpn;
-} // Get FPN from TLB value
-uint32_t tlb_get_value(struct memphy_struct* mp, int addr){
-    uint32_t val = 0;
-    uint32_t t1=( mp->storage[addr*5]  & 0x000000FF ) << 24;
-    uint32_t t2=( mp->storage[addr*5+1] & 0x000000FF ) <<16;
-    uint32_t t3=( mp->storage[addr*5+2] & 0x000000FF) <<8;
-    uint32_t t4=( mp->storage[addr*5+3] & 0x000000FF) ;
-    val =t1|t2|t3|t4;
-    return val;
-} // Get TLB value
+    return mp->tlb_fpn[addr];
+} // Get FPN of TLB entry
+
+/*
+ *  tlb_stripe_lock - lock the stripe guarding the entry of (pid, pgn)
+ *  Only shared levels have stripes. A hashed level maps each key to one
+ *  entry, so the stripe follows the entry index. A fully associative
+ *  level may place a key anywhere and uses a single stripe.
+ */
+static pthread_mutex_t *tlb_stripe_lock(struct memphy_struct *mp, int pid, int pgn)
+{
+    pthread_mutex_t *lock;
+
+    if (mp->tlb_locks == NULL)
+        return NULL;
+
+    if (mp->tlb_fa)
+        lock = &mp->tlb_locks[0].lock;
+    else
+        lock = &mp->tlb_locks[tlb_get_addr(mp, pid, pgn) % mp->tlb_nlocks].lock;
+
+    __atomic_fetch_add(&mp->tlb_lock_acqs, 1, __ATOMIC_RELAXED);
+    if (pthread_mutex_trylock(lock) != 0) {
+        __atomic_fetch_add(&mp->tlb_lock_waits, 1, __ATOMIC_RELAXED);
+        pthread_mutex_lock(lock);
+    }
+    return lock;
+}
+
+static void tlb_stripe_unlock(pthread_mutex_t *lock)
+{
+    if (lock != NULL)
+        pthread_mutex_unlock(lock);
+}
 
+static void tlb_lock_all(struct memphy_struct *mp)
+{
+    int i;
+
+    for (i = 0; mp->tlb_locks != NULL && i < mp->tlb_nlocks; i++)
+        pthread_mutex_lock(&mp->tlb_locks[i].lock);
+}
+
+static void tlb_unlock_all(struct memphy_struct *mp)
+{
+    int i;
+
+    for (i = 0; mp->tlb_locks != NULL && i < mp->tlb_nlocks; i++)
+        pthread_mutex_unlock(&mp->tlb_locks[i].lock);
+}
+
+/*
+ *  tlb_find - find the entries of this level covering page (pid, pgn)
+ *  Each candidate base is probed under its own stripe lock.
+ *  @clear: drop every covering entry instead of returning the first
+ *  @fpn: frame of page pgn in the found entry
+ *  @base, @order: pages the found entry maps
+ *  Return the entry index (number of dropped entries if @clear), -1 if none
+ */
+static int tlb_find(struct memphy_struct *mp, int pid, int pgn, int clear,
+                    int *fpn, int *base, int *order)
+{
+    uint32_t orders = __atomic_load_n(&mp->tlb_orders, __ATOMIC_RELAXED);
+    pthread_mutex_t *lock;
+    int k, b, addr, found = -1;
+
+    for (k = 0; orders != 0; k++, orders >>= 1) {
+        if (!(orders & 1))
+            continue;
+
+        b = pgn & ~((1 << k) - 1);
+        lock = tlb_stripe_lock(mp, pid, b);
+        addr = tlb_lookup(mp, pid, b);
+        if (addr >= 0 && pgn - b < (1 << TLB_FLG_ORDER(mp->tlb_flags[addr]))) {
+            if (clear) {
+                tlb_clear_entry(mp, addr);
+                found = (found < 0) ? 1 : found + 1;
+            } else {
+                if (mp->tlb_fa)
+                    mp->tlb_flags[addr] |= TLB_FLG_REF;
+                *fpn = mp->tlb_fpn[addr] + (pgn - b);
+                *base = b;
+                *order = TLB_FLG_ORDER(mp->tlb_flags[addr]);
+                tlb_stripe_unlock(lock);
+                return addr;
+            }
+        }
+        tlb_stripe_unlock(lock);
+    }
+
+    return found;
+}
+
+static int tlb_read(struct memphy_struct *mp, int pid, int pgnum, int *value,
+                    int *base, int *order)
+{
+    if (tlb_find(mp, pid, pgnum, 0, value, base, order) >= 0) {
+        __atomic_fetch_add(&mp->tlb_hits, 1, __ATOMIC_RELAXED);
+        return *value;
+    }
+
+    __atomic_fetch_add(&mp->tlb_misses, 1, __ATOMIC_RELAXED);
+    if (mp->tlb_next == NULL ||
+        tlb_read(mp->tlb_next, pid, pgnum, value, base, order) < 0)
+        return -1; /* TLB miss */
+
+    /* Refill this level with the whole entry of the next one */
+    tlb_cache_write_order(mp, pid, *base, *value - (pgnum - *base), *order, 0);
+
+    return *value;
+}
+
+/*
+ *  tlb_cache_read read TLB cache device
+ *  On a miss the next level is looked up and, on its hit, the entry is
+ *  filled into this level.
+ *  @mp: memphy struct
+ *  @pid: process id, the address space ID (see tlb_asid_of())
+ *  @pgnum: page number
+ *  @value: obtained value
+ */
 int tlb_cache_read(struct memphy_struct * mp, int pid, int pgnum, int* value)
 {
    /* TODO: the identify info is mapped to 
     *      cache line by employing:
     *      direct mapped, associated mapping etc.
     */
-    if (mp == NULL || pgnum < 0 || pgnum >= mp->maxsz)
-        return -1; // Tham số không hợp lệ hoặc mp không tồn tại
-    int addr = tlb_get_addr(mp, pid, pgnum); // Lấy địa chỉ TLB từ PID và PGN
-    int pid_tlb = tlb_get_pid(mp, addr); // Lấy PID từ TLB
-    int pgnum_tlb = tlb_get_pgn(mp, addr); // Lấy PGN từ TLB
-    if(pid!=pid_tlb) return -1;
-    if(pgnum!=pgnum_tlb) return -1;
-    *value = tlb_get_fpn(mp, addr); // Lấy FPN từ TLB
-    return *value;
-    return 0; // Đọc thành công từ bộ nhớ vật lý
+    int base, order;
+
+    if (mp == NULL || pgnum < 0 || pgnum >= PAGING_MAX_PGN)
+        return -1; /* Invalid parameter */
+
+    return tlb_read(mp, pid, pgnum, value, &base, &order);
+}
+
+/*
+ *  tlb_cache_write_order install an entry mapping 2^order pages
+ *  @mp: memphy struct
+ *  @pid: process id
+ *  @pgnum: first page, aligned to 2^order
+ *  @value: frame of the first page, the others follow contiguously
+ *  @order: log2 of the number of pages
+ *  @deep: also install in all next levels
+ */
+int tlb_cache_write_order(struct memphy_struct *mp, int pid, int pgnum, int value,
+                          int order, int deep)
+{
+    pthread_mutex_t *lock;
+    int ret;
+
+    if (mp == NULL || pgnum < 0 || pgnum >= PAGING_MAX_PGN ||
+        order < 0 || order > TLB_MAX_ORDER || (pgnum & ((1 << order) - 1)))
+        return -1; /* Invalid parameter */
+
+    lock = tlb_stripe_lock(mp, pid, pgnum);
+    ret = tlb_set_entry(mp, tlb_get_addr(mp, pid, pgnum), pid, pgnum, value, order);
+    tlb_stripe_unlock(lock);
+
+    if (deep && mp->tlb_next != NULL)
+        tlb_cache_write_order(mp->tlb_next, pid, pgnum, value, order, deep);
+
+    return ret;
 }
 
 /*
  *  tlb_cache_write write TLB cache device
+ *  The entry is installed in this level and all next levels.
  *  @mp: memphy struct
  *  @pid: process id
  *  @pgnum: page number
@@ -129,25 +341,79 @@ int tlb_cache_write(struct memphy_struct *mp, int pid, int pgnum, int value)
     *      cache line by employing:
     *      direct mapped, associated mapping etc.
     */
-     if (mp == NULL || pgnum < 0 || pgnum >= mp->maxsz)
-        return -1; // Tham số không hợp lệ hoặc mp không tồn tại
-
-    int addr = pgnum * PAGE_SIZE; // Tính địa chỉ bắt đầu của trang
-
-    // Ghi giá trị vào bộ nhớ vật lý
-    TLBMEMPHY_write(mp, addr, value);
-
-    // Cập nhật TLB cache
-    for (int i = 0; i < mp->maxsz; i++) {
-        if (!mp->tlb[i].valid) {
-            mp->tlb[i].pid = pid;
-            mp->tlb[i].pgnum = pgnum;
-            mp->tlb[i].value = value;
-            mp->tlb[i].valid = 1;
-            break;
-        }
+    return tlb_cache_write_order(mp, pid, pgnum, value, 0, 1);
+}
+
+/*
+ *  tlb_cache_invalidate drop the cached translation of a page
+ *  from this level and all next levels
+ *  @mp: memphy struct
+ *  @pid: process id
+ *  @pgnum: page number
+ */
+int tlb_cache_invalidate(struct memphy_struct *mp, int pid, int pgnum)
+{
+    int fpn, base, order;
+
+    if (mp == NULL || pgnum < 0 || pgnum >= PAGING_MAX_PGN)
+        return -1; /* Invalid parameter */
+
+    tlb_find(mp, pid, pgnum, 1, &fpn, &base, &order);
+
+    if (mp->tlb_next != NULL)
+        tlb_cache_invalidate(mp->tlb_next, pid, pgnum);
+
+    return 0;
+}
+
+/*
+ *  tlb_cache_invalidate_range drop the cached translations of pages
+ *  [pgn_start, pgn_end] from this level only. Ranges wider than the
+ *  level are handled by one scan over its entries.
+ *  @mp: memphy struct
+ *  @pid: process id
+ *  @pgn_start, @pgn_end: page range
+ */
+int tlb_cache_invalidate_range(struct memphy_struct *mp, int pid, int pgn_start, int pgn_end)
+{
+    int pgn, addr, fpn, base, order;
+
+    if (mp == NULL || pgn_start > pgn_end)
+        return -1;
+
+    if (pgn_end - pgn_start + 1 <= mp->maxsz) {
+        for (pgn = pgn_start; pgn <= pgn_end; pgn++)
+            tlb_find(mp, pid, pgn, 1, &fpn, &base, &order);
+        return 0;
     }
-    return 0; // Ghi thành công vào bộ nhớ vật lý
+
+    tlb_lock_all(mp);
+    for (addr = 0; addr < mp->maxsz; addr++) {
+        uint32_t tag = mp->tlb_tag[addr];
+        int npage = 1 << TLB_FLG_ORDER(mp->tlb_flags[addr]);
+        if ((tag & TLB_TAG_VALID_MASK) && TLB_TAG_PID(tag) == pid &&
+            TLB_TAG_PGN(tag) + npage - 1 >= pgn_start && TLB_TAG_PGN(tag) <= pgn_end)
+            mp->tlb_tag[addr] = 0;
+    }
+    tlb_unlock_all(mp);
+    return 0;
+}
+
+/*
+ *  tlb_flush_all invalidate every entry of one TLB level
+ *  @mp: memphy struct
+ */
+int tlb_flush_all(struct memphy_struct *mp)
+{
+    if (mp == NULL)
+        return -1;
+
+    tlb_lock_all(mp);
+    memset(mp->tlb_tag, 0, mp->maxsz * sizeof(uint32_t));
+    mp->tlb_orders = 0;
+    tlb_unlock_all(mp);
+
+    return 0;
 }
 
 /*
@@ -161,8 +427,11 @@ int TLBMEMPHY_read(struct memphy_struct * mp, int addr, int *value)
    if (mp == NULL)
      return -1;
 
-   /* TLB cached is random access by native */
-   *value = mp->storage[addr];
+   if (addr < 0 || addr >= mp->maxsz)
+     return -1;
+
+   /* TLB cached is random access by native, one FPN word per entry */
+   *value = mp->tlb_fpn[addr];
 
    return 0;
 }
@@ -179,8 +448,11 @@ int TLBMEMPHY_write(struct memphy_struct * mp, int addr, int data)
    if (mp == NULL)
      return -1;
 
-   /* TLB cached is random access by native */
-   mp->storage[addr] = data;
+   if (addr < 0 || addr >= mp->maxsz)
+     return -1;
+
+   /* TLB cached is random access by native, one FPN word per entry */
+   mp->tlb_fpn[addr] = data;
 
    return 0;
 }
@@ -200,10 +472,11 @@ int TLBMEMPHY_dump(struct memphy_struct * mp)
         printf("Error: Invalid memory physical structure\n");
         return -1;
     }
-    for(int i = 0; i < mp->maxsz/5; i++){
+    for(int i = 0; i < mp->maxsz; i++){
         if(!tlb_empty(mp,i))
-        printf("Memory physical content %d: %08x %02x\n", i, tlb_get_value(mp,i),tlb_get_pid(mp,i));
-        //printf("So Trang va PGN: %d %d\n",tlb_get_fpn(mp,i),tlb_get_pgn(mp,i));
+        printf("Memory physical content %d: pgn %d fpn %d npage %d asid %d\n", i,
+               tlb_get_pgn(mp,i), tlb_get_fpn(mp,i), 1 << tlb_get_order(mp,i),
+               tlb_get_pid(mp,i));
     }
     
     return 0;
@@ -213,16 +486,124 @@ int TLBMEMPHY_dump(struct memphy_struct * mp)
 /*
  *  Init TLBMEMPHY struct
  */
+static void *tlb_alloc_array(int nmemb)
+{
+   /* Round up so every array starts and ends on a cache line */
+   size_t sz = DIV_ROUND_UP(nmemb * sizeof(uint32_t), TLB_ENTRY_ALIGN) * TLB_ENTRY_ALIGN;
+   void *arr = aligned_alloc(TLB_ENTRY_ALIGN, sz);
+
+   memset(arr, 0, sz);
+   return arr;
+}
+
 int init_tlbmemphy(struct memphy_struct *mp, int max_size)
 {
-   mp->storage = (BYTE *)malloc(max_size*sizeof(BYTE));
+   mp->storage = NULL;
    mp->maxsz = max_size;
-   mp->tlb = (struct tlb_entry_t *)malloc(max_size * sizeof(struct tlb_entry_t));
-   for (int i = 0; i < max_size; i++) {
-       mp->tlb[i].valid = 0;
-   }
+   mp->tlb_tag = tlb_alloc_array(max_size);
+   mp->tlb_fpn = tlb_alloc_array(max_size);
+   mp->tlb_flags = tlb_alloc_array(max_size);
    mp->rdmflg = 1;
 
+   /* Small TLBs are searched fully associatively */
+   mp->tlb_fa = (max_size <= TLB_FA_MAXSZ);
+   mp->tlb_fa_hand = 0;
+   mp->tlb_orders = 0;
+
+   /* A private, stand-alone level until linked or shared */
+   mp->tlb_next = NULL;
+   mp->tlb_locks = NULL;
+   mp->tlb_nlocks = 0;
+   mp->tlb_asid_gen = 0;
+   mp->tlb_sd = NULL;
+   mp->tlb_hits = mp->tlb_misses = 0;
+   mp->tlb_lock_acqs = mp->tlb_lock_waits = 0;
+
+   return 0;
+}
+
+/*
+ *  TLBMEMPHY_share - make a TLB level shared among CPUs
+ *  @mp: memphy struct
+ *  @nlocks: number of lock stripes
+ */
+int TLBMEMPHY_share(struct memphy_struct *mp, int nlocks)
+{
+   int i;
+
+   /* A fully associative level has no fixed entry per key */
+   if (mp->tlb_fa || nlocks < 1)
+     nlocks = 1;
+
+   mp->tlb_locks = aligned_alloc(TLB_ENTRY_ALIGN, nlocks * sizeof(struct tlb_stripe));
+   for (i = 0; i < nlocks; i++)
+     pthread_mutex_init(&mp->tlb_locks[i].lock, NULL);
+   mp->tlb_nlocks = nlocks;
+
+   return 0;
+}
+
+/*
+ *  TLBMEMPHY_save - write the entries of a TLB level to a snapshot, with
+ *  the level unused
+ *  @mp: memphy struct
+ *  @s: snapshot
+ */
+int TLBMEMPHY_save(struct memphy_struct *mp, struct snap *s)
+{
+   snap_put_u32(s, mp->maxsz);
+   snap_put_u32(s, mp->tlb_fa_hand);
+   snap_put_u32(s, mp->tlb_orders);
+   snap_put_u32(s, mp->tlb_asid_gen);
+   snap_put(s, mp->tlb_tag, mp->maxsz * sizeof(uint32_t));
+   snap_put(s, mp->tlb_fpn, mp->maxsz * sizeof(uint32_t));
+   snap_put(s, mp->tlb_flags, mp->maxsz * sizeof(uint32_t));
+
+   return 0;
+}
+
+/*
+ *  TLBMEMPHY_restore - take the entries of a TLB level of the same size
+ *  from a snapshot
+ *  @mp: memphy struct
+ *  @s: snapshot
+ */
+int TLBMEMPHY_restore(struct memphy_struct *mp, struct snap *s)
+{
+   if (snap_get_u32(s) != mp->maxsz)
+     return -1;
+
+   mp->tlb_fa_hand = snap_get_u32(s);
+   mp->tlb_orders = snap_get_u32(s);
+   mp->tlb_asid_gen = snap_get_u32(s);
+   snap_get(s, mp->tlb_tag, mp->maxsz * sizeof(uint32_t));
+   snap_get(s, mp->tlb_fpn, mp->maxsz * sizeof(uint32_t));
+   snap_get(s, mp->tlb_flags, mp->maxsz * sizeof(uint32_t));
+
+   return 0;
+}
+
+/*
+ *  TLBMEMPHY_stat - report hit rate and lock contention of a TLB level
+ *  @mp: memphy struct
+ *  @name: level name
+ */
+int TLBMEMPHY_stat(struct memphy_struct *mp, const char *name)
+{
+   unsigned long nref;
+
+   if (mp == NULL)
+     return -1;
+
+   nref = mp->tlb_hits + mp->tlb_misses;
+   printf("TLB %s (%d entries): %lu hits %lu misses, hit rate %.1f%%",
+          name, mp->maxsz, mp->tlb_hits, mp->tlb_misses,
+          nref ? 100.0 * mp->tlb_hits / nref : 0.0);
+   if (mp->tlb_locks != NULL)
+     printf(", %d stripes contended %lu/%lu",
+            mp->tlb_nlocks, mp->tlb_lock_waits, mp->tlb_lock_acqs);
+   printf("\n");
+
    return 0;
 }
 
@@ -0,0 +1,464 @@
+/*
+ * CPU TLB statistics
+ * TLB module cpu/cpu-tlbstat.c
+ */
+
+#include "mm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * Miss classification (3C). Every translation of tlbread()/tlbwrite()
+ * is replayed into a shadow fully associative LRU TLB with as many
+ * entries as the real TLB. A real miss is
+ *  - compulsory if the page was never referenced before, or not since
+ *    its mapping was invalidated,
+ *  - capacity if the shadow TLB misses as well,
+ *  - conflict if the shadow TLB hits, i.e. only the placement or the
+ *    replacement policy of the real TLB lost it.
+ * Pages are keyed by (pid, pgn) so that ASID changes do not reset them.
+ * Flushing a process bumps its epoch; pages of an older epoch count as
+ * never referenced.
+ */
+struct tlb_shadow {
+  uint32_t key;
+  uint32_t epoch;
+  int lru;                   /* linked in the shadow LRU */
+  struct tlb_shadow *hnext;  /* hash chain */
+  struct tlb_shadow *prev, *next;
+};
+
+#define TLB_STAT_HBITS 16
+
+struct tlb_stat {
+  unsigned long refs;
+  unsigned long hits;
+  unsigned long miss[TLB_MISS_NCLASS];
+  uint32_t epoch; /* per pid only */
+};
+
+static const char *tlb_miss_name[TLB_MISS_NCLASS] = {
+  "compulsory", "capacity", "conflict"
+};
+
+/* The shadow TLB is shared by all CPUs: every translation takes the
+ * lock, so the statistics are off unless asked for */
+int tlb_stat_enabled = CPUTLB_STAT;
+
+static pthread_mutex_t tlb_stat_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tlb_shadow *tlb_shadow_hash[1 << TLB_STAT_HBITS];
+static struct tlb_shadow tlb_shadow_lru = {
+  .prev = &tlb_shadow_lru, .next = &tlb_shadow_lru
+};
+static int tlb_shadow_cap;
+static int tlb_shadow_len;
+
+static struct tlb_stat tlb_stat_all;
+static struct tlb_stat *tlb_stat_pid;  /* indexed by pid */
+static uint32_t tlb_stat_npid;
+static struct memphy_struct **tlb_stat_cpus;
+static struct tlb_stat *tlb_stat_cpu;  /* indexed like tlb_stat_cpus */
+static int tlb_stat_ncpus;
+
+static inline struct tlb_shadow **tlb_shadow_slot(uint32_t key)
+{
+  struct tlb_shadow **p = &tlb_shadow_hash[(key * 2654435761u) >>
+                                           (32 - TLB_STAT_HBITS)];
+
+  while (*p != NULL && (*p)->key != key)
+    p = &(*p)->hnext;
+  return p;
+}
+
+static inline void tlb_shadow_unlink(struct tlb_shadow *s)
+{
+  s->prev->next = s->next;
+  s->next->prev = s->prev;
+  s->lru = 0;
+  tlb_shadow_len--;
+}
+
+static inline void tlb_shadow_push(struct tlb_shadow *s)
+{
+  s->next = tlb_shadow_lru.next;
+  s->prev = &tlb_shadow_lru;
+  tlb_shadow_lru.next->prev = s;
+  tlb_shadow_lru.next = s;
+  s->lru = 1;
+  tlb_shadow_len++;
+}
+
+/*tlb_shadow_ref - reference a page in the shadow TLB
+ *Return the miss class the page would have if the real TLB missed
+ */
+static int tlb_shadow_ref(uint32_t key, uint32_t epoch)
+{
+  struct tlb_shadow **p = tlb_shadow_slot(key);
+  struct tlb_shadow *s = *p;
+  int cls;
+
+  if (s == NULL) {
+    s = calloc(1, sizeof(struct tlb_shadow));
+    s->key = key;
+    s->epoch = epoch;
+    *p = s;
+    cls = TLB_MISS_COMPULSORY;
+  } else if (s->epoch != epoch) {
+    if (s->lru)
+      tlb_shadow_unlink(s);
+    s->epoch = epoch;
+    cls = TLB_MISS_COMPULSORY;
+  } else if (!s->lru) {
+    cls = TLB_MISS_CAPACITY;
+  } else {
+    tlb_shadow_unlink(s);
+    cls = TLB_MISS_CONFLICT;
+  }
+
+  tlb_shadow_push(s);
+  if (tlb_shadow_len > tlb_shadow_cap)
+    tlb_shadow_unlink(tlb_shadow_lru.prev);
+
+  return cls;
+}
+
+static struct tlb_stat *tlb_stat_of_pid(uint32_t pid)
+{
+  if (pid >= tlb_stat_npid) {
+    uint32_t n = (pid + 1) * 2;
+    tlb_stat_pid = realloc(tlb_stat_pid, n * sizeof(struct tlb_stat));
+    memset(tlb_stat_pid + tlb_stat_npid, 0,
+           (n - tlb_stat_npid) * sizeof(struct tlb_stat));
+    tlb_stat_npid = n;
+  }
+  return &tlb_stat_pid[pid];
+}
+
+static struct tlb_stat *tlb_stat_of_cpu(struct memphy_struct *mp)
+{
+  int i;
+
+  for (i = 0; i < tlb_stat_ncpus; i++)
+    if (tlb_stat_cpus[i] == mp)
+      return &tlb_stat_cpu[i];
+  return NULL;
+}
+
+static inline void tlb_stat_add(struct tlb_stat *st, int hit, int cls)
+{
+  if (st == NULL)
+    return;
+  st->refs++;
+  if (hit)
+    st->hits++;
+  else
+    st->miss[cls]++;
+}
+
+/*tlb_stat_init - size the shadow TLB
+ *@nentries: number of entries of the TLB being classified
+ */
+int tlb_stat_init(int nentries)
+{
+  pthread_mutex_lock(&tlb_stat_lock);
+  tlb_shadow_cap = nentries;
+  pthread_mutex_unlock(&tlb_stat_lock);
+  return 0;
+}
+
+/*tlb_stat_register - count the references made through a CPU's TLB */
+int tlb_stat_register(struct memphy_struct *mp)
+{
+  pthread_mutex_lock(&tlb_stat_lock);
+  tlb_stat_cpus = realloc(tlb_stat_cpus,
+                          (tlb_stat_ncpus + 1) * sizeof(*tlb_stat_cpus));
+  tlb_stat_cpu = realloc(tlb_stat_cpu,
+                         (tlb_stat_ncpus + 1) * sizeof(*tlb_stat_cpu));
+  tlb_stat_cpus[tlb_stat_ncpus] = mp;
+  memset(&tlb_stat_cpu[tlb_stat_ncpus], 0, sizeof(*tlb_stat_cpu));
+  tlb_stat_ncpus++;
+  pthread_mutex_unlock(&tlb_stat_lock);
+  return 0;
+}
+
+/*tlb_stat_ref - account one translation
+ *@proc: process translating, proc->tlb is the CPU's TLB
+ *@pgn: page number
+ *@hit: the TLB held the translation
+ */
+int tlb_stat_ref(struct pcb_t *proc, int pgn, int hit)
+{
+  struct tlb_stat *st;
+  int cls;
+
+  if (!tlb_stat_enabled && !tlb_sweep_enabled)
+    return 0;
+
+  pthread_mutex_lock(&tlb_stat_lock);
+  if (tlb_stat_enabled) {
+    st = tlb_stat_of_pid(proc->pid);
+    cls = tlb_shadow_ref(TLB_TAG(proc->pid, pgn), st->epoch);
+    tlb_stat_add(&tlb_stat_all, hit, cls);
+    tlb_stat_add(st, hit, cls);
+    tlb_stat_add(tlb_stat_of_cpu(proc->tlb), hit, cls);
+  }
+  if (tlb_sweep_enabled)
+    tlb_sweep_ref(proc->pid, pgn);
+  pthread_mutex_unlock(&tlb_stat_lock);
+
+  return 0;
+}
+
+/*tlb_stat_forget - pages [pgn_start, pgn_end] of @pid were invalidated
+ *Their next miss counts as compulsory again
+ */
+int tlb_stat_forget(uint32_t pid, int pgn_start, int pgn_end)
+{
+  int pgn;
+
+  if (!tlb_stat_enabled)
+    return 0;
+
+  pthread_mutex_lock(&tlb_stat_lock);
+  for (pgn = pgn_start; pgn <= pgn_end; pgn++) {
+    struct tlb_shadow **p = tlb_shadow_slot(TLB_TAG(pid, pgn));
+    struct tlb_shadow *s = *p;
+
+    if (s == NULL)
+      continue;
+    if (s->lru)
+      tlb_shadow_unlink(s);
+    *p = s->hnext;
+    free(s);
+  }
+  pthread_mutex_unlock(&tlb_stat_lock);
+
+  return 0;
+}
+
+/*tlb_stat_flush - all pages of @pid were invalidated, in O(1) */
+int tlb_stat_flush(uint32_t pid)
+{
+  if (!tlb_stat_enabled)
+    return 0;
+
+  pthread_mutex_lock(&tlb_stat_lock);
+  tlb_stat_of_pid(pid)->epoch++;
+  pthread_mutex_unlock(&tlb_stat_lock);
+  return 0;
+}
+
+static void tlb_stat_print(const char *name, struct tlb_stat *st)
+{
+  unsigned long nmiss = st->refs - st->hits;
+  int c;
+
+  printf("  %-8s refs %8lu  hit %6.2f%%  miss %8lu",
+         name, st->refs, st->refs ? 100.0 * st->hits / st->refs : 0.0, nmiss);
+  for (c = 0; c < TLB_MISS_NCLASS; c++)
+    printf("  %s %lu (%.1f%%)", tlb_miss_name[c], st->miss[c],
+           nmiss ? 100.0 * st->miss[c] / nmiss : 0.0);
+  printf("\n");
+}
+
+/*tlb_stat_dump - print the counters of all CPUs and processes */
+int tlb_stat_dump(void)
+{
+  char name[16];
+  uint32_t pid;
+  int i;
+
+  if (!tlb_stat_enabled)
+    return -1;
+
+  pthread_mutex_lock(&tlb_stat_lock);
+  printf("TLB statistics (%d entry shadow LRU)\n", tlb_shadow_cap);
+  tlb_stat_print("total", &tlb_stat_all);
+  for (i = 0; i < tlb_stat_ncpus; i++) {
+    sprintf(name, "cpu %d", i);
+    tlb_stat_print(name, &tlb_stat_cpu[i]);
+  }
+  for (pid = 0; pid < tlb_stat_npid; pid++) {
+    if (tlb_stat_pid[pid].refs == 0)
+      continue;
+    sprintf(name, "pid %u", pid);
+    tlb_stat_print(name, &tlb_stat_pid[pid]);
+  }
+  pthread_mutex_unlock(&tlb_stat_lock);
+
+  return 0;
+}
+
+/*
+ * TLB size sweep. With tlb_sweep_enabled, every (pid, pgn) translated
+ * is also appended to a trace. At exit the trace is analysed in one
+ * pass per set count: the LRU stack distance of a reference is the
+ * number of distinct pages of its set referenced since the previous
+ * reference to the same page. A Fenwick tree over time, holding a mark
+ * at the last reference of every page, gives it in O(log n). An LRU TLB
+ * of A ways misses exactly the references of distance >= A, so a single
+ * pass yields the miss ratio of every size at once. Sets are indexed
+ * like the hashed TLB (tlb_get_addr()).
+ */
+int tlb_sweep_enabled = CPUTLB_SWEEP;
+static uint32_t *tlb_sweep_trace;
+static long tlb_sweep_len;
+static long tlb_sweep_cap;
+
+struct tlb_sweep_slot {
+  uint32_t key;
+  uint32_t stamp;  /* partition the slot is valid for */
+  long last;       /* time of the last reference */
+};
+
+/*tlb_sweep_ref - append a reference to the sweep trace */
+int tlb_sweep_ref(uint32_t pid, int pgn)
+{
+  if (tlb_sweep_len == tlb_sweep_cap) {
+    tlb_sweep_cap = tlb_sweep_cap ? tlb_sweep_cap * 2 : 4096;
+    tlb_sweep_trace = realloc(tlb_sweep_trace,
+                              tlb_sweep_cap * sizeof(uint32_t));
+  }
+  tlb_sweep_trace[tlb_sweep_len++] = TLB_TAG(pid, pgn);
+  return 0;
+}
+
+static inline int tlb_sweep_set(uint32_t key, int nsets)
+{
+  uint32_t h = TLB_TAG_PID(key) * 9173 + TLB_TAG_PGN(key) + 971;
+  return h % nsets;
+}
+
+/*tlb_sweep_hist - histogram of LRU stack distances
+ *@nsets: distances are counted within sets of the hashed index
+ *@nkeys: upper bound of the distinct pages in the trace
+ *@hist: hist[d] references at distance d < histsz, hist[histsz] beyond
+ *Return the number of cold (first) references
+ */
+static long tlb_sweep_hist(int nsets, long nkeys, unsigned long *hist,
+                           int histsz)
+{
+  long n = tlb_sweep_len, hsz, cold = 0, i, t, base;
+  long *start = calloc(nsets + 1, sizeof(long));
+  uint32_t *part = malloc(n * sizeof(uint32_t));
+  int *bit = malloc((n + 1) * sizeof(int));
+  struct tlb_sweep_slot *hash;
+  int s;
+
+  for (hsz = 1; hsz < 2 * nkeys; hsz <<= 1)
+    ;
+  hash = calloc(hsz, sizeof(struct tlb_sweep_slot));
+
+  /* Stable partition of the trace by set */
+  for (i = 0; i < n; i++)
+    start[tlb_sweep_set(tlb_sweep_trace[i], nsets) + 1]++;
+  for (s = 0; s < nsets; s++)
+    start[s + 1] += start[s];
+  for (i = 0; i < n; i++)
+    part[start[tlb_sweep_set(tlb_sweep_trace[i], nsets)]++] =
+      tlb_sweep_trace[i];
+
+  memset(hist, 0, (histsz + 1) * sizeof(unsigned long));
+  for (s = 0, base = 0; s < nsets; base = start[s], s++) {
+    long m = start[s] - base;
+
+    memset(bit, 0, (m + 1) * sizeof(int));
+    for (t = 1; t <= m; t++) {
+      uint32_t key = part[base + t - 1];
+      long h = (key * 2654435761u) & (hsz - 1);
+      long j, d = 0;
+
+      while (hash[h].stamp == s + 1 && hash[h].key != key)
+        h = (h + 1) & (hsz - 1);
+
+      if (hash[h].stamp != s + 1) {
+        cold++;
+        hash[h].key = key;
+        hash[h].stamp = s + 1;
+      } else {
+        /* marks in (last, t) = distinct pages referenced since */
+        for (j = t - 1; j > 0; j -= j & -j)
+          d += bit[j];
+        for (j = hash[h].last; j > 0; j -= j & -j)
+          d -= bit[j];
+        hist[d < histsz ? d : histsz]++;
+        for (j = hash[h].last; j <= m; j += j & -j)
+          bit[j]--;
+      }
+      for (j = t; j <= m; j += j & -j)
+        bit[j]++;
+      hash[h].last = t;
+    }
+  }
+
+  free(hash);
+  free(bit);
+  free(part);
+  free(start);
+  return cold;
+}
+
+/*tlb_sweep_miss - miss ratio of a fully associative LRU TLB on the
+ *recorded trace, in percent, -1 without a trace
+ *@size: entries
+ */
+double tlb_sweep_miss(int size)
+{
+  unsigned long *hist;
+  long n = tlb_sweep_len, hit = 0, d;
+
+  if (n == 0 || size <= 0)
+    return -1;
+  hist = malloc((size + 1) * sizeof(unsigned long));
+  tlb_sweep_hist(1, n, hist, size);
+  for (d = 0; d < size; d++)
+    hit += hist[d];
+  free(hist);
+  return 100.0 * (n - hit) / n;
+}
+
+/*tlb_sweep_dump - miss ratio curves of the recorded trace
+ *@assoc: ways of the set associative curve
+ */
+int tlb_sweep_dump(int assoc)
+{
+  int histsz = 1 << 16, nsets, size;
+  unsigned long *hist = malloc((histsz + 1) * sizeof(unsigned long));
+  unsigned long miss;
+  long n = tlb_sweep_len, cold, d;
+
+  if (n == 0) {
+    free(hist);
+    return -1;
+  }
+
+  /* Fully associative: one set, every size from one histogram */
+  cold = tlb_sweep_hist(1, n, hist, histsz);
+  printf("TLB sweep: %ld refs, %ld distinct pages\n", n, cold);
+  printf("  fully associative LRU\n");
+  miss = n - cold;
+  for (size = 1, d = 0; size <= histsz; size <<= 1) {
+    for (; d < size; d++)
+      miss -= hist[d];
+    printf("    %6d entries: miss ratio %6.2f%%\n",
+           size, 100.0 * (cold + miss) / n);
+    if (miss == 0)
+      break;
+  }
+
+  /* Set associative: one pass per set count */
+  printf("  %d-way LRU, hashed set index\n", assoc);
+  for (nsets = 1, d = cold; nsets * assoc <= histsz; nsets <<= 1) {
+    cold = tlb_sweep_hist(nsets, d, hist, assoc);
+    miss = cold + hist[assoc];
+    printf("    %6d sets, %6d entries: miss ratio %6.2f%%\n",
+           nsets, nsets * assoc, 100.0 * miss / n);
+    if (miss == cold)
+      break;
+  }
+
+  free(hist);
+  return 0;
+}
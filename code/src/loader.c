@@ -29,6 +29,11 @@ static enum ins_opcode_t get_opcode(char * opt) {
 	}
 }
 
+/* PID of the next process loaded, e.g. when resuming from a snapshot */
+void load_set_pid(uint32_t pid) {
+	avail_pid = pid;
+}
+
 struct pcb_t * load(const char * path) {
 	/* Create new PCB for the new process */
 	struct pcb_t * proc = (struct pcb_t * )malloc(sizeof(struct pcb_t));
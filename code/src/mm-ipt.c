@@ -0,0 +1,225 @@
+/*
+ * Inverted page table
+ * One hash table for all address spaces instead of a table per
+ * process: an entry per mapped page, keyed by (address space, page),
+ * holding its PTE. Swapped pages keep their entry, so the table holds
+ * about as many entries as RAM and swap have frames, whatever the
+ * number of processes.
+ *
+ * Open addressing with linear probing over 8 byte entries, eight to a
+ * cache line. A removed entry is filled by shifting the following run
+ * back, there are no tombstones. Writers take ipt_lock; lookups take no
+ * lock and retry if a writer moved entries meanwhile (ipt_seq odd or
+ * changed). Entries are stored with release and loaded with acquire
+ * ordering, so a lookup that saw a moved entry sees ipt_seq change.
+ */
+
+#include "mm.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef MM_PAGING
+
+#define IPT_PGN_BITS  NBITS(PAGING_MAX_PGN)
+#define IPT_MAX_ID    (1U << (32 - IPT_PGN_BITS))
+#define IPT_INIT_SZ   1024 /* entries, grows by doubling at 3/4 load */
+
+struct ipt_ent {
+  uint32_t key; /* address space id << IPT_PGN_BITS | pgn, 0 = free */
+  uint32_t pte;
+};
+
+struct ipt_table {
+  uint32_t mask;
+  uint32_t nused;
+  struct ipt_table *old; /* replaced tables, a lookup may still probe one */
+  struct ipt_ent ent[];
+};
+
+static struct ipt_table *ipt;
+static unsigned ipt_seq;
+static pthread_mutex_t ipt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint32_t ipt_key(uint32_t id, int pgn)
+{
+  return id << IPT_PGN_BITS | pgn;
+}
+
+static inline uint32_t ipt_hash(uint32_t key)
+{
+  key *= 0x9e3779b1;
+  return key ^ (key >> 16);
+}
+
+static struct ipt_table *ipt_alloc(uint32_t sz)
+{
+  struct ipt_table *t = calloc(1, sizeof(struct ipt_table) +
+                                      sz * sizeof(struct ipt_ent));
+
+  t->mask = sz - 1;
+  return t;
+}
+
+/* Slot of key in t, or the free slot ending its probe, ipt_lock held */
+static uint32_t ipt_find(struct ipt_table *t, uint32_t key)
+{
+  uint32_t i = ipt_hash(key) & t->mask;
+
+  while (t->ent[i].key != 0 && t->ent[i].key != key)
+    i = (i + 1) & t->mask;
+  return i;
+}
+
+/* Twice the size, entries rehashed, ipt_lock held and ipt_seq odd */
+static void ipt_grow(void)
+{
+  struct ipt_table *t = ipt_alloc(ipt ? 2 * (ipt->mask + 1) : IPT_INIT_SZ);
+  uint32_t i, j;
+
+  if (ipt != NULL) {
+    for (i = 0; i <= ipt->mask; i++)
+      if (ipt->ent[i].key != 0) {
+        j = ipt_find(t, ipt->ent[i].key);
+        t->ent[j] = ipt->ent[i];
+      }
+    t->nused = ipt->nused;
+    t->old = ipt;
+  }
+  __atomic_store_n(&ipt, t, __ATOMIC_RELEASE);
+}
+
+/* Empty slot i, moving back entries probed past it, ipt_lock held and
+ * ipt_seq odd */
+static void ipt_remove(struct ipt_table *t, uint32_t i)
+{
+  uint32_t j = i, h, key;
+
+  for (;;) {
+    j = (j + 1) & t->mask;
+    key = t->ent[j].key;
+    if (key == 0)
+      break;
+    /* The entry stays if its home slot lies in (i, j] */
+    h = ipt_hash(key) & t->mask;
+    if (i <= j ? (i < h && h <= j) : (i < h || h <= j))
+      continue;
+    __atomic_store_n(&t->ent[i].pte, t->ent[j].pte, __ATOMIC_RELEASE);
+    __atomic_store_n(&t->ent[i].key, key, __ATOMIC_RELEASE);
+    i = j;
+  }
+  __atomic_store_n(&t->ent[i].key, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&t->ent[i].pte, 0, __ATOMIC_RELEASE);
+  t->nused--;
+}
+
+/*
+ * ipt_get - PTE of a page, 0 if not mapped
+ * @id  : address space, mm->id
+ * @pgn : page number
+ */
+uint32_t ipt_get(uint32_t id, int pgn)
+{
+  uint32_t key = ipt_key(id, pgn), pte, i, k;
+  struct ipt_table *t;
+  unsigned seq;
+
+  do {
+    seq = __atomic_load_n(&ipt_seq, __ATOMIC_ACQUIRE);
+    t = __atomic_load_n(&ipt, __ATOMIC_ACQUIRE);
+    pte = 0;
+    if (t != NULL)
+      for (i = ipt_hash(key) & t->mask;; i = (i + 1) & t->mask) {
+        k = __atomic_load_n(&t->ent[i].key, __ATOMIC_ACQUIRE);
+        if (k == key) {
+          pte = __atomic_load_n(&t->ent[i].pte, __ATOMIC_ACQUIRE);
+          break;
+        }
+        if (k == 0)
+          break;
+      }
+  } while ((seq & 1) || __atomic_load_n(&ipt_seq, __ATOMIC_RELAXED) != seq);
+
+  return pte;
+}
+
+/*
+ * ipt_set - set the PTE of a page, a PTE of 0 removes its entry
+ * @id  : address space, mm->id
+ * @pgn : page number
+ * @pte : page table entry
+ */
+int ipt_set(uint32_t id, int pgn, uint32_t pte)
+{
+  uint32_t key = ipt_key(id, pgn), i = 0;
+  int found;
+
+  if (id == 0 || id >= IPT_MAX_ID)
+    return -1;
+
+  pthread_mutex_lock(&ipt_lock);
+  if (ipt != NULL)
+    i = ipt_find(ipt, key);
+  found = ipt != NULL && ipt->ent[i].key == key;
+  if (found == (pte != 0)) {
+    /* Nothing moves: an update, or no entry to remove */
+    if (found)
+      __atomic_store_n(&ipt->ent[i].pte, pte, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&ipt_lock);
+    return 0;
+  }
+
+  __atomic_store_n(&ipt_seq, ipt_seq + 1, __ATOMIC_RELAXED);
+  if (pte == 0) {
+    ipt_remove(ipt, i);
+  } else {
+    if (ipt == NULL || 4 * (ipt->nused + 1) > 3 * (ipt->mask + 1))
+      ipt_grow();
+    i = ipt_find(ipt, key);
+    __atomic_store_n(&ipt->ent[i].pte, pte, __ATOMIC_RELEASE);
+    __atomic_store_n(&ipt->ent[i].key, key, __ATOMIC_RELEASE);
+    ipt->nused++;
+  }
+  __atomic_store_n(&ipt_seq, ipt_seq + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&ipt_lock);
+
+  return 0;
+}
+
+/*
+ * ipt_bytes - memory taken by the table, replaced ones included
+ */
+long ipt_bytes(void)
+{
+  struct ipt_table *t;
+  long bytes = 0;
+
+  pthread_mutex_lock(&ipt_lock);
+  for (t = ipt; t != NULL; t = t->old)
+    bytes += sizeof(struct ipt_table) + (t->mask + 1L) * sizeof(struct ipt_ent);
+  pthread_mutex_unlock(&ipt_lock);
+  return bytes;
+}
+
+/*
+ * ipt_stat - print the size and load of the inverted page table
+ */
+int ipt_stat(void)
+{
+  uint32_t nused, sz;
+
+  pthread_mutex_lock(&ipt_lock);
+  if (ipt == NULL) {
+    pthread_mutex_unlock(&ipt_lock);
+    return -1;
+  }
+  nused = ipt->nused;
+  sz = ipt->mask + 1;
+  pthread_mutex_unlock(&ipt_lock);
+
+  printf("Inverted page table: %u of %u entries used, %ld KB\n", nused, sz,
+         ipt_bytes() >> 10);
+  return 0;
+}
+
+#endif
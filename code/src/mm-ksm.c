@@ -0,0 +1,568 @@
+/*
+ * PAGING based Memory Management
+ * Same page merging mm/mm-ksm.c
+ *
+ * A scanner thread hashes the frames of every registered address space
+ * and merges identical pages into one read-only frame. Pages of equal
+ * hash are matched against the stable table, frames already shared,
+ * then against the unstable table, pages seen once during the current
+ * pass. Two unstable pages of equal hash get a new stable frame holding
+ * a copy of one of them.
+ *
+ * The scanner does not touch page tables: a page may be written through
+ * the TLB of the CPU running its owner at any time. It posts a merge
+ * hint to the owner instead, and ksm_merge() applies the hints on the
+ * owner's CPU before its next slot. The content is compared then, the
+ * PTE moved to the stable frame with PAGING_PTE_KSM_MASK and the private
+ * frame freed. Shared pages stay out of the TLB and are not swapped;
+ * the first write through pg_setval() copies the page back into a
+ * private frame (ksm_break).
+ */
+
+#include "mm.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef MM_PAGING
+
+struct ksm_hint {
+  int pgn;
+  int fpn; /* stable frame */
+  struct ksm_hint *next;
+};
+
+struct ksm_stable {
+  uint64_t hash;
+  int fpn; /* -1 empty */
+};
+
+struct ksm_unstable {
+  uint64_t hash;
+  struct mm_struct *mm; /* NULL: empty */
+  int pgn;
+};
+
+#define KSM_EMPTY -1
+
+/* Tables, reference counts and hint lists, see os-mm.h for the order */
+static pthread_mutex_t ksm_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct memphy_struct *ksm_mram;
+static struct ksm_stable *ksm_stbl;
+static struct ksm_unstable *ksm_utbl;
+static int ksm_tblmask;
+static int ksm_nunstable; /* entries in ksm_utbl, at most 3/4 of it */
+static int *ksm_ref;     /* per frame: pages mapping it */
+static int *ksm_pending; /* per frame: hints not applied yet */
+static struct mm_struct **ksm_mm;
+static int ksm_nmm, ksm_maxmm;
+
+static pthread_t ksm_thread;
+static int ksm_running, ksm_stopping;
+static int ksm_scan_pages, ksm_scan_us;
+
+/* Statistics, under ksm_lock */
+static unsigned long ksm_nscan, ksm_npass, ksm_nmerge, ksm_nbreak;
+static unsigned long ksm_nstale; /* hints dropped, the page changed */
+static int ksm_nshared;          /* frames with ksm_ref > 0 */
+static int ksm_nsharing;         /* sum of ksm_ref */
+static unsigned long ksm_scan_ns, ksm_merge_ns;
+
+static uint64_t ksm_hash(const BYTE *page)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  int i;
+
+  for (i = 0; i < PAGING_PAGESZ; i++) {
+    h ^= page[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static unsigned long ksm_now(clockid_t clk)
+{
+  struct timespec ts;
+
+  clock_gettime(clk, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* Stable frame holding page, or -1. ksm_lock held */
+static int ksm_stable_find(uint64_t hash, const BYTE *page)
+{
+  BYTE buf[PAGING_PAGESZ];
+  int i = hash & ksm_tblmask;
+
+  for (; ksm_stbl[i].fpn != KSM_EMPTY; i = (i + 1) & ksm_tblmask) {
+    if (ksm_stbl[i].hash != hash)
+      continue;
+    MEMPHY_read_block(ksm_mram, ksm_stbl[i].fpn * PAGING_PAGESZ, buf,
+                      PAGING_PAGESZ);
+    if (memcmp(buf, page, PAGING_PAGESZ) == 0)
+      return ksm_stbl[i].fpn;
+  }
+  return -1;
+}
+
+static void ksm_stable_insert(uint64_t hash, int fpn)
+{
+  int i = hash & ksm_tblmask;
+
+  while (ksm_stbl[i].fpn >= 0)
+    i = (i + 1) & ksm_tblmask;
+  ksm_stbl[i].hash = hash;
+  ksm_stbl[i].fpn = fpn;
+}
+
+/* No tombstones: the run after the removed slot is shifted back, so a
+ * probe always ends at an empty slot. The table holds at most nfp of
+ * its 2 * nfp slots */
+static void ksm_stable_remove(int fpn)
+{
+  int i, j, h;
+
+  for (i = 0; i <= ksm_tblmask && ksm_stbl[i].fpn != fpn; i++)
+    ;
+  if (i > ksm_tblmask)
+    return;
+
+  for (j = i;;) {
+    j = (j + 1) & ksm_tblmask;
+    if (ksm_stbl[j].fpn == KSM_EMPTY)
+      break;
+    /* The entry stays if its home slot lies in (i, j] */
+    h = ksm_stbl[j].hash & ksm_tblmask;
+    if (i <= j ? (i < h && h <= j) : (i < h || h <= j))
+      continue;
+    ksm_stbl[i] = ksm_stbl[j];
+    i = j;
+  }
+  ksm_stbl[i].fpn = KSM_EMPTY;
+}
+
+/* Drop one user or hint of a stable frame, ksm_lock held.
+ * Return 1 if the frame is unused now and must be freed */
+static int ksm_release(int fpn, int *count)
+{
+  (*count)--;
+  if (ksm_ref[fpn] > 0 || ksm_pending[fpn] > 0)
+    return 0;
+  ksm_stable_remove(fpn);
+  return 1;
+}
+
+static void ksm_post(struct mm_struct *mm, int pgn, int fpn)
+{
+  struct ksm_hint *h = malloc(sizeof(struct ksm_hint));
+
+  h->pgn = pgn;
+  h->fpn = fpn;
+  h->next = mm->ksm_hints;
+  __atomic_store_n(&mm->ksm_hints, h, __ATOMIC_RELEASE);
+  ksm_pending[fpn]++;
+}
+
+/* Hash one page and look for its twin */
+static void ksm_scan_page(struct mm_struct *mm, int pgn, const BYTE *page)
+{
+  struct ksm_unstable *u;
+  uint64_t hash = ksm_hash(page);
+  int fpn, i;
+
+  pthread_mutex_lock(&ksm_lock);
+  ksm_nscan++;
+  fpn = ksm_stable_find(hash, page);
+  if (fpn >= 0) {
+    ksm_post(mm, pgn, fpn);
+    pthread_mutex_unlock(&ksm_lock);
+    return;
+  }
+
+  for (i = hash & ksm_tblmask; ksm_utbl[i].mm != NULL;
+       i = (i + 1) & ksm_tblmask)
+    if (ksm_utbl[i].hash == hash &&
+        (ksm_utbl[i].mm != mm || ksm_utbl[i].pgn != pgn))
+      break;
+  u = &ksm_utbl[i];
+  if (u->mm == NULL) { /* first of its kind this pass */
+    if (4 * (ksm_nunstable + 1) > 3 * (ksm_tblmask + 1)) {
+      /* Full until the pass ends, e.g. pages swapped in meanwhile */
+      pthread_mutex_unlock(&ksm_lock);
+      return;
+    }
+    ksm_nunstable++;
+    u->hash = hash;
+    u->mm = mm;
+    u->pgn = pgn;
+    pthread_mutex_unlock(&ksm_lock);
+    return;
+  }
+  pthread_mutex_unlock(&ksm_lock);
+
+  /* A twin: both go to a new stable frame */
+  if (MEMPHY_get_freefp(ksm_mram, &fpn) < 0)
+    return;
+  MEMPHY_write_block(ksm_mram, fpn * PAGING_PAGESZ, page, PAGING_PAGESZ);
+
+  pthread_mutex_lock(&ksm_lock);
+  ksm_stable_insert(hash, fpn);
+  ksm_ref[fpn] = 0;
+  ksm_pending[fpn] = 0;
+  ksm_post(u->mm, u->pgn, fpn);
+  ksm_post(mm, pgn, fpn);
+  pthread_mutex_unlock(&ksm_lock);
+}
+
+/* Scan the next pages of the registered address spaces */
+static void ksm_scan(int *cursor_mm, int *cursor_pgn)
+{
+  BYTE page[PAGING_PAGESZ];
+  struct mm_struct *mm;
+  int npage = 0, nmm, end, pgn, ok;
+  uint32_t pte;
+
+  while (npage < ksm_scan_pages) {
+    pthread_mutex_lock(&ksm_lock);
+    nmm = ksm_nmm;
+    if (*cursor_mm >= nmm) { /* pass done, forget the unstable pages */
+      *cursor_mm = 0;
+      memset(ksm_utbl, 0, (ksm_tblmask + 1) * sizeof(*ksm_utbl));
+      ksm_nunstable = 0;
+      ksm_npass += nmm > 0;
+      pthread_mutex_unlock(&ksm_lock);
+      return;
+    }
+    mm = ksm_mm[*cursor_mm];
+    pthread_mutex_unlock(&ksm_lock);
+
+    /* Skip an owner that has not applied the last hints yet */
+    if (__atomic_load_n(&mm->ksm_hints, __ATOMIC_ACQUIRE) != NULL) {
+      (*cursor_mm)++;
+      *cursor_pgn = 0;
+      continue;
+    }
+
+    pthread_mutex_lock(&mm->mm_lock);
+    end = DIV_ROUND_UP(mm->mmap->vm_end, PAGING_PAGESZ);
+    for (pgn = *cursor_pgn, ok = 0; pgn < end && !ok; pgn++) {
+      pte = pte_get(mm, pgn);
+      ok = PAGING_PAGE_PRESENT(pte) && !(pte & PAGING_PTE_KSM_MASK);
+      if (ok)
+        MEMPHY_read_block(ksm_mram, PAGING_PTE_FPN(pte) * PAGING_PAGESZ,
+                          page, PAGING_PAGESZ);
+    }
+    pthread_mutex_unlock(&mm->mm_lock);
+
+    if (!ok) { /* next address space */
+      (*cursor_mm)++;
+      *cursor_pgn = 0;
+      continue;
+    }
+    *cursor_pgn = pgn;
+    ksm_scan_page(mm, pgn - 1, page);
+    npage++;
+  }
+}
+
+static void *ksm_routine(void *arg)
+{
+  int cursor_mm = 0, cursor_pgn = 0;
+  unsigned long t;
+
+  (void)arg;
+  while (!__atomic_load_n(&ksm_stopping, __ATOMIC_ACQUIRE)) {
+    t = ksm_now(CLOCK_THREAD_CPUTIME_ID);
+    ksm_scan(&cursor_mm, &cursor_pgn);
+    t = ksm_now(CLOCK_THREAD_CPUTIME_ID) - t;
+
+    pthread_mutex_lock(&ksm_lock);
+    ksm_scan_ns += t;
+    pthread_mutex_unlock(&ksm_lock);
+    usleep(ksm_scan_us);
+  }
+  return NULL;
+}
+
+/*ksm_start - start the scanner
+ *@mram: RAM whose frames are merged
+ *@npage: pages hashed per wakeup
+ *@us: sleep between wakeups
+ */
+int ksm_start(struct memphy_struct *mram, int npage, int us)
+{
+  int size = 1, i;
+
+  while (size < 2 * mram->nfp)
+    size <<= 1;
+  ksm_stbl = malloc(size * sizeof(*ksm_stbl));
+  for (i = 0; i < size; i++)
+    ksm_stbl[i].fpn = KSM_EMPTY;
+  ksm_utbl = calloc(size, sizeof(*ksm_utbl));
+  ksm_tblmask = size - 1;
+  ksm_nunstable = 0;
+  ksm_ref = calloc(mram->nfp, sizeof(int));
+  ksm_pending = calloc(mram->nfp, sizeof(int));
+  ksm_mram = mram;
+  ksm_scan_pages = npage;
+  ksm_scan_us = us;
+
+  ksm_stopping = 0;
+  ksm_running = 1;
+  return pthread_create(&ksm_thread, NULL, ksm_routine, NULL);
+}
+
+/*ksm_stop - stop the scanner, shared pages stay shared */
+int ksm_stop(void)
+{
+  if (!ksm_running)
+    return -1;
+  __atomic_store_n(&ksm_stopping, 1, __ATOMIC_RELEASE);
+  pthread_join(ksm_thread, NULL);
+  ksm_running = 0;
+  return 0;
+}
+
+/*ksm_pause - stop the scanner and drop the hints not applied yet,
+ *e.g. for a snapshot: the merging state is rebuilt by ksm_resume()
+ */
+int ksm_pause(void)
+{
+  struct ksm_hint *h, *next;
+  struct mm_struct *mm;
+  int i, nfree;
+
+  if (ksm_stop() < 0)
+    return -1;
+
+  for (i = 0;; i++) {
+    pthread_mutex_lock(&ksm_lock);
+    mm = i < ksm_nmm ? ksm_mm[i] : NULL;
+    if (mm == NULL) {
+      pthread_mutex_unlock(&ksm_lock);
+      break;
+    }
+    h = mm->ksm_hints;
+    __atomic_store_n(&mm->ksm_hints, NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ksm_lock);
+
+    for (; h != NULL; h = next) {
+      next = h->next;
+      pthread_mutex_lock(&ksm_lock);
+      nfree = ksm_release(h->fpn, &ksm_pending[h->fpn]);
+      pthread_mutex_unlock(&ksm_lock);
+      if (nfree)
+        MEMPHY_put_freefp(ksm_mram, h->fpn);
+      free(h);
+    }
+  }
+  return 0;
+}
+
+/*ksm_resume - rebuild the shared frames from the page tables of the
+ *registered address spaces and restart the scanner, after ksm_pause()
+ */
+int ksm_resume(void)
+{
+  BYTE page[PAGING_PAGESZ];
+  struct mm_struct *mm;
+  int i, pgn, end, fpn;
+  uint32_t pte;
+
+  if (ksm_running || ksm_ref == NULL)
+    return -1;
+
+  pthread_mutex_lock(&ksm_lock);
+  for (i = 0; i <= ksm_tblmask; i++)
+    ksm_stbl[i].fpn = KSM_EMPTY;
+  memset(ksm_utbl, 0, (ksm_tblmask + 1) * sizeof(*ksm_utbl));
+  ksm_nunstable = 0;
+  memset(ksm_ref, 0, ksm_mram->nfp * sizeof(int));
+  ksm_nshared = ksm_nsharing = 0;
+  pthread_mutex_unlock(&ksm_lock);
+
+  for (i = 0;; i++) {
+    pthread_mutex_lock(&ksm_lock);
+    mm = i < ksm_nmm ? ksm_mm[i] : NULL;
+    pthread_mutex_unlock(&ksm_lock);
+    if (mm == NULL)
+      break;
+
+    pthread_mutex_lock(&mm->mm_lock);
+    end = DIV_ROUND_UP(mm->mmap->vm_end, PAGING_PAGESZ);
+    for (pgn = 0; pgn < end; pgn++) {
+      pte = pte_get(mm, pgn);
+      if (!PAGING_PAGE_PRESENT(pte) || !(pte & PAGING_PTE_KSM_MASK))
+        continue;
+      fpn = PAGING_PTE_FPN(pte);
+      pthread_mutex_lock(&ksm_lock);
+      if (ksm_ref[fpn]++ == 0) {
+        MEMPHY_read_block(ksm_mram, fpn * PAGING_PAGESZ, page, PAGING_PAGESZ);
+        ksm_stable_insert(ksm_hash(page), fpn);
+        ksm_nshared++;
+      }
+      ksm_nsharing++;
+      pthread_mutex_unlock(&ksm_lock);
+    }
+    pthread_mutex_unlock(&mm->mm_lock);
+  }
+
+  ksm_stopping = 0;
+  ksm_running = 1;
+  return pthread_create(&ksm_thread, NULL, ksm_routine, NULL);
+}
+
+/*ksm_register - have the pages of an address space scanned
+ *@mm: address space, never freed
+ */
+int ksm_register(struct mm_struct *mm)
+{
+  pthread_mutex_lock(&ksm_lock);
+  if (ksm_nmm == ksm_maxmm) {
+    ksm_maxmm = ksm_maxmm ? 2 * ksm_maxmm : 16;
+    ksm_mm = realloc(ksm_mm, ksm_maxmm * sizeof(*ksm_mm));
+  }
+  ksm_mm[ksm_nmm++] = mm;
+  pthread_mutex_unlock(&ksm_lock);
+  return 0;
+}
+
+/*ksm_merge - apply the merge hints of a process, on the CPU about to
+ *run it
+ *@caller: process
+ */
+int ksm_merge(struct pcb_t *caller)
+{
+  BYTE page[PAGING_PAGESZ], shared[PAGING_PAGESZ];
+  struct mm_struct *mm = caller->mm;
+  struct ksm_hint *h, *next;
+  unsigned long t;
+  uint32_t pte;
+  int merged, oldfpn, nfree;
+
+  if (__atomic_load_n(&mm->ksm_hints, __ATOMIC_ACQUIRE) == NULL)
+    return 0;
+
+  t = ksm_now(CLOCK_MONOTONIC);
+  pthread_mutex_lock(&mm->mm_lock);
+  pthread_mutex_lock(&ksm_lock);
+  h = mm->ksm_hints;
+  __atomic_store_n(&mm->ksm_hints, NULL, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&ksm_lock);
+
+  for (; h != NULL; h = next) {
+    next = h->next;
+    pte = pte_get(mm, h->pgn);
+    merged = 0;
+    oldfpn = PAGING_PTE_FPN(pte);
+    if (PAGING_PAGE_PRESENT(pte) && !(pte & PAGING_PTE_KSM_MASK)) {
+      MEMPHY_read_block(ksm_mram, oldfpn * PAGING_PAGESZ, page,
+                        PAGING_PAGESZ);
+      MEMPHY_read_block(ksm_mram, h->fpn * PAGING_PAGESZ, shared,
+                        PAGING_PAGESZ);
+      merged = memcmp(page, shared, PAGING_PAGESZ) == 0;
+    }
+    if (merged) {
+      pte_set_fpn(&pte, h->fpn);
+      SETBIT(pte, PAGING_PTE_KSM_MASK);
+      pte_set(mm, h->pgn, pte);
+#ifdef CPU_TLB
+      tlb_shootdown(caller, h->pgn, h->pgn);
+#endif
+      MEMPHY_put_freefp(ksm_mram, oldfpn);
+    }
+
+    pthread_mutex_lock(&ksm_lock);
+    if (merged) {
+      if (ksm_ref[h->fpn]++ == 0)
+        ksm_nshared++;
+      ksm_nsharing++;
+      ksm_nmerge++;
+    } else {
+      ksm_nstale++;
+    }
+    nfree = ksm_release(h->fpn, &ksm_pending[h->fpn]);
+    pthread_mutex_unlock(&ksm_lock);
+    if (nfree)
+      MEMPHY_put_freefp(ksm_mram, h->fpn);
+    free(h);
+  }
+  pthread_mutex_unlock(&mm->mm_lock);
+
+  t = ksm_now(CLOCK_MONOTONIC) - t;
+  pthread_mutex_lock(&ksm_lock);
+  ksm_merge_ns += t;
+  pthread_mutex_unlock(&ksm_lock);
+  return 0;
+}
+
+/*ksm_put - a page stops mapping a shared frame, mm_lock held
+ *@fpn: shared frame
+ */
+int ksm_put(int fpn)
+{
+  int nfree;
+
+  pthread_mutex_lock(&ksm_lock);
+  ksm_nsharing--;
+  if (ksm_ref[fpn] == 1)
+    ksm_nshared--;
+  nfree = ksm_release(fpn, &ksm_ref[fpn]);
+  pthread_mutex_unlock(&ksm_lock);
+  if (nfree)
+    MEMPHY_put_freefp(ksm_mram, fpn);
+  return 0;
+}
+
+/*ksm_break - give a shared page a private copy before it is written,
+ *mm_lock held
+ *@caller: owner of the page
+ *@pgn: page
+ *@fpn: returned private frame
+ */
+int ksm_break(struct pcb_t *caller, int pgn, int *fpn)
+{
+  uint32_t pte = pte_get(caller->mm, pgn);
+  int shared = PAGING_PTE_FPN(pte);
+
+  if (pg_take_frame(caller, fpn) < 0)
+    return -1;
+  MEMPHY_copy_frames(caller->mram, shared, caller->mram, *fpn, 1);
+  pte_set_fpn(&pte, *fpn);
+  CLRBIT(pte, PAGING_PTE_KSM_MASK);
+  pte_set(caller->mm, pgn, pte);
+  ksm_put(shared);
+
+  pthread_mutex_lock(&ksm_lock);
+  ksm_nbreak++;
+  pthread_mutex_unlock(&ksm_lock);
+
+#ifdef CPU_TLB
+  tlb_refill(caller, pgn, *fpn);
+#endif
+  return 0;
+}
+
+/*
+ * ksm_stat - print the frames merging saves and what the scanning and
+ * merging cost
+ */
+int ksm_stat(void)
+{
+  if (ksm_ref == NULL)
+    return -1;
+
+  printf("KSM: %lu pages scanned in %lu passes, %d frames shared by %d "
+         "pages, %d frames saved\n", ksm_nscan, ksm_npass, ksm_nshared,
+         ksm_nsharing, ksm_nsharing - ksm_nshared);
+  printf("  %lu merges, %lu stale hints, %lu copies on write, scanner CPU "
+         "%.3f ms (%.2f us/page), merging %.3f ms\n", ksm_nmerge, ksm_nstale,
+         ksm_nbreak, ksm_scan_ns / 1e6,
+         ksm_nscan ? ksm_scan_ns / 1e3 / ksm_nscan : 0.0, ksm_merge_ns / 1e6);
+  return 0;
+}
+
+#endif
@@ -5,14 +5,14 @@
  */
 
 #include "mm.h"
+#include "snapshot.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 
 #ifdef MM_PAGING
 
-pthread_mutex_t mp_lock = PTHREAD_MUTEX_INITIALIZER;
-
 int print_rg_memphy(struct pcb_t *caller, struct vm_rg_struct rgnode){
   int pgn_start = PAGING_PGN(rgnode.rg_start);
   int pgn_end = PAGING_PGN(rgnode.rg_end);
@@ -20,9 +20,10 @@ int print_rg_memphy(struct pcb_t *caller, struct vm_rg_struct rgnode){
   int off_end = PAGING_OFFST(rgnode.rg_end);
   int fpn_start, fpn_end;
 
-  /* Get the page to MEMRAM, swap from MEMSWAP if needed */
-  pg_getpage(caller->mm, pgn_start, &fpn_start, caller);
-  pg_getpage(caller->mm, pgn_end, &fpn_end, caller);
+  /* Get the page to MEMRAM, swap from MEMSWAP if needed; the caller
+   * holds mm_lock */
+  __pg_getpage(caller->mm, pgn_start, &fpn_start, caller);
+  __pg_getpage(caller->mm, pgn_end, &fpn_end, caller);
   
   printf("\tPhysical: Start = Addr 0x%x, End = Addr 0x%x\n", fpn_start + off_start, fpn_end + off_end);
   return 0;
@@ -30,26 +31,128 @@ int print_rg_memphy(struct pcb_t *caller, struct vm_rg_struct rgnode){
 
 
 /*
- *  MEMPHY_mv_csr - move MEMPHY cursor
+ *  memphy_mark_dirty - record frames [addr, addr + len) as written
+ */
+static inline void memphy_mark_dirty(struct memphy_struct *mp, int addr, int len) {
+  int fpn, last = (addr + len - 1) / PAGING_PAGESZ;
+
+  for (fpn = addr / PAGING_PAGESZ; fpn <= last; fpn++)
+    if (!(__atomic_load_n(&mp->dirty[fpn / 64], __ATOMIC_RELAXED) &
+          (1ULL << (fpn % 64))))
+      __atomic_fetch_or(&mp->dirty[fpn / 64], 1ULL << (fpn % 64),
+                        __ATOMIC_RELAXED);
+}
+
+/*
+ * Latency model of sequential devices. Moving the cursor costs
+ * seek_ns_per_kb per KB of distance and every byte transferred
+ * xfer_ns_per_byte, MEMPHY_SEEK_NS_PER_KB and MEMPHY_XFER_NS_PER_BYTE
+ * unless set otherwise. The cost is charged to the calling thread,
+ * i.e. the CPU that runs the faulting process; cpu_routine() turns it
+ * into stalled time slots with MEMPHY_stall_slots(). Each device also
+ * sums the time it was busy, devices working in parallel.
+ * Writeback workers charge nobody: they queue their device time on the
+ * device instead, with MEMPHY_queue_ns(). The queue drains as simulated
+ * time goes by, and a CPU accessing the device first waits for what is
+ * left of it.
+ */
+static __thread unsigned long memphy_cost_ns;
+static unsigned long memphy_now_ns; /* simulated time, see MEMPHY_set_time_ns() */
+
+/*
+ *  MEMPHY_mv_csr - move MEMPHY cursor, mp_lock held
  *  @mp: memphy struct
  *  @offset: offset
  */
 int MEMPHY_mv_csr(struct memphy_struct *mp, int offset) {
-  int numstep = 0;
-  pthread_mutex_lock(&mp_lock);
-
-  mp->cursor = 0;
-  while (numstep < offset && numstep < mp->maxsz) {
-    /* Traverse sequentially */
-    mp->cursor = (mp->cursor + 1) % mp->maxsz;
-    numstep++;
-  }
+  int dist = offset - mp->cursor;
+  unsigned long ns;
 
-  pthread_mutex_unlock(&mp_lock);
+  if (dist < 0)
+    dist = -dist;
+  ns = (unsigned long)dist * mp->seek_ns_per_kb / 1024;
+  memphy_cost_ns += ns;
+  mp->busy_ns += ns;
+  mp->cursor = offset % mp->maxsz;
 
   return 0;
 }
 
+/*
+ *  memphy_xfer - stream len bytes from the cursor, mp_lock held
+ */
+static inline void memphy_xfer(struct memphy_struct *mp, int len) {
+  unsigned long ns = (unsigned long)len * mp->xfer_ns_per_byte;
+
+  memphy_cost_ns += ns;
+  mp->busy_ns += ns;
+  mp->cursor = (mp->cursor + len) % mp->maxsz;
+}
+
+/*
+ *  MEMPHY_stall_slots - whole time slots of device latency the calling
+ *  CPU owes, the remainder is carried over
+ */
+int MEMPHY_stall_slots(void) {
+  int nslot = memphy_cost_ns / MEMPHY_SLOT_NS;
+
+  memphy_cost_ns %= MEMPHY_SLOT_NS;
+  return nslot;
+}
+
+/*
+ *  MEMPHY_take_cost_ns - device latency charged to the calling thread
+ *  so far, which then owes nothing. For threads other than CPUs, e.g.
+ *  the swap writeback workers, that account their latency themselves
+ */
+unsigned long MEMPHY_take_cost_ns(void) {
+  unsigned long ns = memphy_cost_ns;
+
+  memphy_cost_ns = 0;
+  return ns;
+}
+
+/*
+ *  MEMPHY_set_time_ns - simulated time reached, by the CPUs at the start
+ *  of each time slot
+ *  @ns: time
+ */
+void MEMPHY_set_time_ns(unsigned long ns) {
+  __atomic_store_n(&memphy_now_ns, ns, __ATOMIC_RELAXED);
+}
+
+/*
+ *  MEMPHY_queue_ns - queue background device time after the writeback
+ *  already queued on the device, or from now if it is idle
+ *  @mp: memphy struct
+ *  @ns: device time
+ */
+void MEMPHY_queue_ns(struct memphy_struct *mp, unsigned long ns) {
+  unsigned long now = __atomic_load_n(&memphy_now_ns, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&mp->mp_lock);
+  if (mp->wb_until_ns < now)
+    mp->wb_until_ns = now;
+  mp->wb_until_ns += ns;
+  pthread_mutex_unlock(&mp->mp_lock);
+}
+
+/*
+ *  MEMPHY_wait_queue - charge the calling CPU the writeback still queued
+ *  on the device, before it accesses it. The CPU is as far as the latency
+ *  it was charged already
+ *  @mp: memphy struct
+ */
+void MEMPHY_wait_queue(struct memphy_struct *mp) {
+  unsigned long now = __atomic_load_n(&memphy_now_ns, __ATOMIC_RELAXED) +
+                      memphy_cost_ns;
+
+  pthread_mutex_lock(&mp->mp_lock);
+  if (mp->wb_until_ns > now)
+    memphy_cost_ns += mp->wb_until_ns - now;
+  pthread_mutex_unlock(&mp->mp_lock);
+}
+
 /*
  *  MEMPHY_seq_read - read MEMPHY device
  *  @mp: memphy struct
@@ -57,21 +160,22 @@ int MEMPHY_mv_csr(struct memphy_struct *mp, int offset) {
  *  @value: obtained value
  */
 int MEMPHY_seq_read(struct memphy_struct *mp, int addr, BYTE *value) {
-  pthread_mutex_lock(&mp_lock);
   if (mp == NULL){
-    pthread_mutex_unlock(&mp_lock);
     return -1;
   }
 
-  if (!mp->rdmflg){
-    pthread_mutex_unlock(&mp_lock);
+  pthread_mutex_lock(&mp->mp_lock);
+
+  if (mp->rdmflg){
+    pthread_mutex_unlock(&mp->mp_lock);
     return -1; /* Not compatible mode for sequential read */
   }
 
   MEMPHY_mv_csr(mp, addr);
   *value = (BYTE)mp->storage[addr];
+  memphy_xfer(mp, 1);
 
-  pthread_mutex_unlock(&mp_lock);
+  pthread_mutex_unlock(&mp->mp_lock);
 
   return 0;
 }
@@ -103,21 +207,21 @@ int MEMPHY_read(struct memphy_struct *mp, int addr, BYTE *value) {
  *  @data: written data
  */
 int MEMPHY_seq_write(struct memphy_struct *mp, int addr, BYTE value) {
-  pthread_mutex_lock(&mp_lock);
-
   if (mp == NULL){
-    pthread_mutex_unlock(&mp_lock);
     return -1;
   }
 
-  if (!mp->rdmflg){
-    pthread_mutex_unlock(&mp_lock);
-    return -1; /* Not compatible mode for sequential read */
+  pthread_mutex_lock(&mp->mp_lock);
+  if (mp->rdmflg){
+    pthread_mutex_unlock(&mp->mp_lock);
+    return -1; /* Not compatible mode for sequential write */
   }
 
   MEMPHY_mv_csr(mp, addr);
   mp->storage[addr] = value;
-  pthread_mutex_unlock(&mp_lock);
+  memphy_xfer(mp, 1);
+  memphy_mark_dirty(mp, addr, 1);
+  pthread_mutex_unlock(&mp->mp_lock);
 
   return 0;
 }
@@ -133,15 +237,194 @@ int MEMPHY_write(struct memphy_struct *mp, int addr, BYTE data) {
     return -1;
   }
 
-  if (mp->rdmflg)
+  if (mp->rdmflg) {
     mp->storage[addr] = data;
-  else{ /* Sequential access device */
+    memphy_mark_dirty(mp, addr, 1);
+  } else{ /* Sequential access device */
     return MEMPHY_seq_write(mp, addr, data);
   }
 
   return 0;
 }
 
+/*
+ *  MEMPHY_read_block - read len bytes at addr
+ *  Random access devices copy straight from storage, sequential ones
+ *  seek once and stream the block.
+ *  @mp: memphy struct
+ *  @addr: address
+ *  @buf: destination buffer
+ *  @len: number of bytes
+ */
+int MEMPHY_read_block(struct memphy_struct *mp, int addr, BYTE *buf, int len) {
+  if (mp == NULL || addr < 0 || len < 0 || addr + len > mp->maxsz)
+    return -1;
+
+  if (mp->rdmflg) {
+    memcpy(buf, mp->storage + addr, len);
+    return 0;
+  }
+
+  pthread_mutex_lock(&mp->mp_lock);
+  MEMPHY_mv_csr(mp, addr);
+  memcpy(buf, mp->storage + addr, len);
+  memphy_xfer(mp, len);
+  pthread_mutex_unlock(&mp->mp_lock);
+
+  return 0;
+}
+
+/*
+ *  MEMPHY_write_block - write len bytes at addr
+ *  @mp: memphy struct
+ *  @addr: address
+ *  @buf: source buffer
+ *  @len: number of bytes
+ */
+int MEMPHY_write_block(struct memphy_struct *mp, int addr, const BYTE *buf, int len) {
+  if (mp == NULL || addr < 0 || len < 0 || addr + len > mp->maxsz)
+    return -1;
+
+  if (len == 0)
+    return 0;
+  if (mp->rdmflg) {
+    memcpy(mp->storage + addr, buf, len);
+    memphy_mark_dirty(mp, addr, len);
+    return 0;
+  }
+
+  pthread_mutex_lock(&mp->mp_lock);
+  MEMPHY_mv_csr(mp, addr);
+  memcpy(mp->storage + addr, buf, len);
+  memphy_mark_dirty(mp, addr, len);
+  memphy_xfer(mp, len);
+  pthread_mutex_unlock(&mp->mp_lock);
+
+  return 0;
+}
+
+/*
+ *  MEMPHY_copy_frames - copy nfp frames from one device to another
+ *  @mpsrc: source memphy
+ *  @srcfpn: first source frame
+ *  @mpdst: destination memphy
+ *  @dstfpn: first destination frame
+ *  @nfp: number of frames
+ */
+int MEMPHY_copy_frames(struct memphy_struct *mpsrc, int srcfpn,
+                       struct memphy_struct *mpdst, int dstfpn, int nfp) {
+  int src = srcfpn * PAGING_PAGESZ, dst = dstfpn * PAGING_PAGESZ;
+  int len = nfp * PAGING_PAGESZ, pgit;
+  BYTE page[PAGING_PAGESZ];
+
+  if (mpsrc == NULL || mpdst == NULL || nfp < 0 ||
+      src < 0 || src + len > mpsrc->maxsz ||
+      dst < 0 || dst + len > mpdst->maxsz)
+    return -1;
+
+  if (mpsrc->rdmflg && mpdst->rdmflg) {
+    /* One bulk copy, frames of one device may overlap */
+    memmove(mpdst->storage + dst, mpsrc->storage + src, len);
+    if (len > 0)
+      memphy_mark_dirty(mpdst, dst, len);
+    return 0;
+  }
+
+  /* A sequential device is seeked once per page */
+  for (pgit = 0; pgit < nfp; pgit++) {
+    MEMPHY_read_block(mpsrc, src + pgit * PAGING_PAGESZ, page, PAGING_PAGESZ);
+    MEMPHY_write_block(mpdst, dst + pgit * PAGING_PAGESZ, page, PAGING_PAGESZ);
+  }
+
+  return 0;
+}
+
+/*
+ * Buddy allocator. Free frames form blocks of 2^k frames aligned on
+ * 2^k. The buddy of block f of order k is f ^ 2^k; a freed block is
+ * merged with its buddy as long as that one is free and whole. Each
+ * order keeps a doubly linked list of its free blocks, threaded through
+ * fp_next/fp_prev at the block's first frame, so unlinking a buddy is
+ * O(1) and no memory is allocated after MEMPHY_format().
+ */
+static void memphy_blk_push(struct memphy_struct *mp, int fpn, int order)
+{
+  int head = mp->fp_head[order];
+
+  mp->fp_order[fpn] = order;
+  mp->fp_prev[fpn] = -1;
+  mp->fp_next[fpn] = head;
+  if (head >= 0)
+    mp->fp_prev[head] = fpn;
+  mp->fp_head[order] = fpn;
+}
+
+static void memphy_blk_unlink(struct memphy_struct *mp, int fpn)
+{
+  int order = mp->fp_order[fpn];
+
+  if (mp->fp_prev[fpn] >= 0)
+    mp->fp_next[mp->fp_prev[fpn]] = mp->fp_next[fpn];
+  else
+    mp->fp_head[order] = mp->fp_next[fpn];
+  if (mp->fp_next[fpn] >= 0)
+    mp->fp_prev[mp->fp_next[fpn]] = mp->fp_prev[fpn];
+  mp->fp_order[fpn] = -1;
+}
+
+/* Take a block of 2^order frames, splitting a larger one if needed */
+static int memphy_blk_alloc(struct memphy_struct *mp, int order)
+{
+  int k, fpn;
+
+  for (k = order; k <= MEMPHY_MAX_ORDER && mp->fp_head[k] < 0; k++)
+    ;
+  if (k > MEMPHY_MAX_ORDER)
+    return -1;
+
+  fpn = mp->fp_head[k];
+  memphy_blk_unlink(mp, fpn);
+  /* Upper halves go back; the lowest frames are handed out first */
+  while (k > order) {
+    k--;
+    memphy_blk_push(mp, fpn + (1 << k), k);
+  }
+  mp->free_fp_cnt -= 1 << order;
+  return fpn;
+}
+
+/* Give back a block of 2^order frames, merging it with free buddies */
+static void memphy_blk_free(struct memphy_struct *mp, int fpn, int order)
+{
+  mp->free_fp_cnt += 1 << order;
+  while (order < MEMPHY_MAX_ORDER) {
+    int buddy = fpn ^ (1 << order);
+
+    if (buddy + (1 << order) > mp->nfp || mp->fp_order[buddy] != order)
+      break;
+    memphy_blk_unlink(mp, buddy);
+    if (buddy < fpn)
+      fpn = buddy;
+    order++;
+  }
+  memphy_blk_push(mp, fpn, order);
+}
+
+/* Give back frames [fpn, fpn + nfp) as the largest aligned blocks */
+static void memphy_range_free(struct memphy_struct *mp, int fpn, int nfp)
+{
+  while (nfp > 0) {
+    int order = 0;
+
+    while (order < MEMPHY_MAX_ORDER && !(fpn & (1 << order)) &&
+           (2 << order) <= nfp)
+      order++;
+    memphy_blk_free(mp, fpn, order);
+    fpn += 1 << order;
+    nfp -= 1 << order;
+  }
+}
+
 /*
  *  MEMPHY_format-format MEMPHY device
  *  @mp: memphy struct
@@ -149,97 +432,201 @@ int MEMPHY_write(struct memphy_struct *mp, int addr, BYTE data) {
 int MEMPHY_format(struct memphy_struct *mp, int pagesz) {
   /* This setting come with fixed constant PAGESZ */
   int numfp = mp->maxsz / pagesz;
-  struct framephy_struct *newfst, *fst;
-  int iter = 0;
+  int k, fpn;
 
   if (numfp <= 0){
     return -1;
   }
 
-  /* Init head of free framephy list */
-  fst = malloc(sizeof(struct framephy_struct));
-  fst->fpn = iter;
-  mp->free_fp_list = fst;
-
-  /* We have list with first element, fill in the rest num-1 element member*/
-  pthread_mutex_lock(&mp_lock);
-  for (iter = 1; iter < numfp; iter++) {
-    newfst = malloc(sizeof(struct framephy_struct));
-    newfst->fpn = iter;
-    newfst->fp_next = NULL;
-    fst->fp_next = newfst;
-    fst = newfst;
+  pthread_mutex_lock(&mp->mp_lock);
+  mp->nfp = numfp;
+  mp->fp_next = realloc(mp->fp_next, numfp * sizeof(int));
+  mp->fp_prev = realloc(mp->fp_prev, numfp * sizeof(int));
+  mp->fp_order = realloc(mp->fp_order, numfp);
+  memset(mp->fp_order, -1, numfp);
+  for (k = 0; k <= MEMPHY_MAX_ORDER; k++)
+    mp->fp_head[k] = -1;
+  mp->free_fp_cnt = 0;
+  mp->fp_range_ok = mp->fp_range_fail = 0;
+
+  /* All frames are free. Blocks are pushed from the top of the device
+   * down so that the lowest frames are handed out first */
+  for (fpn = numfp; fpn > 0; fpn -= 1 << k) {
+    for (k = 0; k < MEMPHY_MAX_ORDER && !(fpn & (1 << k)); k++)
+      ;
+    memphy_blk_free(mp, fpn - (1 << k), k);
   }
-  pthread_mutex_unlock(&mp_lock);
+  pthread_mutex_unlock(&mp->mp_lock);
 
   return 0;
 }
 
+/*
+ *  MEMPHY_nfree - number of free frames
+ *  @mp: memphy struct
+ */
+int MEMPHY_nfree(struct memphy_struct *mp) {
+  int n;
+
+  pthread_mutex_lock(&mp->mp_lock);
+  n = mp->free_fp_cnt;
+  pthread_mutex_unlock(&mp->mp_lock);
+
+  return n;
+}
+
 int MEMPHY_get_freefp(struct memphy_struct *mp, int *retfpn) {
-  pthread_mutex_lock(&mp_lock);
-  struct framephy_struct *fpit = mp->free_fp_list;
+  int fpn;
+
+  pthread_mutex_lock(&mp->mp_lock);
+  fpn = memphy_blk_alloc(mp, 0);
+  pthread_mutex_unlock(&mp->mp_lock);
 
-  if (fpit == NULL){
-    pthread_mutex_unlock(&mp_lock);
+  if (fpn < 0)
+    return -1;
+  *retfpn = fpn;
+  return 0;
+}
+
+/*
+ *  MEMPHY_get_freefp_range - take nfp physically contiguous frames
+ *  @mp: memphy struct
+ *  @nfp: number of frames
+ *  @retfpn: first frame of the run
+ */
+int MEMPHY_get_freefp_range(struct memphy_struct *mp, int nfp, int *retfpn) {
+  int order = 0, fpn = -1;
+
+  while ((1 << order) < nfp)
+    order++;
+
+  pthread_mutex_lock(&mp->mp_lock);
+  if (nfp > 0 && order <= MEMPHY_MAX_ORDER)
+    fpn = memphy_blk_alloc(mp, order);
+  if (fpn < 0) {
+    mp->fp_range_fail++;
+    pthread_mutex_unlock(&mp->mp_lock);
     return -1;
   }
+  /* Trim the block to the request */
+  memphy_range_free(mp, fpn + nfp, (1 << order) - nfp);
+  mp->fp_range_ok++;
+  pthread_mutex_unlock(&mp->mp_lock);
 
-  *retfpn = fpit->fpn;
-  mp->free_fp_list = fpit->fp_next;
+  *retfpn = fpn;
+  return 0;
+}
 
-  /* MEMPHY is iteratively used up until its exhausted
-   * No garbage collector acting then it not been released
-   */
-  free(fpit);
-  pthread_mutex_unlock(&mp_lock);
+/*
+ *  MEMPHY_frag_stat - print free memory fragmentation of a device
+ *  Fragmentation is the share of free frames outside blocks of the
+ *  largest order the device can hold, i.e. unusable for the largest
+ *  contiguous request.
+ *  @mp: memphy struct
+ *  @name: device name
+ */
+int MEMPHY_frag_stat(struct memphy_struct *mp, const char *name) {
+  int k, fpn, nblk, top = 0, largest = -1, ntop = 0;
+
+  pthread_mutex_lock(&mp->mp_lock);
+  while (top < MEMPHY_MAX_ORDER && (2 << top) <= mp->nfp)
+    top++;
+
+  printf("MEMPHY %s: %d/%d frames free, free blocks per order:", name,
+         mp->free_fp_cnt, mp->nfp);
+  if (mp->nfp == 0) {
+    /* Not formatted, e.g. a RAM too small for a page */
+    printf(" none\n");
+    pthread_mutex_unlock(&mp->mp_lock);
+    return 0;
+  }
+  for (k = 0; k <= MEMPHY_MAX_ORDER; k++) {
+    for (nblk = 0, fpn = mp->fp_head[k]; fpn >= 0; fpn = mp->fp_next[fpn])
+      nblk++;
+    if (nblk > 0)
+      largest = k;
+    if (k == top)
+      ntop = nblk << k;
+    printf(" %d", nblk);
+  }
+  printf("\n");
+  printf("  largest free block %d frames, fragmentation %.1f%%, "
+         "contiguous requests %lu served %lu fell back\n",
+         largest < 0 ? 0 : 1 << largest,
+         mp->free_fp_cnt ? 100.0 * (mp->free_fp_cnt - ntop) / mp->free_fp_cnt
+                         : 0.0,
+         mp->fp_range_ok, mp->fp_range_fail);
+  pthread_mutex_unlock(&mp->mp_lock);
 
   return 0;
 }
 
 int numFile = 0;
 
+/*
+ *  MEMPHY_dump - dump what changed in a device since the last dump
+ *  Writes mark their frames in a dirty bitmap, so a dump only visits
+ *  frames written since the previous one and costs nothing when
+ *  nothing changed. With MEM_TO_FILE every changed byte is written as
+ *  "Addr 0x..: value" to outputN.txt, against a copy of the device as
+ *  of the last dump.
+ *  @mp: memphy struct
+ */
 int MEMPHY_dump(struct memphy_struct *mp) {
-  /*TODO dump memphy content mp->storage
-   *     for tracing the memory content
-   */
-  for(int i=0;i<mp->maxsz;i++){
-    BYTE data;
-    
-    MEMPHY_read(mp, i, &data);
-    //if(data!=0)
-    //printf("Addr 0x%x: %d\n", i, (uint32_t)data);
-  }
-  #ifdef MEM_TO_FILE
+  int w, nwords = (mp->nfp_dirty + 63) / 64;
+#ifdef MEM_TO_FILE
+  char file[32];
   FILE *ptr;
-  char file[100] = "\0";
-  char *num[10];
-  sprintf(num, "%d", numFile);
-  strcat(file, "output");
-  strcat(file, num);
-  strcat(file, ".txt");
+
+  if (mp->dump_shadow == NULL)
+    mp->dump_shadow = calloc(mp->maxsz, sizeof(BYTE));
+  sprintf(file, "output%d.txt", numFile++);
   ptr = fopen(file, "w");
-  fprintf(ptr, "Memphy content:\n");
-  for (int i = 0; i < mp->maxsz; i++) {
-    BYTE data;
-    MEMPHY_read(mp, i, &data);
-    fprintf(ptr, "Addr 0x%x: %d\n", i, (uint32_t)data); // %x is hex
+  if (ptr == NULL)
+    return -1;
+  fprintf(ptr, "Memphy changes:\n");
+#endif
+
+  for (w = 0; w < nwords; w++) {
+    if (__atomic_load_n(&mp->dirty[w], __ATOMIC_RELAXED) == 0)
+      continue;
+#ifdef MEM_TO_FILE
+    uint64_t bits = __atomic_exchange_n(&mp->dirty[w], 0, __ATOMIC_ACQ_REL);
+
+    while (bits != 0) {
+      int fpn = w * 64 + __builtin_ctzll(bits);
+      int addr = fpn * PAGING_PAGESZ, end = addr + PAGING_PAGESZ;
+
+      if (end > mp->maxsz)
+        end = mp->maxsz;
+      for (; addr < end; addr++) {
+        if (mp->storage[addr] == mp->dump_shadow[addr])
+          continue;
+        fprintf(ptr, "Addr 0x%x: %d\n", addr, (uint32_t)mp->storage[addr]);
+        mp->dump_shadow[addr] = mp->storage[addr];
+      }
+      bits &= bits - 1;
+    }
+#else
+    __atomic_store_n(&mp->dirty[w], 0, __ATOMIC_RELEASE);
+#endif
   }
-  numFile++;
+
+#ifdef MEM_TO_FILE
   fclose(ptr);
-  #endif
+#endif
   return 0;
 }
 
 int MEMPHY_put_freefp(struct memphy_struct *mp, int fpn) {
-  pthread_mutex_lock(&mp_lock);
-  struct framephy_struct *fp = mp->free_fp_list;
-  struct framephy_struct *newnode = malloc(sizeof(struct framephy_struct));
-
-  /* Create new node with value fpn */
-  newnode->fpn = fpn;
-  newnode->fp_next = fp;
-  mp->free_fp_list = newnode;
-  pthread_mutex_unlock(&mp_lock);
+  pthread_mutex_lock(&mp->mp_lock);
+  if (fpn < 0 || fpn >= mp->nfp || mp->fp_order[fpn] >= 0) {
+    /* Out of the device, or already free */
+    pthread_mutex_unlock(&mp->mp_lock);
+    return -1;
+  }
+  memphy_blk_free(mp, fpn, 0);
+  pthread_mutex_unlock(&mp->mp_lock);
 
   return 0;
 }
@@ -248,8 +635,20 @@ int MEMPHY_put_freefp(struct memphy_struct *mp, int fpn) {
  *  Init MEMPHY struct
  */
 int init_memphy(struct memphy_struct *mp, int max_size, int randomflg) {
-  mp->storage = (BYTE *)malloc(max_size * sizeof(BYTE));
+  int k;
+
+  mp->storage = (BYTE *)calloc(max_size, sizeof(BYTE));
   mp->maxsz = max_size;
+  mp->nfp_dirty = (max_size + PAGING_PAGESZ - 1) / PAGING_PAGESZ;
+  mp->dirty = calloc((mp->nfp_dirty + 63) / 64, sizeof(uint64_t));
+  mp->dump_shadow = NULL;
+  mp->fp_next = mp->fp_prev = NULL;
+  mp->fp_order = NULL;
+  for (k = 0; k <= MEMPHY_MAX_ORDER; k++)
+    mp->fp_head[k] = -1;
+  mp->nfp = mp->free_fp_cnt = 0;
+  mp->fp_range_ok = mp->fp_range_fail = 0;
+  pthread_mutex_init(&mp->mp_lock, NULL);
 
   MEMPHY_format(mp, PAGING_PAGESZ);
 
@@ -257,13 +656,66 @@ int init_memphy(struct memphy_struct *mp, int max_size, int randomflg) {
 
   if (!mp->rdmflg) /* Not Ramdom acess device, then it serial device*/
     mp->cursor = 0;
+  mp->seek_ns_per_kb = MEMPHY_SEEK_NS_PER_KB;
+  mp->xfer_ns_per_byte = MEMPHY_XFER_NS_PER_BYTE;
+  mp->busy_ns = 0;
+  mp->wb_until_ns = 0;
+
+  return 0;
+}
+
+/*
+ *  MEMPHY_save - write content and frame pool of a device to a snapshot
+ *  @mp: memphy struct
+ *  @s: snapshot
+ */
+int MEMPHY_save(struct memphy_struct *mp, struct snap *s) {
+  pthread_mutex_lock(&mp->mp_lock);
+  snap_put_u32(s, mp->maxsz);
+  snap_put_u32(s, mp->nfp);
+  snap_put_u32(s, mp->cursor);
+  snap_put_u32(s, mp->free_fp_cnt);
+  snap_put(s, mp->fp_head, sizeof(mp->fp_head));
+  snap_put_array(s, mp->storage, mp->maxsz);
+  snap_put_array(s, mp->fp_next, mp->nfp * sizeof(int));
+  snap_put_array(s, mp->fp_prev, mp->nfp * sizeof(int));
+  snap_put_array(s, mp->fp_order, mp->nfp);
+  pthread_mutex_unlock(&mp->mp_lock);
+
+  return 0;
+}
+
+/*
+ *  MEMPHY_restore - take content and frame pool of a device from a
+ *  snapshot. They are mapped from the file, nothing is read before it
+ *  is used. The device is initialized with the same size and unused
+ *  @mp: memphy struct
+ *  @s: snapshot
+ */
+int MEMPHY_restore(struct memphy_struct *mp, struct snap *s) {
+  if (snap_get_u32(s) != mp->maxsz || snap_get_u32(s) != mp->nfp)
+    return -1;
+
+  pthread_mutex_lock(&mp->mp_lock);
+  mp->cursor = snap_get_u32(s);
+  mp->free_fp_cnt = snap_get_u32(s);
+  snap_get(s, mp->fp_head, sizeof(mp->fp_head));
+  free(mp->storage);
+  free(mp->fp_next);
+  free(mp->fp_prev);
+  free(mp->fp_order);
+  mp->storage = snap_map_array(s, mp->maxsz);
+  mp->fp_next = snap_map_array(s, mp->nfp * sizeof(int));
+  mp->fp_prev = snap_map_array(s, mp->nfp * sizeof(int));
+  mp->fp_order = snap_map_array(s, mp->nfp);
+  pthread_mutex_unlock(&mp->mp_lock);
 
   return 0;
 }
 
 int MEMPHY_put_fp(struct memphy_struct *mp, int fpn)
 {
-   pthread_mutex_lock(&mp_lock);
+   pthread_mutex_lock(&mp->mp_lock);
    struct framephy_struct *fp = mp->used_fp_list;
    struct framephy_struct *newnode = malloc(sizeof(struct framephy_struct));
 
@@ -271,7 +723,7 @@ int MEMPHY_put_fp(struct memphy_struct *mp, int fpn)
    newnode->fpn = fpn;
    newnode->fp_next = fp;
    mp->used_fp_list = newnode;
-   pthread_mutex_unlock(&mp_lock);
+   pthread_mutex_unlock(&mp->mp_lock);
    return 0;
 }
 
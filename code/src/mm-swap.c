@@ -0,0 +1,461 @@
+/*
+ * PAGING based Memory Management
+ * Swap manager mm/mm-swap.c
+ *
+ * Spreads swapped pages over the configured swap devices. Devices are
+ * filled by decreasing priority: a device is only used once all those
+ * of higher priority are full. Devices of equal priority take slots in
+ * turn, so consecutive swap outs stripe across them. The swap type of
+ * a swapped PTE is the index of the device holding the page.
+ * Without swap_init() every page goes to the active_mswp of its owner.
+ *
+ * Writeback: once swap_wb_start() has run, eviction happens ahead of
+ * need. When a fault leaves fewer free RAM frames than the low mark,
+ * the faulting process unmaps victims of its own and queues them; the
+ * worker threads copy them to their slots off the CPUs' time slots.
+ * Until then the PTE is swapped with PAGING_PTE_WRITEBACK_MASK set and
+ * the frame stays pinned, out of the free pool. Completion clears the
+ * bit, wakes faults waiting on the page and releases the frame. The
+ * fault path still evicts synchronously when no frame is free at all.
+ */
+
+#include "mm.h"
+#include "snapshot.h"
+#include "trace.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifdef MM_PAGING
+
+static struct memphy_struct *swap_dev[PAGING_MAX_MMSWP]; /* NULL: unused */
+static int swap_prio[PAGING_MAX_MMSWP];
+static int swap_ndev;
+static unsigned int swap_next; /* striping cursor */
+static unsigned long swap_nout[PAGING_MAX_MMSWP];
+static unsigned long swap_nin[PAGING_MAX_MMSWP];
+
+struct swap_wb_req {
+  struct mm_struct *mm;
+  int pgn;
+  struct memphy_struct *mram;
+  int fpn;                   /* pinned RAM frame */
+  struct memphy_struct *dev;
+  int swptyp;
+  int swpoff;
+  unsigned long t_queue;     /* host ns */
+  struct swap_wb_req *next;
+};
+
+#define SWAP_WB_MAX_THREAD 8
+
+static pthread_mutex_t swap_wb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t swap_wb_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t swap_wb_idle = PTHREAD_COND_INITIALIZER; /* all done */
+static struct swap_wb_req *swap_wb_head, **swap_wb_tail = &swap_wb_head;
+static pthread_t swap_wb_thread[SWAP_WB_MAX_THREAD];
+static int swap_wb_nthread;
+static int swap_wb_low;      /* free frames the writeback keeps */
+static int swap_wb_stopping;
+static int swap_wb_inflight; /* frames pinned by queued writebacks */
+/* Statistics, under swap_wb_lock */
+static unsigned long swap_wb_nqueue, swap_wb_ndone;
+static unsigned long swap_wb_lat_ns, swap_wb_lat_max, swap_wb_dev_ns;
+static unsigned long swap_wb_nwait; /* faults that waited on a page */
+
+/*swap_init - hand the swap devices to the manager, before any swapping
+ *@devs: devices, those of size 0 are left out
+ *@prio: priority of each device
+ *@ndev: number of devices
+ */
+int swap_init(struct memphy_struct *devs, const int *prio, int ndev)
+{
+  int d;
+
+  if (ndev > PAGING_MAX_MMSWP)
+    ndev = PAGING_MAX_MMSWP;
+  for (d = 0; d < ndev; d++) {
+    swap_dev[d] = devs[d].nfp > 0 ? &devs[d] : NULL;
+    swap_prio[d] = prio[d];
+    swap_nout[d] = swap_nin[d] = 0;
+  }
+  swap_ndev = ndev;
+  swap_next = 0;
+
+  return 0;
+}
+
+/*swap_device - device of a swap type
+ *@caller: owner of the swapped page
+ *@swptyp: swap type from the PTE
+ */
+struct memphy_struct *swap_device(struct pcb_t *caller, int swptyp)
+{
+  if (swap_ndev == 0)
+    return caller->active_mswp;
+  if (swptyp < 0 || swptyp >= swap_ndev)
+    return NULL;
+  return swap_dev[swptyp];
+}
+
+/* Take a free slot, from the highest priority level with room */
+static int swap_alloc(struct pcb_t *caller, int *swptyp, int *swpoff)
+{
+  int member[PAGING_MAX_MMSWP];
+  int tried = 0, prio, n, d, i;
+  unsigned int start;
+
+  if (swap_ndev == 0) {
+    *swptyp = 0;
+    return MEMPHY_get_freefp(caller->active_mswp, swpoff);
+  }
+
+  start = __atomic_fetch_add(&swap_next, 1, __ATOMIC_RELAXED);
+  for (;;) {
+    prio = INT_MIN;
+    for (d = 0; d < swap_ndev; d++)
+      if (swap_dev[d] != NULL && !(tried & (1 << d)) && swap_prio[d] > prio)
+        prio = swap_prio[d];
+    if (prio == INT_MIN)
+      return -1; /* all devices full */
+
+    for (n = 0, d = 0; d < swap_ndev; d++)
+      if (swap_dev[d] != NULL && swap_prio[d] == prio) {
+        member[n++] = d;
+        tried |= 1 << d;
+      }
+    for (i = 0; i < n; i++) {
+      d = member[(start + i) % n];
+      if (MEMPHY_get_freefp(swap_dev[d], swpoff) == 0) {
+        *swptyp = d;
+        return 0;
+      }
+    }
+  }
+}
+
+/*swap_page_out - copy a RAM frame to a free swap slot
+ *@caller: owner of the frame
+ *@fpn: RAM frame
+ *@swptyp: returned device
+ *@swpoff: returned slot
+ */
+int swap_page_out(struct pcb_t *caller, int fpn, int *swptyp, int *swpoff)
+{
+  struct memphy_struct *mp;
+
+  if (swap_alloc(caller, swptyp, swpoff) < 0)
+    return -1;
+
+  mp = swap_device(caller, *swptyp);
+  MEMPHY_wait_queue(mp);
+  __swap_cp_page(caller->mram, fpn, mp, *swpoff);
+  if (swap_ndev > 0)
+    __atomic_fetch_add(&swap_nout[*swptyp], 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/*swap_page_in - copy a swapped page to a RAM frame and free its slot
+ *@caller: owner of the page
+ *@swptyp: device
+ *@swpoff: slot
+ *@fpn: RAM frame
+ */
+int swap_page_in(struct pcb_t *caller, int swptyp, int swpoff, int fpn)
+{
+  struct memphy_struct *mp = swap_device(caller, swptyp);
+
+  if (mp == NULL)
+    return -1;
+
+  MEMPHY_wait_queue(mp);
+  __swap_cp_page(mp, swpoff, caller->mram, fpn);
+  if (swap_ndev > 0)
+    __atomic_fetch_add(&swap_nin[swptyp], 1, __ATOMIC_RELAXED);
+  return MEMPHY_put_freefp(mp, swpoff);
+}
+
+/*swap_page_free - free the slot of a swapped page that is dropped
+ *@caller: owner of the page
+ *@swptyp: device
+ *@swpoff: slot
+ */
+int swap_page_free(struct pcb_t *caller, int swptyp, int swpoff)
+{
+  struct memphy_struct *mp = swap_device(caller, swptyp);
+
+  if (mp == NULL)
+    return -1;
+  return MEMPHY_put_freefp(mp, swpoff);
+}
+
+static unsigned long swap_wb_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* Write one page back, then hand the frame back to RAM */
+static void swap_wb_complete(struct swap_wb_req *req)
+{
+  unsigned long devns, lat;
+  uint32_t pte;
+  int owned;
+
+  __swap_cp_page(req->mram, req->fpn, req->dev, req->swpoff);
+  devns = MEMPHY_take_cost_ns();
+  /* The device is busy with it, the next CPU access waits */
+  MEMPHY_queue_ns(req->dev, devns);
+  if (swap_ndev > 0)
+    __atomic_fetch_add(&swap_nout[req->swptyp], 1, __ATOMIC_RELAXED);
+
+  /* __free() may have dropped the page meanwhile, then the slot is
+   * nobody's either */
+  pthread_mutex_lock(&req->mm->mm_lock);
+  pte = pte_get(req->mm, req->pgn);
+  owned = (pte & PAGING_PTE_WRITEBACK_MASK) &&
+          PAGING_SWPTYP(pte) == req->swptyp &&
+          PAGING_SWP(pte) == req->swpoff;
+  if (owned) {
+    CLRBIT(pte, PAGING_PTE_WRITEBACK_MASK);
+    pte_set(req->mm, req->pgn, pte);
+    pthread_cond_broadcast(&req->mm->mm_wb_cond);
+  }
+  pthread_mutex_unlock(&req->mm->mm_lock);
+
+  if (!owned)
+    MEMPHY_put_freefp(req->dev, req->swpoff);
+  MEMPHY_put_freefp(req->mram, req->fpn);
+  __atomic_fetch_sub(&swap_wb_inflight, 1, __ATOMIC_RELAXED);
+
+  lat = swap_wb_now() - req->t_queue;
+  pthread_mutex_lock(&swap_wb_lock);
+  swap_wb_ndone++;
+  swap_wb_lat_ns += lat;
+  if (lat > swap_wb_lat_max)
+    swap_wb_lat_max = lat;
+  swap_wb_dev_ns += devns;
+  if (swap_wb_ndone == swap_wb_nqueue)
+    pthread_cond_broadcast(&swap_wb_idle);
+  pthread_mutex_unlock(&swap_wb_lock);
+}
+
+static void *swap_wb_routine(void *arg)
+{
+  struct swap_wb_req *req;
+
+  (void)arg;
+  for (;;) {
+    pthread_mutex_lock(&swap_wb_lock);
+    while (swap_wb_head == NULL && !swap_wb_stopping)
+      pthread_cond_wait(&swap_wb_cond, &swap_wb_lock);
+    req = swap_wb_head;
+    if (req == NULL) { /* stopping and drained */
+      pthread_mutex_unlock(&swap_wb_lock);
+      return NULL;
+    }
+    swap_wb_head = req->next;
+    if (swap_wb_head == NULL)
+      swap_wb_tail = &swap_wb_head;
+    pthread_mutex_unlock(&swap_wb_lock);
+
+    swap_wb_complete(req);
+    free(req);
+  }
+}
+
+/*swap_wb_start - start the writeback workers, after swap_init()
+ *@nthread: number of workers, 0 keeps eviction in the fault path
+ *@low: free RAM frames to keep
+ */
+int swap_wb_start(int nthread, int low)
+{
+  int i;
+
+  if (nthread > SWAP_WB_MAX_THREAD)
+    nthread = SWAP_WB_MAX_THREAD;
+  swap_wb_low = low;
+  swap_wb_stopping = 0;
+  for (i = 0; i < nthread; i++)
+    pthread_create(&swap_wb_thread[i], NULL, swap_wb_routine, NULL);
+  swap_wb_nthread = nthread;
+
+  return 0;
+}
+
+/*swap_wb_stop - complete the queued writebacks and stop the workers */
+int swap_wb_stop(void)
+{
+  int i;
+
+  pthread_mutex_lock(&swap_wb_lock);
+  swap_wb_stopping = 1;
+  pthread_cond_broadcast(&swap_wb_cond);
+  pthread_mutex_unlock(&swap_wb_lock);
+
+  for (i = 0; i < swap_wb_nthread; i++)
+    pthread_join(swap_wb_thread[i], NULL);
+  swap_wb_nthread = 0;
+
+  return 0;
+}
+
+/*swap_wb_drain - wait until the queued writebacks are complete, with
+ *no CPU queueing more
+ */
+int swap_wb_drain(void)
+{
+  pthread_mutex_lock(&swap_wb_lock);
+  while (swap_wb_ndone != swap_wb_nqueue)
+    pthread_cond_wait(&swap_wb_idle, &swap_wb_lock);
+  pthread_mutex_unlock(&swap_wb_lock);
+
+  return 0;
+}
+
+/*swap_wb_balance - evict pages of the caller ahead of need while RAM
+ *is short of free frames, mm_lock held
+ *@caller: faulting process
+ */
+int swap_wb_balance(struct pcb_t *caller)
+{
+  struct mm_struct *mm = caller->mm;
+  struct swap_wb_req *req;
+  uint32_t pte;
+  int vicpgn, fpn, swptyp, swpoff;
+
+  if (swap_wb_nthread == 0)
+    return 0;
+
+  while (MEMPHY_nfree(caller->mram) +
+         __atomic_load_n(&swap_wb_inflight, __ATOMIC_RELAXED) < swap_wb_low) {
+    if (find_victim_page(mm, &vicpgn) < 0)
+      break;
+    pte = pte_get(mm, vicpgn);
+    fpn = PAGING_PTE_FPN(pte);
+
+    /* Compression is CPU work, done here and the frame is free now */
+    if (zswap_store(caller->mram, fpn, &swpoff) == 0) {
+      pte_set_swap(&pte, ZSWAP_SWPTYP, swpoff);
+      pte_set(mm, vicpgn, pte);
+      TRACE(caller->pid, TRACE_SWAPOUT, vicpgn * PAGING_PAGESZ, 0, fpn);
+#ifdef CPU_TLB
+      tlb_shootdown(caller, vicpgn, vicpgn);
+#endif
+      MEMPHY_put_freefp(caller->mram, fpn);
+      continue;
+    }
+
+    if (swap_alloc(caller, &swptyp, &swpoff) < 0) {
+      /* Swap is full: give the page back to the ring */
+      pgn_ring_add(mm, vicpgn);
+      break;
+    }
+    pte_set_swap(&pte, swptyp, swpoff);
+    SETBIT(pte, PAGING_PTE_WRITEBACK_MASK);
+    pte_set(mm, vicpgn, pte);
+    TRACE(caller->pid, TRACE_SWAPOUT, vicpgn * PAGING_PAGESZ, 0, fpn);
+#ifdef CPU_TLB
+    tlb_shootdown(caller, vicpgn, vicpgn);
+#endif
+
+    req = malloc(sizeof(struct swap_wb_req));
+    req->mm = mm;
+    req->pgn = vicpgn;
+    req->mram = caller->mram;
+    req->fpn = fpn;
+    req->dev = swap_device(caller, swptyp);
+    req->swptyp = swptyp;
+    req->swpoff = swpoff;
+    req->t_queue = swap_wb_now();
+    req->next = NULL;
+    __atomic_fetch_add(&swap_wb_inflight, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&swap_wb_lock);
+    *swap_wb_tail = req;
+    swap_wb_tail = &req->next;
+    swap_wb_nqueue++;
+    pthread_cond_signal(&swap_wb_cond);
+    pthread_mutex_unlock(&swap_wb_lock);
+  }
+
+  return 0;
+}
+
+/*swap_wb_wait - wait until a page is written back, mm_lock held and
+ *dropped while waiting
+ *@mm: owner of the page
+ *@pgn: page
+ */
+int swap_wb_wait(struct mm_struct *mm, int pgn)
+{
+  if (!(pte_get(mm, pgn) & PAGING_PTE_WRITEBACK_MASK))
+    return 0;
+
+  pthread_mutex_lock(&swap_wb_lock);
+  swap_wb_nwait++;
+  pthread_mutex_unlock(&swap_wb_lock);
+
+  while (pte_get(mm, pgn) & PAGING_PTE_WRITEBACK_MASK)
+    pthread_cond_wait(&mm->mm_wb_cond, &mm->mm_lock);
+
+  return 0;
+}
+
+/*swap_save - write the striping cursor to a snapshot, the devices are
+ *saved on their own */
+int swap_save(struct snap *s)
+{
+  return snap_put_u32(s, swap_next);
+}
+
+/*swap_restore - take the striping cursor from a snapshot, after
+ *swap_init() with the same devices */
+int swap_restore(struct snap *s)
+{
+  swap_next = snap_get_u32(s);
+  return 0;
+}
+
+/*
+ * swap_stat - print the traffic of each swap device and the aggregate
+ * throughput, the devices transferring in parallel: the run took as
+ * long as the busiest device
+ */
+int swap_stat(void)
+{
+  unsigned long busy, maxbusy = 0, npage = 0;
+  int d;
+
+  if (swap_ndev == 0)
+    return -1;
+
+  for (d = 0; d < swap_ndev; d++) {
+    if (swap_dev[d] == NULL)
+      continue;
+    busy = swap_dev[d]->busy_ns;
+    printf("SWAP%d: prio %d, %lu pages out, %lu in, %d/%d slots free, "
+           "busy %.3f ms\n", d, swap_prio[d], swap_nout[d], swap_nin[d],
+           swap_dev[d]->free_fp_cnt, swap_dev[d]->nfp, busy / 1e6);
+    npage += swap_nout[d] + swap_nin[d];
+    if (busy > maxbusy)
+      maxbusy = busy;
+  }
+  if (maxbusy > 0)
+    printf("  %lu page transfers, aggregate %.1f MB/s\n", npage,
+           (double)npage * PAGING_PAGESZ / maxbusy * 1e3);
+  if (swap_wb_nqueue > 0)
+    printf("  writeback: %lu pages queued, %lu done, %lu faults waited, "
+           "completion avg %.1f us max %.1f us, device %.1f us avg\n",
+           swap_wb_nqueue, swap_wb_ndone, swap_wb_nwait,
+           swap_wb_lat_ns / 1e3 / swap_wb_ndone, swap_wb_lat_max / 1e3,
+           swap_wb_dev_ns / 1e3 / swap_wb_ndone);
+
+  return 0;
+}
+
+#endif
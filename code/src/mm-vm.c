@@ -4,6 +4,7 @@
  */
 
 #include "mm.h"
+#include "trace.h"
 #include "string.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,21 +12,19 @@
 
 #ifdef MM_PAGING
 
-pthread_mutex_t vm_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Victim pages: CLOCK with second chance, or plain FIFO */
+int mm_victim_clock = MM_VICTIM_CLOCK;
 
-/*enlist_vm_freerg_list - add new rg to freerg_list
+/*enlist_vm_freerg_list - add new rg to freerg_list, mm_lock held
  *@mm: memory region
  *@rg_elmt: new region
  *
  */
 int enlist_vm_freerg_list(struct mm_struct *mm, struct vm_rg_struct rg_elmt) {
-  pthread_mutex_lock(&vm_lock);
   struct vm_rg_struct *rg_node = mm->mmap->vm_freerg_list;
 
-  if (rg_elmt.rg_start >= rg_elmt.rg_end){
-    pthread_mutex_unlock(&vm_lock);
+  if (rg_elmt.rg_start >= rg_elmt.rg_end)
     return -1;
-  }
 
   struct vm_rg_struct *new_rg = (struct vm_rg_struct *)malloc(sizeof(struct vm_rg_struct));
   new_rg->rg_start = rg_elmt.rg_start;
@@ -38,7 +37,6 @@ int enlist_vm_freerg_list(struct mm_struct *mm, struct vm_rg_struct rg_elmt) {
   /* Enlist the new region */
   
   mm->mmap->vm_freerg_list = new_rg;
-  pthread_mutex_unlock(&vm_lock);
   return 0;
 }
 
@@ -77,15 +75,9 @@ struct vm_rg_struct *get_symrg_byid(struct mm_struct *mm, int rgid) {
   return &mm->symrgtbl[rgid];
 }
 
-/*__alloc - allocate a region memory
- *@caller: caller
- *@vmaid: ID vm area to alloc memory region
- *@rgid: memory region ID (used to identify variable in symbole table)
- *@size: allocated size
- *@alloc_addr: address of allocated memory region
- *
+/*vm_alloc_region - body of __alloc(), mm_lock held
  */
-int __alloc(struct pcb_t *caller, int vmaid, int rgid, int size, int *alloc_addr) {
+static int vm_alloc_region(struct pcb_t *caller, int vmaid, int rgid, int size, int *alloc_addr) {
   /*Allocate at the toproof */
   struct vm_rg_struct rgnode;
 
@@ -183,6 +175,24 @@ int __alloc(struct pcb_t *caller, int vmaid, int rgid, int size, int *alloc_addr
   return 0;
 }
 
+/*__alloc - allocate a region memory
+ *@caller: caller
+ *@vmaid: ID vm area to alloc memory region
+ *@rgid: memory region ID (used to identify variable in symbole table)
+ *@size: allocated size
+ *@alloc_addr: address of allocated memory region
+ *
+ */
+int __alloc(struct pcb_t *caller, int vmaid, int rgid, int size, int *alloc_addr) {
+  int ret;
+
+  pthread_mutex_lock(&caller->mm->mm_lock);
+  ret = vm_alloc_region(caller, vmaid, rgid, size, alloc_addr);
+  pthread_mutex_unlock(&caller->mm->mm_lock);
+
+  return ret;
+}
+
 /*__free - remove a region memory
  *@caller: caller
  *@vmaid: ID vm area to alloc memory region
@@ -195,13 +205,20 @@ int __free(struct pcb_t *caller, int vmaid, int rgid) {
 
   if (rgid < 0 || rgid > PAGING_MAX_SYMTBL_SZ)
     return -1;
+  pthread_mutex_lock(&caller->mm->mm_lock);
   int i;
   int page_start = PAGING_PGN(caller->mm->symrgtbl[rgid].rg_start);
   int page_end = PAGING_PGN(caller->mm->symrgtbl[rgid].rg_end);
   for ( i = page_start; i <= page_end; i++)
   {
-    /* code */
-    caller->mm->pgd[i] = 0;
+    uint32_t pte = pte_get(caller->mm, i);
+
+    if (PAGING_PAGE_PRESENT(pte) && (pte & PAGING_PTE_KSM_MASK))
+      ksm_put(PAGING_PTE_FPN(pte));
+    else if (!PAGING_PAGE_PRESENT(pte))
+      __swap_free(caller, pte);
+    if (pte != 0)
+      pte_set(caller->mm, i, 0);
   }
   
   /* TODO: Manage the collect freed region to freerg_list */
@@ -228,6 +245,7 @@ int __free(struct pcb_t *caller, int vmaid, int rgid) {
   printf("\tFree Region List:\n");
   print_list_rg(caller->mm->mmap->vm_freerg_list);
   #endif
+  pthread_mutex_unlock(&caller->mm->mm_lock);
   
   return 0;
 }
@@ -254,54 +272,133 @@ int pgfree_data(struct pcb_t *proc, uint32_t reg_index) {
   return __free(proc, 0, reg_index);
 }
 
-/*pg_getpage - get the page in ram
+/*pg_take_frame - a frame for a page of the caller, a free one if any,
+ *else the frame of a victim page moved out of RAM, mm_lock held
+ *@caller: caller
+ *@fpn: return FPN
+ */
+int pg_take_frame(struct pcb_t *caller, int *fpn) {
+  struct mm_struct *mm = caller->mm;
+  int vicpgn;
+  uint32_t vicpte;
+
+  if (MEMPHY_get_freefp(caller->mram, fpn) == 0)
+    return 0;
+
+  /* Find victim page */
+  if (find_victim_page(mm, &vicpgn) < 0)
+    return -1;
+
+  vicpte = pte_get(mm, vicpgn);
+
+  *fpn = PAGING_PTE_FPN(vicpte);
+
+  /* Do swap frame from MEMRAM to MEMSWP and vice versa*/
+  /* Move victim frame out: zswap pool or swap device */
+  __swap_out(caller, *fpn, &vicpte);
+  TRACE(caller->pid, TRACE_SWAPOUT, vicpgn * PAGING_PAGESZ, 0, *fpn);
+
+  /* Update page table */
+  pte_set(mm, vicpgn, vicpte);
+#ifdef CPU_TLB
+  /* The victim's translation is gone on every CPU */
+  tlb_shootdown(caller, vicpgn, vicpgn);
+#endif
+  return 0;
+}
+
+/*__pg_getpage - get the page in ram, mm_lock held
  *@mm: memory region
  *@pagenum: PGN
  *@framenum: return FPN
  *@caller: caller
  *
  */
-int pg_getpage(struct mm_struct *mm, int pgn, int *fpn, struct pcb_t *caller) {
-  uint32_t pte = mm->pgd[pgn];
+int __pg_getpage(struct mm_struct *mm, int pgn, int *fpn, struct pcb_t *caller) {
+  struct mm_xlat *x = PAGING_XLAT(mm, pgn);
+  uint32_t pte;
+  int resident;
+
+  /* Page accessed again: no page table lookup */
+  if (x->pgn == pgn) {
+    *fpn = x->fpn;
+    TRACE(caller->pid, TRACE_GETPAGE, pgn * PAGING_PAGESZ, 1, *fpn);
+#ifdef CPU_TLB
+    tlb_refill(caller, pgn, *fpn);
+#endif
+    return 0;
+  }
+
+  pte = pte_get(mm, pgn);
+  resident = PAGING_PAGE_PRESENT(pte) != 0;
 
   if (!PAGING_PAGE_PRESENT(pte)) { /* Page is not online, make it actively living */
-    int vicpgn, swpfpn;
     int vicfpn;
-    uint32_t vicpte;
 
-    int tgtfpn = PAGING_SWP(pte); // the target frame storing our variable
+    /* Evicted ahead of need and still on its way to the device */
+    if (pte & PAGING_PTE_WRITEBACK_MASK) {
+      swap_wb_wait(mm, pgn);
+      pte = pte_get(mm, pgn);
+    }
 
     /* TODO: Play with your paging theory here */
-    /* Find victim page */
-    find_victim_page(caller->mm, &vicpgn);
+    if (pg_take_frame(caller, &vicfpn) < 0)
+      return -1;
 
-    vicpte = mm->pgd[vicpgn];
+    /* Bring target page in, its swap slot is free again */
+    __swap_in(caller, pte, vicfpn);
+    TRACE(caller->pid, TRACE_SWAPIN, pgn * PAGING_PAGESZ, 0, vicfpn);
 
-    vicfpn = PAGING_FPN(vicpte);
+    /* Update its online status of the target page, nothing of the
+     * swapped PTE survives but the bits pte_set_fpn() keeps */
+    pte_set_fpn(&pte, vicfpn);
+    if (mm_victim_clock)
+      SETBIT(pte, PAGING_PTE_ACCESSED_MASK);
+    pte_set(mm, pgn, pte);
+
+    /* Keep frames free for the next faults, off this CPU; the target
+     * page is not a candidate before it is enlisted */
+    swap_wb_balance(caller);
+
+    /* Newest page of the ring */
+    pgn_ring_add(caller->mm, pgn);
+  } else if (mm_victim_clock && !(pte & PAGING_PTE_ACCESSED_MASK)) {
+    /* Used again: the CLOCK hand passes over it once more */
+    SETBIT(pte, PAGING_PTE_ACCESSED_MASK);
+    pte_set(mm, pgn, pte);
+  }
+  *fpn = PAGING_PTE_FPN(pte);
+  TRACE(caller->pid, TRACE_GETPAGE, pgn * PAGING_PAGESZ, resident, *fpn);
 
-    /* Get free frame in MEMSWP */
-    MEMPHY_get_freefp(caller->active_mswp, &swpfpn);
+  /* Merged pages stay out, their first write must find the KSM bit */
+  if (!(pte & PAGING_PTE_KSM_MASK)) {
+    x->pgn = pgn;
+    x->fpn = *fpn;
+  }
 
-    /* Do swap frame from MEMRAM to MEMSWP and vice versa*/
-    /* Copy victim frame to swap */
-    __swap_cp_page(caller->mram, vicfpn, caller->active_mswp, swpfpn);
-    /* Copy target frame from swap to mem */
-    __swap_cp_page(caller->active_mswp, tgtfpn, caller->mram, vicfpn);
+#ifdef CPU_TLB
+  /* Page walk done, refill the TLB so the next access hits */
+  tlb_refill(caller, pgn, *fpn);
+#endif
 
-    /* Update page table */
-    pte_set_swap(&vicpte, 0, swpfpn);
+  return 0;
+}
 
-    /* Update its online status of the target page */
-    // pte_set_fpn() & mm->pgd[pgn];
-    pte_set_fpn(&pte, vicfpn);
+/*pg_getpage - get the page in ram
+ *@mm: memory region
+ *@pagenum: PGN
+ *@framenum: return FPN
+ *@caller: caller
+ *
+ */
+int pg_getpage(struct mm_struct *mm, int pgn, int *fpn, struct pcb_t *caller) {
+  int ret;
 
-    /* Update fifo_pgn of process */
-    enlist_pgn_node(&caller->mm->fifo_pgn, pgn);
-  }
-  // printf("PTE %08x\n",pte);
-  *fpn = (pte)&0xFFF;
+  pthread_mutex_lock(&mm->mm_lock);
+  ret = __pg_getpage(mm, pgn, fpn, caller);
+  pthread_mutex_unlock(&mm->mm_lock);
 
-  return 0;
+  return ret;
 }
 
 /*pg_getval - read value at given offset
@@ -316,13 +413,18 @@ int pg_getval(struct mm_struct *mm, int addr, BYTE *data,
   int off = PAGING_OFFST(addr);
   int fpn;
 
-  /* Get the page to MEMRAM, swap from MEMSWAP if needed */
-  if (pg_getpage(mm, pgn, &fpn, caller) != 0)
+  /* Get the page to MEMRAM, swap from MEMSWAP if needed. The frame
+   * stays ours until the read is done */
+  pthread_mutex_lock(&mm->mm_lock);
+  if (__pg_getpage(mm, pgn, &fpn, caller) != 0) {
+    pthread_mutex_unlock(&mm->mm_lock);
     return -1; /* invalid page access */
+  }
   // printf("RUN %d %d %d\n",fpn,pgn,off);
   int phyaddr = (fpn << PAGING_ADDR_FPN_LOBIT) + off;
 
   MEMPHY_read(caller->mram, phyaddr, data);
+  pthread_mutex_unlock(&mm->mm_lock);
 
   #ifdef EX
   printf("\tPosition: Addr 0x%x\n", phyaddr);
@@ -343,12 +445,24 @@ int pg_setval(struct mm_struct *mm, int addr, BYTE value,
   int fpn;
 
   /* Get the page to MEMRAM, swap from MEMSWAP if needed */
-  if (pg_getpage(mm, pgn, &fpn, caller) != 0)
+  pthread_mutex_lock(&mm->mm_lock);
+  if (__pg_getpage(mm, pgn, &fpn, caller) != 0) {
+    pthread_mutex_unlock(&mm->mm_lock);
     return -1; /* invalid page access */
+  }
+  /* Merged with identical pages of other processes: copy on write.
+   * A cached translation is not of a merged page */
+  if (PAGING_XLAT(mm, pgn)->pgn != pgn &&
+      (pte_get(mm, pgn) & PAGING_PTE_KSM_MASK) &&
+      ksm_break(caller, pgn, &fpn) != 0) {
+    pthread_mutex_unlock(&mm->mm_lock);
+    return -1;
+  }
 
   int phyaddr = (fpn << PAGING_ADDR_FPN_LOBIT) + off;
   printf("RUN %d\n",phyaddr);
   MEMPHY_write(caller->mram, phyaddr, value);
+  pthread_mutex_unlock(&mm->mm_lock);
   #ifdef EX
   printf("\tPosition: Addr 0x%x\n", phyaddr);
   #endif
@@ -397,7 +511,11 @@ int pgread(struct pcb_t *proc, // Process executing the instruction
 
     return -1;
   }
+  int addr = proc->mm->symrgtbl[source].rg_start + offset;
+  int resident = PAGING_PAGE_PRESENT(pte_get(proc->mm, PAGING_PGN(addr))) != 0;
   int val = __read(proc, 0, source, offset, &data);
+  TRACE(proc->pid, TRACE_PGREAD, addr, resident,
+        PAGING_PTE_FPN(pte_get(proc->mm, PAGING_PGN(addr))));
 
   // proc->regs[destination] = (uint32_t)data;
 #ifdef IODUMP
@@ -449,7 +567,11 @@ int pgwrite(struct pcb_t *proc,   // Process executing the instruction
       proc->pc=proc->code->size;
       return -1;  
     }
+    int addr = proc->mm->symrgtbl[destination].rg_start + offset;
+    int resident = PAGING_PAGE_PRESENT(pte_get(proc->mm, PAGING_PGN(addr))) != 0;
     int t = __write(proc, 0, destination, offset, data);
+    TRACE(proc->pid, TRACE_PGWRITE, addr, resident,
+          PAGING_PTE_FPN(pte_get(proc->mm, PAGING_PGN(addr))));
 #ifdef IODUMP
   printf("write region=%d offset=%d value=%d\n", destination, offset, data);
 #ifdef PAGETBL_DUMP
@@ -461,26 +583,34 @@ int pgwrite(struct pcb_t *proc,   // Process executing the instruction
   return t;
 }
 
-/*free_pcb_memphy - collect all memphy of pcb
+/*free_pcb_memph - give back the frames and swap space of a finished
+ *process: frames to RAM, or to KSM when merged, swapped pages to zswap
+ *or to their swap device
  *@caller: caller
- *@vmaid: ID vm area to alloc memory region
- *@incpgnum: number of page
  */
 int free_pcb_memph(struct pcb_t *caller) {
-  int pagenum, fpn;
+  struct vm_area_struct *vma;
+  int pgn;
   uint32_t pte;
 
-  for (pagenum = 0; pagenum < PAGING_MAX_PGN; pagenum++) {
-    pte = caller->mm->pgd[pagenum];
+  pthread_mutex_lock(&caller->mm->mm_lock);
+  for (vma = caller->mm->mmap; vma != NULL; vma = vma->vm_next) {
+    for (pgn = PAGING_PGN(vma->vm_start);
+         (unsigned long)pgn * PAGING_PAGESZ < vma->vm_end; pgn++) {
+      pte = pte_get(caller->mm, pgn);
 
-    if (!PAGING_PAGE_PRESENT(pte)) {
-      fpn = PAGING_FPN(pte);
-      MEMPHY_put_freefp(caller->mram, fpn);
-    } else {
-      fpn = PAGING_SWP(pte);
-      MEMPHY_put_freefp(caller->active_mswp, fpn);
+      if (pte == 0)
+        continue;
+      if (!PAGING_PAGE_PRESENT(pte))
+        __swap_free(caller, pte); /* writeback: the worker frees it */
+      else if (pte & PAGING_PTE_KSM_MASK)
+        ksm_put(PAGING_PTE_FPN(pte));
+      else
+        MEMPHY_put_freefp(caller->mram, PAGING_PTE_FPN(pte));
+      pte_set(caller->mm, pgn, 0);
     }
   }
+  pthread_mutex_unlock(&caller->mm->mm_lock);
 
   return 0;
 }
@@ -569,36 +699,75 @@ int inc_vma_limit(struct pcb_t *caller, int vmaid, int inc_sz) {
   return 0;
 }
 
-/*find_victim_page - find victim page
- *@caller: caller
- *@pgn: return page number
+/*find_victim_page - find victim page, mm_lock held
+ *The ring holds the resident pages in the order they came in, the hand
+ *is at the oldest. With CLOCK a page used since the hand last passed
+ *gets a second chance: its accessed bit is cleared and the hand moves
+ *on. With FIFO the oldest page goes. Either way O(1) per page passed.
+ *@mm: address space
+ *@retpgn: return page number
  *
  */
 int find_victim_page(struct mm_struct *mm, int *retpgn) {
-  struct pgn_t *pgit = mm->fifo_pgn;
-  struct pgn_t *pre = pgit;
+  struct pgn_t *pg, *shared = NULL;
+  uint32_t pte;
 
-  /* TODO: Implement the theorical mechanism to find the victim page */
-  if (pgit == NULL){
-    *retpgn = 0;
-    return -1;
-  }
+  while (mm->pg_ring != NULL) {
+    pg = mm->pg_ring->pg_next;
+    pte = pte_get(mm, pg->pgn);
 
-  // Get the end of the page list
-  while (pgit->pg_next != NULL) {
-    pgit = pgit->pg_next;
-  }
+    /* __free() clears the PTEs of a region but leaves its pages in the
+     * ring: such a page has no frame to give up */
+    if (!PAGING_PAGE_PRESENT(pte)) {
+      pgn_ring_del(mm);
+      continue;
+    }
 
-  while (pre->pg_next != pgit) {
-    pre = pre->pg_next;
+    if (pte & PAGING_PTE_KSM_MASK) {
+      /* Went round: only pages merged by KSM are left, their frames
+       * are not ours to give */
+      if (pg == shared)
+        break;
+      if (shared == NULL)
+        shared = pg;
+      mm->pg_ring = pg; /* passed over */
+      continue;
+    }
+
+    if (mm_victim_clock && (pte & PAGING_PTE_ACCESSED_MASK)) {
+      CLRBIT(pte, PAGING_PTE_ACCESSED_MASK);
+      pte_set(mm, pg->pgn, pte);
+      shared = NULL; /* a page to take on the next round */
+      mm->pg_ring = pg;
+      continue;
+    }
+
+    *retpgn = pg->pgn;
+    pgn_ring_del(mm);
+    return 0;
   }
-  *retpgn = pgit->pgn;
-  pre->pg_next = NULL;
 
-  /* Put the victim page to the head of the page list */
-  // enlist_pgn_node(&mm->fifo_pgn, pgit->pgn);
+  *retpgn = 0;
+  return -1;
+}
+
+/*pg_mark_accessed - note a use of a present page for CLOCK, on TLB hits
+ *which bypass __pg_getpage()
+ *@mm: address space
+ *@pgn: page number
+ */
+int pg_mark_accessed(struct mm_struct *mm, int pgn) {
+  uint32_t pte;
+
+  /* Mostly set already: no lock */
+  if (!mm_victim_clock || (pte_get(mm, pgn) & PAGING_PTE_ACCESSED_MASK))
+    return 0;
 
-  free(pgit);
+  pthread_mutex_lock(&mm->mm_lock);
+  pte = pte_get(mm, pgn);
+  if (PAGING_PAGE_PRESENT(pte) && !(pte & PAGING_PTE_ACCESSED_MASK))
+    pte_set(mm, pgn, pte | PAGING_PTE_ACCESSED_MASK);
+  pthread_mutex_unlock(&mm->mm_lock);
 
   return 0;
 }
@@ -0,0 +1,424 @@
+/*
+ * PAGING based Memory Management
+ * Compressed swap tier mm/mm-zswap.c
+ *
+ * Evicted pages are compressed into a pool of RAM frames reserved at
+ * start up and only go to the swap device when they do not fit: the
+ * pool is full, or the page does not compress. Pages filled with one
+ * byte value are kept as that value and take no pool space. A page in
+ * the pool is swapped with type ZSWAP_SWPTYP, its swap offset is the
+ * index of its entry.
+ */
+
+#include "mm.h"
+#include "snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef MM_PAGING
+
+#define ZSWAP_CHUNK 16     /* pool allocation unit in bytes */
+#define ZSWAP_MINMATCH 4
+#define ZSWAP_HASHBITS 8
+
+struct zswap_entry {
+  int chunk; /* first chunk in the pool, -1: same-filled page */
+  int len;   /* compressed length, or the fill byte */
+  int next;  /* free entry list */
+};
+
+/* Pool state, guarded by zswap_lock (a leaf, like a device lock) */
+static pthread_mutex_t zswap_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct memphy_struct *zswap_mram;
+static int zswap_base;      /* first byte of the pool in RAM */
+static int zswap_nfp;       /* frames reserved for the pool */
+static int zswap_nchunk;
+static int zswap_chunk_used;
+static uint64_t *zswap_used; /* chunk bitmap */
+static struct zswap_entry *zswap_ent;
+static int zswap_nent;
+static int zswap_free_ent;
+static int zswap_nstored;
+
+static unsigned long zswap_stores, zswap_same, zswap_loads, zswap_misses;
+static unsigned long zswap_full, zswap_incompressible;
+static unsigned long zswap_bytes_in, zswap_bytes_out; /* compressed pages */
+
+/*
+ * LZ4-style block codec. A block is a run of sequences: a token byte
+ * (literal count << 4 | match length - 4), the literals, then a 16-bit
+ * little endian match offset. A count of 15 continues in the following
+ * bytes, 255 meaning more to come. The last sequence has literals only.
+ */
+static int zswap_put_len(BYTE *dst, int op, int len)
+{
+  for (len -= 15; len >= 255; len -= 255)
+    dst[op++] = (BYTE)255;
+  dst[op++] = (BYTE)len;
+  return op;
+}
+
+static int zswap_put_seq(BYTE *dst, int op, const BYTE *lit, int nlit,
+                         int off, int mlen)
+{
+  int token = op++;
+
+  dst[token] = (BYTE)((nlit < 15 ? nlit : 15) << 4);
+  if (nlit >= 15)
+    op = zswap_put_len(dst, op, nlit);
+  memcpy(dst + op, lit, nlit);
+  op += nlit;
+  if (mlen == 0)
+    return op;
+
+  dst[op++] = (BYTE)(off & 0xff);
+  dst[op++] = (BYTE)(off >> 8);
+  mlen -= ZSWAP_MINMATCH;
+  dst[token] |= (BYTE)(mlen < 15 ? mlen : 15);
+  if (mlen >= 15)
+    op = zswap_put_len(dst, op, mlen);
+  return op;
+}
+
+/*zswap_compress - compress n bytes
+ *@dst: output, at least n + n / 255 + 16 bytes
+ *Return the compressed length
+ */
+int zswap_compress(const BYTE *src, int n, BYTE *dst)
+{
+  int hash[1 << ZSWAP_HASHBITS];
+  int ip = 0, anchor = 0, op = 0;
+
+  memset(hash, -1, sizeof(hash));
+  while (ip + ZSWAP_MINMATCH <= n) {
+    uint32_t seq, h;
+    int ref, mlen;
+
+    memcpy(&seq, src + ip, sizeof(seq));
+    h = (seq * 2654435761u) >> (32 - ZSWAP_HASHBITS);
+    ref = hash[h];
+    hash[h] = ip;
+    if (ref < 0 || ip - ref > 0xffff ||
+        memcmp(src + ref, src + ip, ZSWAP_MINMATCH) != 0) {
+      ip++;
+      continue;
+    }
+
+    for (mlen = ZSWAP_MINMATCH; ip + mlen < n && src[ref + mlen] == src[ip + mlen];
+         mlen++)
+      ;
+    op = zswap_put_seq(dst, op, src + anchor, ip - anchor, ip - ref, mlen);
+    ip += mlen;
+    anchor = ip;
+  }
+
+  return zswap_put_seq(dst, op, src + anchor, n - anchor, 0, 0);
+}
+
+/*zswap_decompress - expand a block of len bytes into at most n bytes
+ *Return the expanded length, -1 on a corrupt block
+ */
+int zswap_decompress(const BYTE *src, int len, BYTE *dst, int n)
+{
+  const unsigned char *in = (const unsigned char *)src;
+  int ip = 0, op = 0;
+
+  while (ip < len) {
+    int token = in[ip++];
+    int nlit = token >> 4, mlen = token & 15, off;
+
+    while (nlit >= 15 && ip < len) {
+      int b = in[ip++];
+      nlit += b;
+      if (b != 255)
+        break;
+    }
+    if (ip + nlit > len || op + nlit > n)
+      return -1;
+    memcpy(dst + op, src + ip, nlit);
+    ip += nlit;
+    op += nlit;
+    if (ip >= len)
+      break;
+
+    if (ip + 2 > len)
+      return -1;
+    off = in[ip] | in[ip + 1] << 8;
+    ip += 2;
+    while (mlen >= 15 && ip < len) {
+      int b = in[ip++];
+      mlen += b;
+      if (b != 255)
+        break;
+    }
+    mlen += ZSWAP_MINMATCH;
+    if (off == 0 || off > op || op + mlen > n)
+      return -1;
+    /* Byte by byte: the match may overlap what it produces */
+    for (; mlen > 0; mlen--, op++)
+      dst[op] = dst[op - off];
+  }
+
+  return op;
+}
+
+/* First run of nchunk free chunks, zswap_lock held */
+static int zswap_chunk_alloc(int nchunk)
+{
+  int c, run = 0;
+
+  for (c = 0; c < zswap_nchunk; c++) {
+    if (zswap_used[c / 64] & (1ULL << (c % 64))) {
+      run = 0;
+      continue;
+    }
+    if (++run == nchunk)
+      break;
+  }
+  if (run < nchunk)
+    return -1;
+
+  for (c = c - nchunk + 1, run = 0; run < nchunk; run++)
+    zswap_used[(c + run) / 64] |= 1ULL << ((c + run) % 64);
+  zswap_chunk_used += nchunk;
+  return c;
+}
+
+static void zswap_chunk_free(int c, int nchunk)
+{
+  int i;
+
+  for (i = 0; i < nchunk; i++)
+    zswap_used[(c + i) / 64] &= ~(1ULL << ((c + i) % 64));
+  zswap_chunk_used -= nchunk;
+}
+
+/*zswap_init - reserve the pool in RAM
+ *@mram: RAM device
+ *@nfp: number of frames taken from it, 0 leaves the tier off
+ */
+int zswap_init(struct memphy_struct *mram, int nfp)
+{
+  int fpn, i;
+
+  if (nfp <= 0 || MEMPHY_get_freefp_range(mram, nfp, &fpn) < 0)
+    return -1;
+
+  pthread_mutex_lock(&zswap_lock);
+  zswap_mram = mram;
+  zswap_base = fpn * PAGING_PAGESZ;
+  zswap_nfp = nfp;
+  zswap_nchunk = nfp * PAGING_PAGESZ / ZSWAP_CHUNK;
+  zswap_chunk_used = 0;
+  zswap_used = calloc((zswap_nchunk + 63) / 64, sizeof(uint64_t));
+
+  /* Same-filled pages take an entry but no chunk. The entry is the swap
+   * offset in the PTE, which bounds their number on large RAMs */
+  zswap_nent = 4 * zswap_nchunk;
+  if (zswap_nent > PAGING_MAX_SWPOFF)
+    zswap_nent = PAGING_MAX_SWPOFF;
+  zswap_ent = malloc(zswap_nent * sizeof(struct zswap_entry));
+  for (i = 0; i < zswap_nent; i++)
+    zswap_ent[i].next = i + 1 < zswap_nent ? i + 1 : -1;
+  zswap_free_ent = 0;
+  zswap_nstored = 0;
+  pthread_mutex_unlock(&zswap_lock);
+
+  return 0;
+}
+
+/*zswap_store - keep a RAM frame in the pool
+ *@mram: RAM device
+ *@fpn: frame to evict
+ *@swpoff: returned entry, the swap offset of the page
+ *Return 0, or -1 if the page has to go to a swap device
+ */
+int zswap_store(struct memphy_struct *mram, int fpn, int *swpoff)
+{
+  BYTE page[PAGING_PAGESZ], buf[2 * PAGING_PAGESZ];
+  int i, len = 0, nchunk = 0, chunk = -1, e;
+
+  if (zswap_mram == NULL || mram != zswap_mram)
+    return -1;
+
+  MEMPHY_read_block(mram, fpn * PAGING_PAGESZ, page, PAGING_PAGESZ);
+  for (i = 1; i < PAGING_PAGESZ && page[i] == page[0]; i++)
+    ;
+  if (i < PAGING_PAGESZ) {
+    len = zswap_compress(page, PAGING_PAGESZ, buf);
+    nchunk = (len + ZSWAP_CHUNK - 1) / ZSWAP_CHUNK;
+  }
+
+  pthread_mutex_lock(&zswap_lock);
+  if (nchunk >= PAGING_PAGESZ / ZSWAP_CHUNK) {
+    /* No smaller than the page itself */
+    zswap_incompressible++;
+    pthread_mutex_unlock(&zswap_lock);
+    return -1;
+  }
+  if (zswap_free_ent < 0 || (nchunk > 0 && (chunk = zswap_chunk_alloc(nchunk)) < 0)) {
+    zswap_full++;
+    pthread_mutex_unlock(&zswap_lock);
+    return -1;
+  }
+  e = zswap_free_ent;
+  zswap_free_ent = zswap_ent[e].next;
+  zswap_ent[e].chunk = chunk;
+  zswap_ent[e].len = nchunk > 0 ? len : (unsigned char)page[0];
+  zswap_nstored++;
+  zswap_stores++;
+  if (nchunk == 0) {
+    zswap_same++;
+  } else {
+    zswap_bytes_in += PAGING_PAGESZ;
+    zswap_bytes_out += len;
+  }
+  pthread_mutex_unlock(&zswap_lock);
+
+  /* The chunks are ours until the entry is loaded */
+  if (nchunk > 0)
+    MEMPHY_write_block(mram, zswap_base + chunk * ZSWAP_CHUNK, buf, len);
+
+  *swpoff = e;
+  return 0;
+}
+
+/*zswap_load - bring a swapped page back into a RAM frame
+ *@mram: RAM device
+ *@pte: PTE of the swapped page
+ *@fpn: destination frame
+ *Return 0 if the page came from the pool, its entry is released, or -1
+ *if it lives on a swap device
+ */
+int zswap_load(struct memphy_struct *mram, uint32_t pte, int fpn)
+{
+  BYTE page[PAGING_PAGESZ], buf[2 * PAGING_PAGESZ];
+  struct zswap_entry ent;
+  int e = PAGING_SWP(pte);
+
+  if (PAGING_SWPTYP(pte) != ZSWAP_SWPTYP) {
+    pthread_mutex_lock(&zswap_lock);
+    zswap_misses++;
+    pthread_mutex_unlock(&zswap_lock);
+    return -1;
+  }
+
+  ent = zswap_ent[e];
+  if (ent.chunk < 0) {
+    memset(page, ent.len, PAGING_PAGESZ);
+  } else {
+    MEMPHY_read_block(mram, zswap_base + ent.chunk * ZSWAP_CHUNK, buf, ent.len);
+    zswap_decompress(buf, ent.len, page, PAGING_PAGESZ);
+  }
+  MEMPHY_write_block(mram, fpn * PAGING_PAGESZ, page, PAGING_PAGESZ);
+
+  zswap_free(e);
+  pthread_mutex_lock(&zswap_lock);
+  zswap_loads++;
+  pthread_mutex_unlock(&zswap_lock);
+
+  return 0;
+}
+
+/*zswap_free - release a pool entry and its chunks, e.g. of a page that
+ *was freed while swapped
+ *@e: entry, the swap offset of the page
+ */
+int zswap_free(int e)
+{
+  pthread_mutex_lock(&zswap_lock);
+  if (e < 0 || e >= zswap_nent) {
+    pthread_mutex_unlock(&zswap_lock);
+    return -1;
+  }
+  if (zswap_ent[e].chunk >= 0)
+    zswap_chunk_free(zswap_ent[e].chunk,
+                     (zswap_ent[e].len + ZSWAP_CHUNK - 1) / ZSWAP_CHUNK);
+  zswap_ent[e].next = zswap_free_ent;
+  zswap_free_ent = e;
+  zswap_nstored--;
+  pthread_mutex_unlock(&zswap_lock);
+
+  return 0;
+}
+
+/*zswap_save - write the pool index to a snapshot, the compressed
+ *pages are in the RAM saved with it
+ */
+int zswap_save(struct snap *s)
+{
+  pthread_mutex_lock(&zswap_lock);
+  snap_put_u32(s, zswap_mram != NULL ? zswap_nfp : 0);
+  if (zswap_mram != NULL) {
+    snap_put_u32(s, zswap_base);
+    snap_put_u32(s, zswap_chunk_used);
+    snap_put_u32(s, zswap_free_ent);
+    snap_put_u32(s, zswap_nstored);
+    snap_put(s, zswap_used, (zswap_nchunk + 63) / 64 * sizeof(uint64_t));
+    snap_put(s, zswap_ent, zswap_nent * sizeof(struct zswap_entry));
+  }
+  pthread_mutex_unlock(&zswap_lock);
+
+  return 0;
+}
+
+/*zswap_restore - take the pool index from a snapshot, after
+ *zswap_init() with the same pool size
+ */
+int zswap_restore(struct snap *s)
+{
+  int err = 0;
+
+  pthread_mutex_lock(&zswap_lock);
+  if (snap_get_u32(s) != (zswap_mram != NULL ? zswap_nfp : 0)) {
+    err = -1;
+  } else if (zswap_mram != NULL) {
+    zswap_base = snap_get_u32(s);
+    zswap_chunk_used = snap_get_u32(s);
+    zswap_free_ent = snap_get_u32(s);
+    zswap_nstored = snap_get_u32(s);
+    snap_get(s, zswap_used, (zswap_nchunk + 63) / 64 * sizeof(uint64_t));
+    snap_get(s, zswap_ent, zswap_nent * sizeof(struct zswap_entry));
+  }
+  pthread_mutex_unlock(&zswap_lock);
+
+  return err;
+}
+
+/*
+ * zswap_stat - print the effect of the tier: compression ratio of the
+ * pages it took, share of swap ins it served and swap device traffic
+ * it saved, one page written per store and one read per load
+ */
+int zswap_stat(void)
+{
+  unsigned long avoided;
+
+  pthread_mutex_lock(&zswap_lock);
+  if (zswap_mram == NULL) {
+    pthread_mutex_unlock(&zswap_lock);
+    return -1;
+  }
+
+  avoided = zswap_stores + zswap_loads;
+  printf("ZSWAP: pool %d frames, %d/%d chunks used, %d pages held\n",
+         zswap_nfp, zswap_chunk_used, zswap_nchunk, zswap_nstored);
+  printf("  stored %lu pages: %lu same-filled, %lu compressed %.2fx, "
+         "rejected %lu full %lu incompressible\n",
+         zswap_stores, zswap_same, zswap_stores - zswap_same,
+         zswap_bytes_out ? (double)zswap_bytes_in / zswap_bytes_out : 0.0,
+         zswap_full, zswap_incompressible);
+  printf("  swap ins %lu, tier hit rate %.1f%%, swap I/O avoided %lu pages "
+         "(%lu KB)\n", zswap_loads + zswap_misses,
+         zswap_loads + zswap_misses
+             ? 100.0 * zswap_loads / (zswap_loads + zswap_misses)
+             : 0.0,
+         avoided, avoided * PAGING_PAGESZ / 1024);
+  pthread_mutex_unlock(&zswap_lock);
+
+  return 0;
+}
+
+#endif
@@ -4,13 +4,15 @@
  */
 
 #include "mm.h"
+#include "snapshot.h"
+#include "trace.h"
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef MM_PAGING
 
-pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
 /*
  * init_pte - Initialize PTE entry
  */
@@ -64,20 +66,83 @@ int pte_set_swap(uint32_t *pte, int swptyp, int swpoff) {
 
 /*
  * pte_set_fpn - Set PTE entry for on-line page
+ * The swap type and offset of a swapped page share their bits with the
+ * FPN, KSM and accessed bits: they are all cleared, only the FPN is set
  * @pte   : target page table entry (PTE)
  * @fpn   : frame page number (FPN)
  */
 int pte_set_fpn(uint32_t *pte, int fpn) {
   SETBIT(*pte, PAGING_PTE_PRESENT_MASK);
   CLRBIT(*pte, PAGING_PTE_SWAPPED_MASK);
+  CLRBIT(*pte, PAGING_PTE_WRITEBACK_MASK);
+  CLRBIT(*pte, PAGING_PTE_SWPTYP_MASK);
+  CLRBIT(*pte, PAGING_PTE_SWPOFF_MASK);
 
   SETVAL(*pte, fpn, PAGING_PTE_FPN_MASK, PAGING_PTE_FPN_LOBIT);
 
   return 0;
 }
 
+/* Page tables: per process two level ones, or the inverted page table
+ * shared by all (mm-ipt.c). Chosen before the first init_mm() */
+int mm_pgtbl_inverted = MM_PGTBL_INVERTED;
+
+static uint32_t mm_nid; /* last address space id */
+
+/*
+ * pte_get - read the PTE of a page, 0 when it is not mapped. Leaf
+ * tables live as long as the mm, a lookup takes no lock
+ * @mm  : address space
+ * @pgn : page number
+ */
+uint32_t pte_get(struct mm_struct *mm, int pgn) {
+  uint32_t *leaf;
+
+  if (mm_pgtbl_inverted)
+    return ipt_get(mm->id, pgn);
+
+  leaf = __atomic_load_n(&mm->pgd[pgn >> PAGING_PTE_LEAF_BITS],
+                         __ATOMIC_ACQUIRE);
+  return leaf ? leaf[pgn & (PAGING_PTE_LEAF_SZ - 1)] : 0;
+}
+
+/*
+ * pte_set - write the PTE of a page, mm_lock held. A leaf table is made
+ * on first use, two threads making the same one keep the first
+ * @mm  : address space
+ * @pgn : page number
+ * @pte : page table entry, 0 unmaps the page
+ */
+int pte_set(struct mm_struct *mm, int pgn, uint32_t pte) {
+  struct mm_xlat *x = PAGING_XLAT(mm, pgn);
+  uint32_t **slot, *leaf, *new;
+
+  /* Swapped out, freed, merged or moved: the translation is stale */
+  if (x->pgn == pgn)
+    x->pgn = -1;
+
+  if (mm_pgtbl_inverted)
+    return ipt_set(mm->id, pgn, pte);
+
+  slot = &mm->pgd[pgn >> PAGING_PTE_LEAF_BITS];
+  leaf = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+  if (leaf == NULL) {
+    if (pte == 0)
+      return 0;
+    new = calloc(PAGING_PTE_LEAF_SZ, sizeof(uint32_t));
+    if (__atomic_compare_exchange_n(slot, &leaf, new, 0, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE))
+      leaf = new;
+    else
+      free(new);
+  }
+
+  leaf[pgn & (PAGING_PTE_LEAF_SZ - 1)] = pte;
+  return 0;
+}
+
 /*
- * vmap_page_range - map a range of page at aligned address
+ * vmap_page_range - map a range of page at aligned address, mm_lock held
  */
 int vmap_page_range(
     struct pcb_t *caller,           // process call
@@ -88,6 +153,7 @@ int vmap_page_range(
 {                                   // no guarantee all given pages are mapped
   // uint32_t *pte = malloc(sizeof(uint32_t));
   struct framephy_struct *fpit = frames;
+  uint32_t pte;
   int fpn;
   int pgit;
 
@@ -96,89 +162,97 @@ int vmap_page_range(
 
   /* TODO map range of frame to address space
    *      [addr to addr + pgnum*PAGING_PAGESZ
-   *      in page table caller->mm->pgd[]
+   *      in page table of caller->mm
    */
-  pthread_mutex_lock(&mem_lock);
   for (pgit = 0; pgit < pgnum; pgit++) {
     fpn = fpit->fpn;
     int pgn = PAGING_PGN((addr + pgit * PAGING_PAGESZ));
     ret_rg->rg_end += PAGING_PAGESZ;
-    pte_set_fpn(&caller->mm->pgd[pgn], fpn);
-    enlist_pgn_node(&caller->mm->fifo_pgn, pgn);
+    pte = pte_get(caller->mm, pgn);
+    pte_set_fpn(&pte, fpn);
+    pte_set(caller->mm, pgn, pte);
+    pgn_ring_add(caller->mm, pgn);
     fpit = fpit->fp_next; 
     
   }
-  pthread_mutex_unlock(&mem_lock);
 
   return 0;
 }
 
 /*
- * alloc_pages_range - allocate req_pgnum of frame in ram
+ * alloc_pages_range - allocate req_pgnum of frame in ram, mm_lock of
+ * the caller held. Frames come from the RAM pool under its own lock,
+ * so processes allocating on other CPUs only meet there.
  * @caller    : caller
  * @req_pgnum : request page num
  * @frm_lst   : frame list
  */
 
 int alloc_pages_range(struct pcb_t *caller, int req_pgnum, struct framephy_struct **frm_lst) {
+  uint32_t pte;
   int pgit, fpn;
   struct framephy_struct *newfp_str=NULL;
+  struct framephy_struct **tail = frm_lst;
+
+  /* Append so pages of the range get frames in allocation order */
+  while (*tail != NULL)
+    tail = &(*tail)->fp_next;
+
+  /* A physically contiguous run first, for bulk copies and multi-page
+   * TLB entries; otherwise frames are gathered one by one */
+  if (req_pgnum > 1 &&
+      MEMPHY_get_freefp_range(caller->mram, req_pgnum, &fpn) == 0) {
+    for (pgit = 0; pgit < req_pgnum; pgit++) {
+      newfp_str = malloc(sizeof(struct framephy_struct));
+      newfp_str->owner = caller->mm;
+      newfp_str->fp_next = NULL;
+      newfp_str->fpn = fpn + pgit;
+      *tail = newfp_str;
+      tail = &newfp_str->fp_next;
+    }
+    return 0;
+  }
 
-  pthread_mutex_lock(&mem_lock);
   for (pgit = 0; pgit < req_pgnum; pgit++) {
     if (MEMPHY_get_freefp(caller->mram, &fpn) == 0) {
       newfp_str = malloc(sizeof(struct framephy_struct));
       newfp_str->owner = caller->mm;
-      if(frm_lst == NULL)
-     {
-       newfp_str->fp_next = NULL;
-       newfp_str->fpn = fpn;
-       *frm_lst = newfp_str;
-     }
-      // case 2: frame list is not empty
-      else
-      {
-        newfp_str->fp_next = *frm_lst;
-        newfp_str->fpn = fpn;
-        *frm_lst = newfp_str;
-      }
+      newfp_str->fp_next = NULL;
+      newfp_str->fpn = fpn;
+      *tail = newfp_str;
+      tail = &newfp_str->fp_next;
       // MEMPHY_put_fp(caller->mram, fpn);
       
     } else { // ERROR CODE of obtaining somes but not enough frames
-      int vicpgn, swfpn;
+      int vicpgn;
 
       /* Get victim frame from victim page*/
-      find_victim_page(caller->mm,&vicpgn);
-      fpn = PAGING_FPN(caller->mm->pgd[vicpgn]);
-
-      /* Get free frame in MEMSWP */
-      MEMPHY_get_freefp(caller->active_mswp, &swfpn);
-      /* Copy victim frame to swap */
-      __swap_cp_page(caller->mram, fpn, caller->active_mswp, swfpn);
-      /* Update page table */
-      pte_set_swap(&caller->mm->pgd[vicpgn], 0, swfpn);
+      if (find_victim_page(caller->mm, &vicpgn) < 0) {
+        /* RAM is full and the caller owns no page to give up */
+        return -1;
+      }
+      pte = pte_get(caller->mm, vicpgn);
+      fpn = PAGING_PTE_FPN(pte);
+
+      /* Move the victim frame out and update the page table */
+      __swap_out(caller, fpn, &pte);
+      pte_set(caller->mm, vicpgn, pte);
+      TRACE(caller->pid, TRACE_SWAPOUT, vicpgn * PAGING_PAGESZ, 0, fpn);
+#ifdef CPU_TLB
+      tlb_shootdown(caller, vicpgn, vicpgn);
+#endif
 
       newfp_str = malloc(sizeof(struct framephy_struct));
       newfp_str->owner = caller->mm;
 
-      if(frm_lst == NULL)
-     {
-       newfp_str->fp_next = NULL;
-       newfp_str->fpn = fpn;
-       *frm_lst = newfp_str;
-     }
-      // case 2: frame list is not empty
-      else
-      {
-        newfp_str->fp_next = *frm_lst;
-        newfp_str->fpn = fpn;
-        *frm_lst = newfp_str;
-      }
+      newfp_str->fp_next = NULL;
+      newfp_str->fpn = fpn;
+      *tail = newfp_str;
+      tail = &newfp_str->fp_next;
       
     }
     
   }
-  pthread_mutex_unlock(&mem_lock);
 
   return 0;
 }
@@ -221,6 +295,9 @@ int vm_map_ram(struct pcb_t *caller, int astart, int aend, int mapstart, int inc
    * do the swaping all to swapper to get the all in ram */
   vmap_page_range(caller, mapstart, incpgnum, frm_lst, ret_rg);
 
+  /* Keep frames free for the next allocations, off this CPU */
+  swap_wb_balance(caller);
+
   return 0;
 }
 
@@ -232,18 +309,61 @@ int vm_map_ram(struct pcb_t *caller, int astart, int aend, int mapstart, int inc
  **/
 int __swap_cp_page(struct memphy_struct *mpsrc, int srcfpn,
                    struct memphy_struct *mpdst, int dstfpn) {
-  int cellidx;
-  int addrsrc, addrdst;
-  for (cellidx = 0; cellidx < PAGING_PAGESZ; cellidx++) {
-    addrsrc = srcfpn * PAGING_PAGESZ + cellidx;
-    addrdst = dstfpn * PAGING_PAGESZ + cellidx;
-
-    BYTE data;
-    MEMPHY_read(mpsrc, addrsrc, &data);
-    MEMPHY_write(mpdst, addrdst, data);
-  }
+  return MEMPHY_copy_frames(mpsrc, srcfpn, mpdst, dstfpn, 1);
+}
 
-  return 0;
+/*
+ * __swap_out - move the content of a RAM frame out of memory,
+ * compressed into the zswap pool when it fits, else copied to a swap
+ * device picked by the swap manager
+ * @caller : owner of the frame, mm_lock held
+ * @fpn    : RAM frame
+ * @pte    : PTE of the page, set to where the content went
+ */
+int __swap_out(struct pcb_t *caller, int fpn, uint32_t *pte) {
+  int swptyp, swpoff;
+
+  if (zswap_store(caller->mram, fpn, &swpoff) == 0)
+    return pte_set_swap(pte, ZSWAP_SWPTYP, swpoff);
+
+  if (swap_page_out(caller, fpn, &swptyp, &swpoff) < 0)
+    return -1;
+  return pte_set_swap(pte, swptyp, swpoff);
+}
+
+/*
+ * __swap_in - bring a swapped page back into a RAM frame and release
+ * the place it was swapped to
+ * @caller : owner of the page, mm_lock held
+ * @pte    : PTE of the swapped page
+ * @fpn    : destination RAM frame
+ */
+int __swap_in(struct pcb_t *caller, uint32_t pte, int fpn) {
+  /* Never swapped out (its region was freed): nothing to bring in, and
+   * swap offset 0 may well belong to another page */
+  if (!PAGING_PAGE_SWAPPED(pte))
+    return -1;
+  if (zswap_load(caller->mram, pte, fpn) == 0)
+    return 0;
+
+  return swap_page_in(caller, PAGING_SWPTYP(pte), PAGING_SWP(pte), fpn);
+}
+
+/*
+ * __swap_free - release the place a swapped page went to, when the
+ * page is dropped without coming back
+ * @caller : owner of the page, mm_lock held
+ * @pte    : PTE of the swapped page
+ */
+int __swap_free(struct pcb_t *caller, uint32_t pte) {
+  /* A page still being written back: the worker finds it dropped and
+   * frees the slot itself */
+  if (!PAGING_PAGE_SWAPPED(pte) || (pte & PAGING_PTE_WRITEBACK_MASK))
+    return -1;
+  if (PAGING_SWPTYP(pte) == ZSWAP_SWPTYP)
+    return zswap_free(PAGING_SWP(pte));
+
+  return swap_page_free(caller, PAGING_SWPTYP(pte), PAGING_SWP(pte));
 }
 
 /*
@@ -253,14 +373,28 @@ int __swap_cp_page(struct memphy_struct *mpsrc, int srcfpn,
  */
 int init_mm(struct mm_struct *mm, struct pcb_t *caller) {
   struct vm_area_struct *vma = malloc(sizeof(struct vm_area_struct));
+  int i;
 
-  mm->pgd = malloc(PAGING_MAX_PGN * sizeof(uint32_t));
+  pthread_mutex_init(&mm->mm_lock, NULL);
+  pthread_cond_init(&mm->mm_wb_cond, NULL);
+
+  /* Leaf tables come with the first page mapped in their range */
+  mm->id = __atomic_add_fetch(&mm_nid, 1, __ATOMIC_RELAXED);
+  mm->pgd = mm_pgtbl_inverted ? NULL : calloc(PAGING_PGD_SZ, sizeof(uint32_t *));
+  for (i = 0; i < MM_XLAT_SZ; i++)
+    mm->xlat[i].pgn = -1;
+
+  mm->pg_ring = NULL;
+  mm->pg_free = NULL;
+  mm->ksm_hints = NULL;
+  memset(mm->symrgtbl, 0, sizeof(mm->symrgtbl));
 
   /* By default the owner comes with at least one vma */
   vma->vm_id = 1;
   vma->vm_start = 0;
   vma->vm_end = vma->vm_start;
   vma->sbrk = vma->vm_start;
+  vma->vm_freerg_list = NULL;
   struct vm_rg_struct *first_rg = init_vm_rg(vma->vm_start, vma->vm_end);
   enlist_vm_rg_node(&vma->vm_freerg_list, first_rg);
 
@@ -272,6 +406,132 @@ int init_mm(struct mm_struct *mm, struct pcb_t *caller) {
   return 0;
 }
 
+/*
+ * mm_save - write an address space to a snapshot: page table, areas
+ * and their free regions, symbol table and ring of pages. Merge hints
+ * are left out, see ksm_pause()
+ * @mm: address space, not in use
+ * @s:  snapshot
+ */
+int mm_save(struct mm_struct *mm, struct snap *s) {
+  struct vm_area_struct *vma;
+  struct vm_rg_struct *rg;
+  struct pgn_t *pg;
+  uint32_t pte[PAGING_PTE_LEAF_SZ];
+  int i, j, n;
+
+  /* Blocks of PTEs with a page mapped, whatever the page table */
+  pthread_mutex_lock(&mm->mm_lock);
+  for (i = 0; i < PAGING_PGD_SZ; i++) {
+    for (j = n = 0; j < PAGING_PTE_LEAF_SZ; j++)
+      n |= pte[j] = pte_get(mm, i << PAGING_PTE_LEAF_BITS | j);
+    if (n != 0) {
+      snap_put_u32(s, i);
+      snap_put(s, pte, sizeof(pte));
+    }
+  }
+  snap_put_u32(s, PAGING_PGD_SZ);
+  for (i = 0; i < PAGING_MAX_SYMTBL_SZ; i++) {
+    snap_put_u64(s, mm->symrgtbl[i].rg_start);
+    snap_put_u64(s, mm->symrgtbl[i].rg_end);
+  }
+
+  for (n = 0, vma = mm->mmap; vma != NULL; vma = vma->vm_next)
+    n++;
+  snap_put_u32(s, n);
+  for (vma = mm->mmap; vma != NULL; vma = vma->vm_next) {
+    snap_put_u64(s, vma->vm_id);
+    snap_put_u64(s, vma->vm_start);
+    snap_put_u64(s, vma->vm_end);
+    snap_put_u64(s, vma->sbrk);
+    for (n = 0, rg = vma->vm_freerg_list; rg != NULL; rg = rg->rg_next)
+      n++;
+    snap_put_u32(s, n);
+    for (rg = vma->vm_freerg_list; rg != NULL; rg = rg->rg_next) {
+      snap_put_u64(s, rg->rg_start);
+      snap_put_u64(s, rg->rg_end);
+    }
+  }
+
+  /* Oldest first, from the hand round */
+  n = 0;
+  if ((pg = mm->pg_ring) != NULL)
+    do {
+      n++;
+      pg = pg->pg_next;
+    } while (pg != mm->pg_ring);
+  snap_put_u32(s, n);
+  for (pg = mm->pg_ring; n > 0; n--) {
+    pg = pg->pg_next;
+    snap_put_u32(s, pg->pgn);
+  }
+  pthread_mutex_unlock(&mm->mm_lock);
+
+  return 0;
+}
+
+/*
+ * mm_restore - take an address space from a snapshot
+ * @mm: address space fresh from init_mm()
+ * @s:  snapshot
+ */
+int mm_restore(struct mm_struct *mm, struct snap *s) {
+  struct vm_area_struct *vma, **vmatail;
+  struct vm_rg_struct *rg, **rgtail;
+  uint32_t pte[PAGING_PTE_LEAF_SZ];
+  int i, j, n, nrg;
+
+  pthread_mutex_lock(&mm->mm_lock);
+  while ((i = snap_get_u32(s)) < PAGING_PGD_SZ) {
+    snap_get(s, pte, sizeof(pte));
+    for (j = 0; j < PAGING_PTE_LEAF_SZ; j++)
+      if (pte[j] != 0)
+        pte_set(mm, i << PAGING_PTE_LEAF_BITS | j, pte[j]);
+  }
+  for (i = 0; i < PAGING_MAX_SYMTBL_SZ; i++) {
+    mm->symrgtbl[i].rg_start = snap_get_u64(s);
+    mm->symrgtbl[i].rg_end = snap_get_u64(s);
+    mm->symrgtbl[i].rg_next = NULL;
+  }
+
+  /* The areas replace the one init_mm() made */
+  while ((vma = mm->mmap) != NULL) {
+    mm->mmap = vma->vm_next;
+    while ((rg = vma->vm_freerg_list) != NULL) {
+      vma->vm_freerg_list = rg->rg_next;
+      free(rg);
+    }
+    free(vma);
+  }
+  vmatail = &mm->mmap;
+  for (n = snap_get_u32(s); n > 0; n--) {
+    vma = malloc(sizeof(struct vm_area_struct));
+    vma->vm_id = snap_get_u64(s);
+    vma->vm_start = snap_get_u64(s);
+    vma->vm_end = snap_get_u64(s);
+    vma->sbrk = snap_get_u64(s);
+    vma->vm_mm = mm;
+    rgtail = &vma->vm_freerg_list;
+    for (nrg = snap_get_u32(s); nrg > 0; nrg--) {
+      rg = malloc(sizeof(struct vm_rg_struct));
+      rg->rg_start = snap_get_u64(s);
+      rg->rg_end = snap_get_u64(s);
+      *rgtail = rg;
+      rgtail = &rg->rg_next;
+    }
+    *rgtail = NULL;
+    *vmatail = vma;
+    vmatail = &vma->vm_next;
+  }
+  *vmatail = NULL;
+
+  for (n = snap_get_u32(s); n > 0; n--)
+    pgn_ring_add(mm, snap_get_u32(s));
+  pthread_mutex_unlock(&mm->mm_lock);
+
+  return mm->mmap != NULL ? 0 : -1;
+}
+
 struct vm_rg_struct *init_vm_rg(int rg_start, int rg_end) {
   struct vm_rg_struct *rgnode = malloc(sizeof(struct vm_rg_struct));
 
@@ -290,12 +550,57 @@ int enlist_vm_rg_node(struct vm_rg_struct **rglist,
   return 0;
 }
 
-int enlist_pgn_node(struct pgn_t **plist, int pgn) {
-  struct pgn_t *pnode = malloc(sizeof(struct pgn_t));
+#define PGN_RING_CHUNK 64 /* ring nodes allocated at once */
 
-  pnode->pgn = pgn;
-  pnode->pg_next = *plist;
-  *plist = pnode;
+/*
+ * pgn_ring_add - put a page in the ring as the newest one, just behind
+ * the hand, mm_lock held. Nodes are reused, a page in or out of RAM
+ * does not allocate
+ * @mm  : address space
+ * @pgn : page number
+ */
+int pgn_ring_add(struct mm_struct *mm, int pgn) {
+  struct pgn_t *pg = mm->pg_free;
+  int i;
+
+  if (pg == NULL) {
+    pg = malloc(PGN_RING_CHUNK * sizeof(struct pgn_t));
+    for (i = 0; i < PGN_RING_CHUNK - 1; i++)
+      pg[i].pg_next = &pg[i + 1];
+    pg[i].pg_next = NULL;
+  }
+  mm->pg_free = pg->pg_next;
+
+  pg->pgn = pgn;
+  if (mm->pg_ring == NULL) {
+    pg->pg_next = pg;
+  } else {
+    pg->pg_next = mm->pg_ring->pg_next;
+    mm->pg_ring->pg_next = pg;
+  }
+  mm->pg_ring = pg;
+
+  return 0;
+}
+
+/*
+ * pgn_ring_del - take the page under the hand out of the ring, mm_lock
+ * held. The hand moves to the next one
+ * @mm : address space
+ */
+int pgn_ring_del(struct mm_struct *mm) {
+  struct pgn_t *pg;
+
+  if (mm->pg_ring == NULL)
+    return -1;
+
+  pg = mm->pg_ring->pg_next;
+  if (pg == mm->pg_ring)
+    mm->pg_ring = NULL;
+  else
+    mm->pg_ring->pg_next = pg->pg_next;
+  pg->pg_next = mm->pg_free;
+  mm->pg_free = pg;
 
   return 0;
 }
@@ -351,17 +656,19 @@ int print_list_vma(struct vm_area_struct *ivma) {
   return 0;
 }
 
-int print_list_pgn(struct pgn_t *ip) {
+int print_list_pgn(struct pgn_t *ring) {
+  struct pgn_t *ip = ring;
+
   printf("print_list_pgn: ");
   if (ip == NULL) {
     printf("NULL list\n");
     return -1;
   }
   printf("\n");
-  while (ip != NULL) {
-    printf("va[%d]-\n", ip->pgn);
+  do {
     ip = ip->pg_next;
-  }
+    printf("va[%d]-\n", ip->pgn);
+  } while (ip != ring);
   printf("n");
   return 0;
 }
@@ -385,9 +692,11 @@ int print_pgtbl(struct pcb_t *caller, uint32_t start, uint32_t end) {
   }
   
   printf("\n");
+  pthread_mutex_lock(&caller->mm->mm_lock);
   for (pgit = pgn_start; pgit < pgn_end; pgit++) {
-    printf("%08ld: %08x\n", pgit * sizeof(uint32_t), caller->mm->pgd[pgit]);
+    printf("%08ld: %08x\n", pgit * sizeof(uint32_t), pte_get(caller->mm, pgit));
   }
+  pthread_mutex_unlock(&caller->mm->mm_lock);
   return 0;
 }
 
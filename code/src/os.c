@@ -4,11 +4,14 @@
 #include "sched.h"
 #include "loader.h"
 #include "mm.h"
+#include "trace.h"
+#include "snapshot.h"
 
 #include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 static int time_slot;
 static int num_cpus;
@@ -16,11 +19,15 @@ static int done = 0;
 
 #ifdef CPU_TLB
 static int tlbsz;
+static struct memphy_struct tlb_l2;
+static struct memphy_struct * tlb_l1;
 #endif
 
 #ifdef MM_PAGING
 static int memramsz;
 static int memswpsz[PAGING_MAX_MMSWP];
+static struct memphy_struct mram;
+static struct memphy_struct mswp[PAGING_MAX_MMSWP];
 
 struct mmpaging_ld_args {
 	/* A dispatched argument struct to compact many-fields passing to loader */
@@ -40,33 +47,75 @@ static struct ld_args{
 #endif
 } ld_processes;
 int num_processes;
+static int ld_next; /* first process not handed to the scheduler yet */
 
 struct cpu_args {
 	struct timer_id_t * timer_id;
 	int id;
+#ifdef CPU_TLB
+	struct memphy_struct * tlb; /* private L1 TLB of this CPU */
+#endif
+	/* What the CPU holds between two slots */
+	struct pcb_t * proc;
+	int time_left;
+	int stall; /* slots still waiting for swap I/O */
+	int stopped;
 };
+static struct cpu_args * cpus;
+
+/* Checkpoint taken at the start of a slot, see os_checkpoint() */
+static const char * snap_path;
+
+/* End the current slot of a CPU, publishing what it holds for a
+ * checkpoint taken before the next one */
+static void cpu_next_slot(struct cpu_args * cpu, struct pcb_t * proc,
+		int time_left, int stall) {
+	cpu->proc = proc;
+	cpu->time_left = time_left;
+	cpu->stall = stall;
+	next_slot(cpu->timer_id);
+}
 
 
 static void * cpu_routine(void * args) {
+	struct cpu_args * cpu = (struct cpu_args*)args;
 	struct timer_id_t * timer_id = ((struct cpu_args*)args)->timer_id;
 	int id = ((struct cpu_args*)args)->id;
-	/* Check for new process in ready queue */
-	int time_left = 0;
-	struct pcb_t * proc = NULL;
-	while (1) {
+#ifdef CPU_TLB
+	struct memphy_struct * tlb = ((struct cpu_args*)args)->tlb;
+#endif
+	trace_set_cpu(id);
+	/* Check for new process in ready queue, unless resuming */
+	int time_left = cpu->time_left;
+	struct pcb_t * proc = cpu->proc;
+	int stall = cpu->stall;
+	while (!cpu->stopped) {
+#ifdef CPU_TLB
+		/* Invalidations other CPUs queued during the last slot */
+		tlb_shootdown_apply(tlb);
+#endif
+#ifdef MM_PAGING
+		/* Writeback queued on the swap devices drains meanwhile */
+		MEMPHY_set_time_ns(current_time() * MEMPHY_SLOT_NS);
+#endif
+		/* Swap I/O on sequential devices keeps this CPU waiting */
+		if (stall > 0) {
+			cpu_next_slot(cpu, proc, time_left, --stall);
+			continue;
+		}
 		/* Check the status of current process */
 		if (proc == NULL) {
 			/* No process is running, the we load new process from
 		 	* ready queue */
 			proc = get_proc();
-			if (proc == NULL) {
-                           next_slot(timer_id);
-                           continue; /* First load failed. skip dummy load */
-                        }
+			/* None yet: stop below once the loader is done */
 		}else if (proc->pc == proc->code->size) {
 			/* The porcess has finish it job */
 			printf("\tCPU %d: Processed %2d has finished\n",
 				id ,proc->pid);
+#ifdef MM_PAGING
+			free_pcb_memph(proc);
+#endif
 			free(proc);
 			proc = get_proc();
 			time_left = 0;
@@ -86,7 +135,7 @@ static void * cpu_routine(void * args) {
 		}else if (proc == NULL) {
 			/* There may be new processes to run in
 			 * next time slots, just skip current slot */
-			next_slot(timer_id);
+			cpu_next_slot(cpu, proc, time_left, stall);
 			continue;
 		}else if (time_left == 0) {
 			printf("\tCPU %d: Dispatched process %2d\n",
@@ -95,10 +144,30 @@ static void * cpu_routine(void * args) {
 		}
 		
 		/* Run current process */
+#ifdef CPU_TLB
+		proc->tlb = tlb; /* translate through this CPU's TLB */
+#endif
+#ifdef MM_KSM
+		/* Merges the scanner found, while the process is off CPU */
+		ksm_merge(proc);
+#endif
 		run(proc);
+#ifdef MM_PAGING
+		/* Waited out in the next slots */
+		stall = MEMPHY_stall_slots();
+		if (stall > 0)
+			printf("\tCPU %d: Process %2d waits %d slot(s) for swap I/O\n",
+				id, proc->pid, stall);
+#endif
+#if CPUTLB_STAT_SLOTS > 0
+		if (id == 0 && current_time() % CPUTLB_STAT_SLOTS == 0)
+			tlb_stat_dump();
+#endif
 		time_left--;
-		next_slot(timer_id);
+		cpu_next_slot(cpu, proc, time_left, stall);
 	}
+	cpu->proc = NULL;
+	cpu->stopped = 1;
 	detach_event(timer_id);
 	pthread_exit(NULL);
 }
@@ -115,9 +184,9 @@ static void * ld_routine(void * args) {
 #else
 	struct timer_id_t * timer_id = (struct timer_id_t*)args;
 #endif
-	int i = 0;
+	int i;
 	printf("ld_routine\n");
-	while (i < num_processes) {
+	while ((i = ld_next) < num_processes) {
 		struct pcb_t * proc = load(ld_processes.path[i]);
 #ifdef MLQ_SCHED
 		proc->prio = ld_processes.prio[i];
@@ -131,15 +200,19 @@ static void * ld_routine(void * args) {
 		proc->mram = mram;
 		proc->mswp = mswp;
 		proc->active_mswp = active_mswp;
+#ifdef MM_KSM
+		ksm_register(proc->mm);
+#endif
 		#ifdef CPU_TLB
 			proc->tlb=tlb;
+			proc->tlb_asid_gen = 0; /* ASID assigned on first access */
 		#endif
 #endif
 		printf("\tLoaded a process at %s, PID: %d PRIO: %ld\n",
 			ld_processes.path[i], proc->pid, ld_processes.prio[i]);
 		add_proc(proc);
 		free(ld_processes.path[i]);
-		i++;
+		ld_next++;
 		next_slot(timer_id);
 	}
 	free(ld_processes.path);
@@ -219,17 +292,249 @@ static void read_config(const char * path) {
 	}
 }
 
+/*
+ * Checkpoint and restore. A snapshot is taken between two slots, when
+ * the CPUs and the loader wait for the timer: no instruction is half
+ * done. It holds the configuration it was taken with, the loader and
+ * scheduler state, the processes (queued, or held by a CPU) with their
+ * address spaces, the TLBs and the memory devices. Statistics are not
+ * saved, they restart with the restored run.
+ */
+static int os_config(uint32_t * cfg) {
+	int n = 0;
+
+	cfg[n++] = time_slot;
+	cfg[n++] = num_cpus;
+	cfg[n++] = num_processes;
+	cfg[n++] = MAX_PRIO;
+	cfg[n++] = sizeof(struct inst_t);
+#ifdef CPU_TLB
+	cfg[n++] = tlbsz;
+	cfg[n++] = CPUTLB_L1SZ;
+#endif
+#ifdef MM_PAGING
+	int sit;
+	cfg[n++] = PAGING_PAGESZ;
+	cfg[n++] = PAGING_MAX_PGN;
+	cfg[n++] = memramsz;
+	for (sit = 0; sit < PAGING_MAX_MMSWP; sit++)
+		cfg[n++] = memswpsz[sit];
+#endif
+	return n;
+}
+
+static int proc_save(struct snap * s, struct pcb_t * proc) {
+	snap_put_u32(s, proc->pid);
+	snap_put_u32(s, proc->priority);
+	snap_put_u32(s, proc->prio);
+	snap_put_u32(s, proc->pc);
+	snap_put_u32(s, proc->bp);
+	snap_put(s, proc->regs, sizeof(proc->regs));
+	snap_put_u32(s, proc->code->size);
+	snap_put(s, proc->code->text, proc->code->size * sizeof(struct inst_t));
+#ifdef CPU_TLB
+	snap_put_u32(s, proc->tlb_asid);
+	snap_put_u32(s, proc->tlb_asid_gen);
+#endif
+#ifdef MM_PAGING
+	mm_save(proc->mm, s);
+#endif
+	return 0;
+}
+
+static struct pcb_t * proc_restore(struct snap * s, void * arg) {
+	struct pcb_t * proc = calloc(1, sizeof(struct pcb_t));
+
+	(void)arg;
+	proc->pid = snap_get_u32(s);
+	proc->priority = snap_get_u32(s);
+	proc->prio = snap_get_u32(s);
+	proc->pc = snap_get_u32(s);
+	proc->bp = snap_get_u32(s);
+	snap_get(s, proc->regs, sizeof(proc->regs));
+	proc->code = (struct code_seg_t*)malloc(sizeof(struct code_seg_t));
+	proc->code->size = snap_get_u32(s);
+	proc->code->text = (struct inst_t*)malloc(
+		sizeof(struct inst_t) * proc->code->size);
+	snap_get(s, proc->code->text, proc->code->size * sizeof(struct inst_t));
+	proc->page_table =
+		(struct page_table_t*)malloc(sizeof(struct page_table_t));
+	if (proc->prio >= MAX_PRIO || proc->pc > proc->code->size) {
+		free(proc->page_table);
+		free(proc->code->text);
+		free(proc->code);
+		free(proc);
+		return NULL;
+	}
+#ifdef CPU_TLB
+	proc->tlb = &tlb_l2;
+	proc->tlb_asid = snap_get_u32(s);
+	proc->tlb_asid_gen = snap_get_u32(s);
+#endif
+#ifdef MM_PAGING
+	proc->mm = malloc(sizeof(struct mm_struct));
+	init_mm(proc->mm, proc);
+	mm_restore(proc->mm, s);
+	proc->mram = &mram;
+	proc->mswp = (struct memphy_struct**) &mswp;
+	proc->active_mswp = &mswp[0];
+#ifdef MM_KSM
+	ksm_register(proc->mm);
+#endif
+#endif
+	return proc;
+}
+
+/* Timer hook, see timer_at() */
+static void os_checkpoint(void) {
+	uint32_t cfg[32];
+	struct snap * s;
+	int i, n;
+
+#ifdef MM_PAGING
+	/* Page tables are also changed off the CPUs: let the writebacks
+	 * complete and the scanner rest */
+	swap_wb_drain();
+#endif
+#ifdef MM_KSM
+	ksm_pause();
+#endif
+	s = snap_create(snap_path);
+	if (s == NULL)
+		goto out;
+
+	n = os_config(cfg);
+	snap_put_u32(s, n);
+	snap_put(s, cfg, n * sizeof(uint32_t));
+	snap_put_u32(s, ld_next);
+	snap_put_u32(s, done);
+	sched_save(s, proc_save);
+	for (i = 0; i < num_cpus; i++) {
+		snap_put_u32(s, cpus[i].time_left);
+		snap_put_u32(s, cpus[i].stall);
+		snap_put_u32(s, cpus[i].stopped);
+		snap_put_u32(s, cpus[i].proc != NULL);
+		if (cpus[i].proc != NULL)
+			proc_save(s, cpus[i].proc);
+	}
+#ifdef CPU_TLB
+	tlb_asid_save(s);
+	TLBMEMPHY_save(&tlb_l2, s);
+	for (i = 0; i < num_cpus; i++) {
+		/* Due before the CPU runs anything anyway */
+		tlb_shootdown_apply(&tlb_l1[i]);
+		TLBMEMPHY_save(&tlb_l1[i], s);
+	}
+#endif
+#ifdef MM_PAGING
+	MEMPHY_save(&mram, s);
+	for (i = 0; i < PAGING_MAX_MMSWP; i++)
+		MEMPHY_save(&mswp[i], s);
+	swap_save(s);
+	zswap_save(s);
+#endif
+	if (snap_commit(s, current_time()) == 0)
+		printf("Checkpoint at slot %lu written to %s\n",
+			current_time(), snap_path);
+out:
+#ifdef MM_KSM
+	ksm_resume();
+#endif
+	return;
+}
+
+/* Resume from a snapshot, with the machine initialized but not started */
+static int os_restore(const char * path) {
+	uint32_t cfg[32], saved[32];
+	uint64_t time;
+	struct snap * s;
+	int i, n, err = 0;
+
+	if ((s = snap_open(path, &time)) == NULL)
+		return -1;
+	n = os_config(cfg);
+	if (snap_get_u32(s) != n || snap_get(s, saved, n * sizeof(uint32_t)) < 0 ||
+	    memcmp(cfg, saved, n * sizeof(uint32_t)) != 0) {
+		printf("Snapshot %s was taken with another configuration\n", path);
+		snap_close(s);
+		return -1;
+	}
+
+#ifdef MM_KSM
+	ksm_pause();
+#endif
+	ld_next = snap_get_u32(s);
+	done = snap_get_u32(s);
+	if (ld_next > num_processes)
+		err = -1;
+	if (!err)
+		err = sched_restore(s, proc_restore, NULL);
+	for (i = 0; i < num_cpus && !err; i++) {
+		cpus[i].time_left = snap_get_u32(s);
+		cpus[i].stall = snap_get_u32(s);
+		cpus[i].stopped = snap_get_u32(s);
+		if (snap_get_u32(s) && (cpus[i].proc = proc_restore(s, NULL)) == NULL)
+			err = -1;
+	}
+#ifdef CPU_TLB
+	if (!err)
+		err = tlb_asid_restore(s) < 0 || TLBMEMPHY_restore(&tlb_l2, s) < 0;
+	for (i = 0; i < num_cpus && !err; i++)
+		err = TLBMEMPHY_restore(&tlb_l1[i], s);
+#endif
+#ifdef MM_PAGING
+	if (!err)
+		err = MEMPHY_restore(&mram, s);
+	for (i = 0; i < PAGING_MAX_MMSWP && !err; i++)
+		err = MEMPHY_restore(&mswp[i], s);
+	if (!err)
+		err = swap_restore(s) < 0 || zswap_restore(s) < 0;
+#endif
+	if (snap_close(s) < 0)
+		err = -1;
+	if (err) {
+		printf("Cannot restore snapshot %s\n", path);
+		return -1;
+	}
+#ifdef MM_KSM
+	ksm_resume();
+#endif
+
+	/* The loader goes on with the first process it had not queued */
+	for (i = 0; i < ld_next; i++)
+		free(ld_processes.path[i]);
+	load_set_pid(ld_next + 1);
+	timer_set_time(time);
+	printf("Restored snapshot %s at slot %lu\n", path, time);
+	return 0;
+}
+
 int main(int argc, char * argv[]) {
 	/* Read config */
-	if (argc != 2) {
-		printf("Usage: os [path to configure file]\n");
+	const char * restore_path = NULL;
+	unsigned long snap_slot = 0;
+	int opt, usage = 0;
+	while ((opt = getopt(argc, argv, "c:r:")) != -1) {
+		if (opt == 'c' && sscanf(optarg, "%lu:", &snap_slot) == 1 &&
+		    snap_slot > 0 && strchr(optarg, ':') != NULL)
+			snap_path = strchr(optarg, ':') + 1;
+		else if (opt == 'r')
+			restore_path = optarg;
+		else
+			usage = 1;
+	}
+	if (usage || (argc - optind != 1 && argc - optind != 2)) {
+		printf("Usage: os [-c slot:snapshot file] [-r snapshot file] "
+			"[path to configure file] [trace file]\n");
 		return 1;
 	}
 	char path[100];
 	path[0] = '\0';
 	strcat(path, "input/");
-	strcat(path, argv[1]);
+	strcat(path, argv[optind]);
 	read_config(path);
+	if (argc - optind == 2 && trace_open(argv[optind + 1], current_time) < 0)
+		return 1;
 
 	pthread_t * cpu = (pthread_t*)malloc(num_cpus * sizeof(pthread_t));
 	struct cpu_args * args =
@@ -241,30 +546,59 @@ int main(int argc, char * argv[]) {
 	for (i = 0; i < num_cpus; i++) {
 		args[i].timer_id = attach_event();
 		args[i].id = i;
+		args[i].proc = NULL;
+		args[i].time_left = 0;
+		args[i].stall = 0;
+		args[i].stopped = 0;
 	}
+	cpus = args;
 	struct timer_id_t * ld_event = attach_event();
-	start_timer();
 #ifdef CPU_TLB
-	struct memphy_struct tlb;
+	/* A small private L1 TLB per CPU, backed by a shared L2 of tlbsz */
+	struct memphy_struct * tlb = &tlb_l2;
+	tlb_l1 = (struct memphy_struct*)malloc(sizeof(struct memphy_struct) * num_cpus);
 
-	init_tlbmemphy(&tlb, tlbsz);
+	init_tlbmemphy(tlb, tlbsz);
+	TLBMEMPHY_share(tlb, CPUTLB_L2_NLOCKS);
+	tlb_stat_init(tlbsz); /* 3C misses of the whole TLB */
+	for (i = 0; i < num_cpus; i++) {
+		init_tlbmemphy(&tlb_l1[i], CPUTLB_L1SZ);
+		tlb_l1[i].tlb_next = tlb;
+		tlb_shootdown_register(&tlb_l1[i]);
+		tlb_stat_register(&tlb_l1[i]);
+		args[i].tlb = &tlb_l1[i];
+	}
 #endif
 
 #ifdef MM_PAGING
 	/* Init all MEMPHY include 1 MEMRAM and n of MEMSWP */
 	int rdmflag = 1; /* By default memphy is RANDOM ACCESS MEMORY */
 
-	struct memphy_struct mram;
-	struct memphy_struct mswp[PAGING_MAX_MMSWP];
-
-
 	/* Create MEM RAM */
 	init_memphy(&mram, memramsz, rdmflag);
+#ifdef MM_ZSWAP
+	/* Evicted pages are compressed into a slice of it first */
+	zswap_init(&mram, mram.nfp >> ZSWAP_POOL_SHIFT);
+#endif
 
 	/* Create all MEM SWAP */ 
+	static const int swp_prio[] = MM_SWP_PRIO;
+	static const int swp_seek[] = MM_SWP_SEEK_NS_PER_KB;
+	static const int swp_xfer[] = MM_SWP_XFER_NS_PER_BYTE;
 	int sit;
-	for(sit = 0; sit < PAGING_MAX_MMSWP; sit++)
-	       init_memphy(&mswp[sit], memswpsz[sit], rdmflag);
+	for(sit = 0; sit < PAGING_MAX_MMSWP; sit++) {
+	       init_memphy(&mswp[sit], memswpsz[sit], MM_SWP_RDMFLG);
+	       mswp[sit].seek_ns_per_kb = swp_seek[sit];
+	       mswp[sit].xfer_ns_per_byte = swp_xfer[sit];
+	}
+	/* Swapped pages are spread over all configured devices */
+	swap_init(mswp, swp_prio, PAGING_MAX_MMSWP);
+	/* Evictions are written back ahead of need by worker threads */
+	swap_wb_start(MM_SWP_WB_THREADS, mram.nfp >> MM_SWP_WB_LOW_SHIFT);
+#ifdef MM_KSM
+	/* Identical pages of all processes share one frame */
+	ksm_start(&mram, KSM_SCAN_PAGES, KSM_SCAN_US);
+#endif
 
 	/* In Paging mode, it needs passing the system mem to each PCB through loader*/
 	struct mmpaging_ld_args *mm_ld_args = malloc(sizeof(struct mmpaging_ld_args));
@@ -280,13 +614,19 @@ int main(int argc, char * argv[]) {
 	/* In MM_PAGING employ CPU_TLB mode, it needs passing
 	 * the system tlb to each PCB through loader
 	*/
-	mm_ld_args->tlb = (struct memphy_struct *) &tlb;
+	mm_ld_args->tlb = tlb;
 #endif
 #endif
 
 	/* Init scheduler */
 	init_scheduler();
 
+	if (restore_path != NULL && os_restore(restore_path) < 0)
+		return 1;
+	if (snap_path != NULL)
+		timer_at(snap_slot, os_checkpoint);
+	start_timer();
+
 	/* Run CPU and loader */
 #ifdef MM_PAGING
 	pthread_create(&ld, NULL, ld_routine, (void*)mm_ld_args);
@@ -306,6 +646,40 @@ int main(int argc, char * argv[]) {
 
 	/* Stop timer */
 	stop_timer();
+#ifdef MM_PAGING
+	swap_wb_stop();
+#endif
+#ifdef MM_KSM
+	ksm_stop();
+#endif
+	trace_close();
+
+#ifdef CPU_TLB
+	for (i = 0; i < num_cpus; i++) {
+		char name[32];
+		sprintf(name, "L1 CPU %d", i);
+		TLBMEMPHY_stat(&tlb_l1[i], name);
+	}
+	TLBMEMPHY_stat(tlb, "L2");
+	tlb_shootdown_stat();
+	tlb_stat_dump();
+	if (tlb_sweep_enabled)
+		tlb_sweep_dump(CPUTLB_SWEEP_ASSOC);
+#endif
+#ifdef MM_PAGING
+	MEMPHY_frag_stat(&mram, "RAM");
+	for (sit = 0; sit < PAGING_MAX_MMSWP; sit++) {
+		char name[16];
+		if (memswpsz[sit] == 0)
+			continue;
+		sprintf(name, "SWP%d", sit);
+		MEMPHY_frag_stat(&mswp[sit], name);
+	}
+	swap_stat();
+	zswap_stat();
+	ksm_stat();
+	ipt_stat();
+#endif
 
 	return 0;
 
@@ -0,0 +1,205 @@
+/*
+ * Offline trace replay
+ * Feeds the accesses of a trace written by `os <config> <trace file>`
+ * through the TLB and page replacement code, without scheduler, timer
+ * or CPU threads.
+ * Run: ./replay <trace file> [tlb entries] [ram bytes]
+ */
+
+#include "mm.h"
+#include "trace.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static struct memphy_struct replay_tlb;
+static struct memphy_struct replay_mram;
+static struct memphy_struct replay_mswp[PAGING_MAX_MMSWP];
+
+static struct pcb_t **replay_procs; /* indexed by pid */
+static uint32_t replay_nprocs;
+
+static double replay_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * replay_proc - PCB standing for a traced process, created on first use
+ */
+static struct pcb_t *replay_proc(uint32_t pid)
+{
+  struct pcb_t *proc;
+
+  if (pid >= replay_nprocs) {
+    uint32_t n = (pid + 1) * 2;
+    replay_procs = realloc(replay_procs, n * sizeof(struct pcb_t *));
+    memset(replay_procs + replay_nprocs, 0,
+           (n - replay_nprocs) * sizeof(struct pcb_t *));
+    replay_nprocs = n;
+  }
+  if (replay_procs[pid] != NULL)
+    return replay_procs[pid];
+
+  proc = calloc(1, sizeof(struct pcb_t));
+  proc->pid = pid;
+  proc->mm = malloc(sizeof(struct mm_struct));
+  init_mm(proc->mm, proc);
+  proc->mram = &replay_mram;
+  proc->mswp = (struct memphy_struct **)&replay_mswp;
+  proc->active_mswp = &replay_mswp[0];
+  proc->tlb = &replay_tlb;
+  replay_procs[pid] = proc;
+  return proc;
+}
+
+/*
+ * replay_map - back a page with a frame on its ALLOC record, or on
+ * its first access if the trace missed the ALLOC
+ */
+static int replay_map(struct pcb_t *proc, int pgn)
+{
+  struct framephy_struct *frm = NULL;
+  struct vm_rg_struct rg;
+  int ret = -1;
+
+  pthread_mutex_lock(&proc->mm->mm_lock);
+  if (alloc_pages_range(proc, 1, &frm) == 0) {
+    vmap_page_range(proc, pgn * PAGING_PAGESZ, 1, frm, &rg);
+    ret = 0;
+  }
+  pthread_mutex_unlock(&proc->mm->mm_lock);
+  return ret;
+}
+
+static int replay_is_access(int op)
+{
+  return op == TRACE_PGREAD || op == TRACE_PGWRITE ||
+         op == TRACE_TLBREAD || op == TRACE_TLBWRITE;
+}
+
+/* Order by time, then by position in the file */
+static int replay_cmp(const void *a, const void *b)
+{
+  const struct trace_rec *ra = *(const struct trace_rec **)a;
+  const struct trace_rec *rb = *(const struct trace_rec **)b;
+
+  if (ra->time != rb->time)
+    return ra->time < rb->time ? -1 : 1;
+  return ra < rb ? -1 : (ra > rb);
+}
+
+int main(int argc, char *argv[])
+{
+  char magic[sizeof(TRACE_MAGIC)] = { 0 };
+  struct trace_rec *rec, **order;
+  long nrec = 0, cap = 4096, i;
+  long nref = 0, ntlbhit = 0, nfault = 0;
+  long rec_tlbref = 0, rec_tlbhit = 0, rec_swapin = 0;
+  int tlbsz = 64, ramsz = 0x100000, sit;
+  double t;
+  FILE *f;
+
+  if (argc < 2) {
+    printf("Usage: replay <trace file> [tlb entries] [ram bytes]\n");
+    return 1;
+  }
+  if (argc > 2)
+    tlbsz = strtol(argv[2], NULL, 0);
+  if (argc > 3)
+    ramsz = strtol(argv[3], NULL, 0);
+
+  f = fopen(argv[1], "rb");
+  if (f == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+  if (fread(magic, 1, strlen(TRACE_MAGIC), f) != strlen(TRACE_MAGIC) ||
+      strcmp(magic, TRACE_MAGIC) != 0) {
+    printf("%s: not a trace file\n", argv[1]);
+    fclose(f);
+    return 1;
+  }
+  rec = malloc(cap * sizeof(struct trace_rec));
+  while (fread(&rec[nrec], sizeof(struct trace_rec), 1, f) == 1) {
+    if (++nrec == cap) {
+      cap *= 2;
+      rec = realloc(rec, cap * sizeof(struct trace_rec));
+    }
+  }
+  fclose(f);
+
+  /* CPUs flushed their buffers independently */
+  order = malloc(nrec * sizeof(struct trace_rec *));
+  for (i = 0; i < nrec; i++)
+    order[i] = &rec[i];
+  qsort(order, nrec, sizeof(struct trace_rec *), replay_cmp);
+
+  init_tlbmemphy(&replay_tlb, tlbsz);
+  init_memphy(&replay_mram, ramsz, 1);
+  for (sit = 0; sit < PAGING_MAX_MMSWP; sit++)
+    init_memphy(&replay_mswp[sit], 0x1000000, 1);
+  tlb_stat_enabled = 1; /* one thread, the lock costs nothing */
+  tlb_stat_init(tlbsz);
+
+  t = replay_now();
+  for (i = 0; i < nrec; i++) {
+    struct trace_rec *r = order[i];
+    struct pcb_t *proc;
+    int pgn, fpn, hit;
+
+    if (r->op == TRACE_TLBREAD || r->op == TRACE_TLBWRITE) {
+      rec_tlbref++;
+      rec_tlbhit += r->hit;
+    } else if (r->op == TRACE_SWAPIN) {
+      rec_swapin++;
+    }
+    if (r->op != TRACE_ALLOC && !replay_is_access(r->op))
+      continue;
+
+    proc = replay_proc(r->pid);
+    pgn = PAGING_PGN(r->vaddr);
+    if (pte_get(proc->mm, pgn) == 0 && replay_map(proc, pgn) < 0) {
+      printf("replay: pid %u: no frame for page %d, RAM too small\n",
+             r->pid, pgn);
+      return 1;
+    }
+
+    if (r->op == TRACE_ALLOC) {
+      /* ALLOC caches the new pages like tlballoc() */
+      tlb_refill(proc, pgn, PAGING_PTE_FPN(pte_get(proc->mm, pgn)));
+      continue;
+    }
+
+    hit = tlb_cache_read(proc->tlb, tlb_asid_of(proc), pgn, &fpn) >= 0;
+    tlb_stat_ref(proc, pgn, hit);
+    if (!hit) {
+      if (PAGING_PAGE_SWAPPED(pte_get(proc->mm, pgn)))
+        nfault++;
+      pg_getpage(proc->mm, pgn, &fpn, proc);
+    } else {
+      pg_mark_accessed(proc->mm, pgn);
+    }
+    ntlbhit += hit;
+    nref++;
+  }
+  t = replay_now() - t;
+
+  printf("replay: %ld records, %ld accesses in %.3fs (%.1f Mrefs/s)\n",
+         nrec, nref, t, t > 0 ? nref / t / 1e6 : 0.0);
+  printf("  recorded: TLB hit rate %5.1f%%, %ld swap ins\n",
+         rec_tlbref ? 100.0 * rec_tlbhit / rec_tlbref : 0.0, rec_swapin);
+  printf("  replayed: TLB hit rate %5.1f%% (%d entries), "
+         "%ld page faults (%d bytes RAM)\n",
+         nref ? 100.0 * ntlbhit / nref : 0.0, tlbsz, nfault, ramsz);
+  tlb_stat_dump();
+
+  free(order);
+  free(rec);
+  return 0;
+}
@@ -1,6 +1,7 @@
 
 #include "queue.h"
 #include "sched.h"
+#include "snapshot.h"
 #include <pthread.h>
 
 #include <stdlib.h>
@@ -11,6 +12,9 @@ static pthread_mutex_t queue_lock;
 
 #ifdef MLQ_SCHED
 static struct queue_t mlq_ready_queue[MAX_PRIO];
+/* MLQ state: queue served and slots it has left */
+static int curr_prio = 0;
+static int curr_slot = MAX_PRIO;
 #endif
 
 int queue_empty(void)
@@ -50,8 +54,6 @@ struct pcb_t *get_mlq_proc(void)
 	/*TODO: get a process from PRIORITY [ready_queue].
 	 * Remember to use lock to protect the queue.
 	 */
-	static int curr_prio = 0;
-	static int curr_slot = MAX_PRIO;
 	pthread_mutex_lock(&queue_lock);
 	int turn = MAX_PRIO;
 	while (turn--)
@@ -134,3 +136,74 @@ void add_proc(struct pcb_t *proc)
 	pthread_mutex_unlock(&queue_lock);
 }
 #endif
+
+static void queue_save(struct queue_t *q, struct snap *s,
+		       int (*put)(struct snap *, struct pcb_t *))
+{
+	int i;
+
+	snap_put_u32(s, q->size);
+	for (i = 0; i < q->size; i++)
+		put(s, q->proc[i]);
+}
+
+static int queue_restore(struct queue_t *q, struct snap *s,
+			 struct pcb_t *(*get)(struct snap *, void *), void *arg)
+{
+	struct pcb_t *proc;
+	uint32_t n = snap_get_u32(s);
+
+	if (n > MAX_QUEUE_SIZE)
+		return -1;
+	for (q->size = 0; n > 0; n--) {
+		if ((proc = get(s, arg)) == NULL)
+			return -1;
+		enqueue(q, proc);
+	}
+	return 0;
+}
+
+/*
+ * Snapshots: the queues in order, each process written by put()
+ * where it is queued, and read back by get()
+ */
+int sched_save(struct snap *s, int (*put)(struct snap *, struct pcb_t *))
+{
+	pthread_mutex_lock(&queue_lock);
+#ifdef MLQ_SCHED
+	int i;
+
+	snap_put_u32(s, curr_prio);
+	snap_put_u32(s, curr_slot);
+	for (i = 0; i < MAX_PRIO; i++)
+		queue_save(&mlq_ready_queue[i], s, put);
+#endif
+	queue_save(&ready_queue, s, put);
+	queue_save(&run_queue, s, put);
+	pthread_mutex_unlock(&queue_lock);
+	return 0;
+}
+
+int sched_restore(struct snap *s,
+		  struct pcb_t *(*get)(struct snap *, void *), void *arg)
+{
+	int err = 0;
+
+	pthread_mutex_lock(&queue_lock);
+#ifdef MLQ_SCHED
+	int i;
+
+	curr_prio = snap_get_u32(s);
+	curr_slot = snap_get_u32(s);
+	if (curr_prio < 0 || curr_prio >= MAX_PRIO)
+		err = -1;
+	for (i = 0; i < MAX_PRIO && !err; i++)
+		err = queue_restore(&mlq_ready_queue[i], s, get, arg);
+#endif
+	if (!err)
+		err = queue_restore(&ready_queue, s, get, arg);
+	if (!err)
+		err = queue_restore(&run_queue, s, get, arg);
+	pthread_mutex_unlock(&queue_lock);
+	return err;
+}
@@ -0,0 +1,257 @@
+/*
+ * Simulator snapshots
+ * Records are buffered in memory and written after the arrays, which
+ * go to the file as they come. The file is built as <path>.tmp and
+ * renamed when complete: a failed checkpoint never leaves a truncated
+ * snapshot behind.
+ */
+
+#include "snapshot.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct snap {
+	int fd;
+	int err;       /* a record or array failed, sticky */
+	char * path;   /* writing: final and temporary name */
+	char * tmp;
+	char * meta;   /* record stream */
+	size_t len;
+	size_t cap;
+	size_t pos;    /* reading: next record */
+	uint64_t end;  /* end of the last array, or of the file */
+};
+
+static int snap_pwrite(int fd, const void * buf, size_t len, uint64_t off) {
+	const char * p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(fd, p, len, off);
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+static int snap_pread(int fd, void * buf, size_t len, uint64_t off) {
+	char * p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = pread(fd, p, len, off);
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+static uint64_t snap_align(uint64_t off) {
+	return (off + SNAP_ALIGN - 1) / SNAP_ALIGN * SNAP_ALIGN;
+}
+
+struct snap * snap_create(const char * path) {
+	struct snap * s = calloc(1, sizeof(struct snap));
+
+	s->path = strdup(path);
+	s->tmp = malloc(strlen(path) + 5);
+	sprintf(s->tmp, "%s.tmp", path);
+	s->fd = open(s->tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (s->fd < 0) {
+		perror(s->tmp);
+		free(s->tmp);
+		free(s->path);
+		free(s);
+		return NULL;
+	}
+	s->end = SNAP_ALIGN; /* the header */
+	return s;
+}
+
+int snap_commit(struct snap * s, uint64_t time) {
+	struct snap_hdr hdr;
+	int err = s->err;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+	hdr.version = SNAP_VERSION;
+	hdr.byteorder = SNAP_BYTEORDER;
+	hdr.time = time;
+	hdr.meta_off = snap_align(s->end);
+	hdr.meta_len = s->len;
+
+	if (!err)
+		err = snap_pwrite(s->fd, s->meta, s->len, hdr.meta_off) < 0 ||
+			snap_pwrite(s->fd, &hdr, sizeof(hdr), 0) < 0;
+	err |= close(s->fd) < 0;
+	if (!err)
+		err = rename(s->tmp, s->path) < 0;
+	if (err) {
+		perror(s->path);
+		unlink(s->tmp);
+	}
+
+	free(s->meta);
+	free(s->tmp);
+	free(s->path);
+	free(s);
+	return err ? -1 : 0;
+}
+
+struct snap * snap_open(const char * path, uint64_t * time) {
+	struct snap * s = calloc(1, sizeof(struct snap));
+	struct snap_hdr hdr;
+	struct stat st;
+
+	s->fd = open(path, O_RDONLY);
+	if (s->fd < 0) {
+		perror(path);
+		free(s);
+		return NULL;
+	}
+	if (fstat(s->fd, &st) < 0 ||
+	    snap_pread(s->fd, &hdr, sizeof(hdr), 0) < 0 ||
+	    memcmp(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.byteorder != SNAP_BYTEORDER) {
+		printf("%s is not a snapshot\n", path);
+		goto fail;
+	}
+	if (hdr.version != SNAP_VERSION) {
+		printf("Snapshot %s has version %u, this build reads %u\n",
+			path, hdr.version, SNAP_VERSION);
+		goto fail;
+	}
+	if (hdr.meta_off + hdr.meta_len > (uint64_t)st.st_size) {
+		printf("Snapshot %s is truncated\n", path);
+		goto fail;
+	}
+
+	s->end = st.st_size;
+	s->len = hdr.meta_len;
+	s->meta = malloc(s->len);
+	if (snap_pread(s->fd, s->meta, s->len, hdr.meta_off) < 0) {
+		perror(path);
+		free(s->meta);
+		goto fail;
+	}
+	*time = hdr.time;
+	return s;
+
+fail:
+	close(s->fd);
+	free(s);
+	return NULL;
+}
+
+/* Done reading. Return -1 if records were missing or left over, i.e.
+ * the snapshot does not match what the reader expected */
+int snap_close(struct snap * s) {
+	int err = s->err || s->pos != s->len;
+
+	close(s->fd); /* mapped arrays stay */
+	free(s->meta);
+	free(s);
+	return err ? -1 : 0;
+}
+
+int snap_put(struct snap * s, const void * buf, size_t len) {
+	if (s->len + len > s->cap) {
+		s->cap = 2 * (s->len + len);
+		s->meta = realloc(s->meta, s->cap);
+	}
+	memcpy(s->meta + s->len, buf, len);
+	s->len += len;
+	return 0;
+}
+
+/* A missing record reads as zeros and fails the snapshot */
+int snap_get(struct snap * s, void * buf, size_t len) {
+	if (s->err || len > s->len - s->pos) {
+		s->err = 1;
+		memset(buf, 0, len);
+		return -1;
+	}
+	memcpy(buf, s->meta + s->pos, len);
+	s->pos += len;
+	return 0;
+}
+
+int snap_put_u32(struct snap * s, uint32_t v) {
+	return snap_put(s, &v, sizeof(v));
+}
+
+uint32_t snap_get_u32(struct snap * s) {
+	uint32_t v;
+
+	snap_get(s, &v, sizeof(v));
+	return v;
+}
+
+int snap_put_u64(struct snap * s, uint64_t v) {
+	return snap_put(s, &v, sizeof(v));
+}
+
+uint64_t snap_get_u64(struct snap * s) {
+	uint64_t v;
+
+	snap_get(s, &v, sizeof(v));
+	return v;
+}
+
+/* A large array, written at once at the next aligned file offset */
+int snap_put_array(struct snap * s, const void * buf, size_t len) {
+	uint64_t off = snap_align(s->end);
+
+	snap_put_u64(s, off);
+	snap_put_u64(s, len);
+	if (len > 0 && snap_pwrite(s->fd, buf, len, off) < 0) {
+		s->err = 1;
+		return -1;
+	}
+	s->end = off + len;
+	return 0;
+}
+
+/*
+ * An array of len bytes written by snap_put_array(), NULL if empty or
+ * the snapshot is bad. It is mapped private: writes do not reach the
+ * file, pages are only read in when touched. The mapping is never
+ * released, callers must not free it.
+ */
+void * snap_map_array(struct snap * s, size_t len) {
+	uint64_t off = snap_get_u64(s);
+	uint64_t n = snap_get_u64(s);
+	void * p;
+
+	if (s->err || n != len || off + len > s->end) {
+		s->err = 1;
+		return NULL;
+	}
+	if (len == 0)
+		return NULL;
+
+	if (off % sysconf(_SC_PAGESIZE) == 0) {
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, s->fd, off);
+		if (p != MAP_FAILED)
+			return p;
+	}
+	/* Host pages larger than SNAP_ALIGN: copy it */
+	p = malloc(len);
+	if (snap_pread(s->fd, p, len, off) < 0) {
+		free(p);
+		s->err = 1;
+		return NULL;
+	}
+	return p;
+}
@@ -17,9 +17,13 @@ static uint64_t _time;
 static int timer_started = 0;
 static int timer_stop = 0;
 
+/* Called between two slots, see timer_at() */
+static uint64_t timer_hook_slot;
+static void (*timer_hook)(void);
+
 
 static void * timer_routine(void * args) {
-	while (!timer_stop) {
+	while (!__atomic_load_n(&timer_stop, __ATOMIC_ACQUIRE)) {
 		printf("Time slot %3lu\n", current_time());
 		int fsh = 0;
 		int event = 0;
@@ -43,6 +47,8 @@ static void * timer_routine(void * args) {
 
 		/* Increase the time slot */
 		_time++;
+		if (timer_hook != NULL && _time == timer_hook_slot)
+			timer_hook();
 		
 		/* Let devices continue their job */
 		for (temp = dev_list; temp != NULL; temp = temp->next) {
@@ -80,6 +86,18 @@ uint64_t current_time() {
 	return _time;
 }
 
+/* Start counting from time instead of 0, before start_timer() */
+void timer_set_time(uint64_t time) {
+	_time = time;
+}
+
+/* Run hook at the start of slot time, before start_timer(). Every
+ * device waits for the slot meanwhile: nothing else is running */
+void timer_at(uint64_t time, void (*hook)(void)) {
+	timer_hook_slot = time;
+	timer_hook = hook;
+}
+
 void start_timer() {
 	timer_started = 1;
 	pthread_create(&_timer, NULL, timer_routine, NULL);
@@ -118,7 +136,7 @@ struct timer_id_t * attach_event() {
 }
 
 void stop_timer() {
-	timer_stop = 1;
+	__atomic_store_n(&timer_stop, 1, __ATOMIC_RELEASE);
 	pthread_join(_timer, NULL);
 	while (dev_list != NULL) {
 		struct timer_id_container_t * temp = dev_list;
@@ -0,0 +1,101 @@
+/*
+ * Memory access tracer
+ * Records go to a buffer of the calling thread and reach the trace
+ * file only when the buffer fills up, or at trace_close().
+ */
+
+#include "trace.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct trace_buf {
+	int nrec;
+	struct trace_buf * next;
+	struct trace_rec rec[TRACE_BUFSZ];
+};
+
+int trace_enabled = 0;
+
+static FILE * trace_file;
+static uint64_t (*trace_clock)(void);
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_buf * trace_bufs; /* buffers of all threads */
+
+static __thread struct trace_buf * trace_tbuf;
+static __thread int trace_cpu = -1;
+
+static void trace_flush(struct trace_buf * buf) {
+	fwrite(buf->rec, sizeof(struct trace_rec), buf->nrec, trace_file);
+	buf->nrec = 0;
+}
+
+int trace_open(const char * path, uint64_t (*clock)(void)) {
+	trace_file = fopen(path, "wb");
+	if (trace_file == NULL) {
+		perror(path);
+		return -1;
+	}
+	fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), trace_file);
+	trace_clock = clock;
+	trace_enabled = 1;
+	return 0;
+}
+
+int trace_close() {
+	struct trace_buf * buf;
+
+	if (trace_file == NULL)
+		return -1;
+
+	trace_enabled = 0;
+	pthread_mutex_lock(&trace_lock);
+	while (trace_bufs != NULL) {
+		buf = trace_bufs;
+		trace_bufs = buf->next;
+		trace_flush(buf);
+		free(buf);
+	}
+	fclose(trace_file);
+	trace_file = NULL;
+	pthread_mutex_unlock(&trace_lock);
+	return 0;
+}
+
+/* The CPU the calling thread simulates, recorded with its accesses */
+void trace_set_cpu(int cpu) {
+	trace_cpu = cpu;
+}
+
+void trace_emit(uint32_t pid, int op, uint32_t vaddr, int hit, int fpn) {
+	struct trace_buf * buf = trace_tbuf;
+	struct trace_rec * rec;
+
+	if (buf == NULL) {
+		buf = calloc(1, sizeof(struct trace_buf));
+		pthread_mutex_lock(&trace_lock);
+		buf->next = trace_bufs;
+		trace_bufs = buf;
+		pthread_mutex_unlock(&trace_lock);
+		trace_tbuf = buf;
+	}
+
+	rec = &buf->rec[buf->nrec++];
+	rec->time = trace_clock ? trace_clock() : 0;
+	rec->pid = pid;
+	rec->vaddr = vaddr;
+	rec->fpn = fpn;
+	rec->cpu = trace_cpu;
+	rec->op = op;
+	rec->hit = hit;
+	rec->pad = 0;
+
+	if (buf->nrec == TRACE_BUFSZ) {
+		pthread_mutex_lock(&trace_lock);
+		if (trace_file != NULL)
+			trace_flush(buf);
+		buf->nrec = 0;
+		pthread_mutex_unlock(&trace_lock);
+	}
+}